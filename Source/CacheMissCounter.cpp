@@ -0,0 +1,43 @@
+// The perf interface behind CacheMissCounter, kept out of the header so its system headers don't reach every file.
+#include "RaytracerCore.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace VRaytracer
+{
+    CacheMissCounter::CacheMissCounter()
+    {
+#if defined(__linux__)
+        perf_event_attr attributes;
+        std::memset(&attributes, 0, sizeof(attributes));
+        attributes.size           = sizeof(attributes);
+        attributes.type           = PERF_TYPE_HARDWARE;
+        attributes.config         = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv     = 1;
+        m_FileDescriptor          = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+    }
+
+    CacheMissCounter::~CacheMissCounter()
+    {
+#if defined(__linux__)
+        if (m_FileDescriptor >= 0)
+            close(m_FileDescriptor);
+#endif
+    }
+
+    uint64_t CacheMissCounter::Read() const
+    {
+        uint64_t count = 0;
+#if defined(__linux__)
+        if (m_FileDescriptor >= 0 && read(m_FileDescriptor, &count, sizeof(count)) != sizeof(count))
+            count = 0;
+#endif
+        return count;
+    }
+} // namespace VRaytracer
@@ -2,8 +2,10 @@
 
 #include "FileSystem.h"
 #include "Macro.h"
+#include "RaytracerCore.h"
 
 #include <cereal/archives/json.hpp>
+#include <cereal/types/string.hpp>
 #include <cereal/types/vector.hpp>
 
 namespace VRaytracer
@@ -47,13 +49,24 @@ namespace VRaytracer
 
     struct QualityConfiguration
     {
-        uint32_t SamplesPerPixel = 10;
-        uint32_t MaxDepth        = 4;
+        uint32_t    SamplesPerPixel = 10;
+        uint32_t    MaxDepth        = 4;
+        uint32_t    MinDepth        = 3;            // Bounces before Russian roulette may end a path
+        std::string Sampler         = "Sobol";      // One of SamplerTypeNames
+        std::string Integrator      = "DepthFirst"; // One of IntegratorTypeNames
+        bool        SortRays        = true;         // Wavefront only, see RenderQualityConfiguration
+        double      ErrorThreshold  = 0;            // Adaptive sampling, 0 samples every pixel SamplesPerPixel times
 
         template<class Archive>
         void serialize(Archive& archive)
         {
-            archive(CEREAL_NVP(SamplesPerPixel), CEREAL_NVP(MaxDepth));
+            archive(CEREAL_NVP(SamplesPerPixel),
+                    CEREAL_NVP(MaxDepth),
+                    CEREAL_NVP(MinDepth),
+                    CEREAL_NVP(Sampler),
+                    CEREAL_NVP(Integrator),
+                    CEREAL_NVP(SortRays),
+                    CEREAL_NVP(ErrorThreshold));
         }
     };
 
@@ -62,20 +75,90 @@ namespace VRaytracer
         CameraConfiguration  CameraConfig;
         QualityConfiguration QualityConfig;
         ColorInfo            BackgroundColor;
+        std::string          EnvironmentMap; // HDR image relative to Resources, replaces BackgroundColor if not empty
 
         template<class Archive>
         void save(Archive& archive) const
         {
-            archive(CEREAL_NVP(CameraConfig), CEREAL_NVP(QualityConfig), CEREAL_NVP(BackgroundColor));
+            archive(CEREAL_NVP(CameraConfig),
+                    CEREAL_NVP(QualityConfig),
+                    CEREAL_NVP(BackgroundColor),
+                    CEREAL_NVP(EnvironmentMap));
         }
 
         template<class Archive>
         void load(Archive& archive)
         {
-            archive(CEREAL_NVP(CameraConfig), CEREAL_NVP(QualityConfig), CEREAL_NVP(BackgroundColor));
+            archive(CEREAL_NVP(CameraConfig),
+                    CEREAL_NVP(QualityConfig),
+                    CEREAL_NVP(BackgroundColor),
+                    CEREAL_NVP(EnvironmentMap));
         }
     };
 
+    // Conversions to the render-side types. Vector3 may be padded for SIMD, so the layouts are not interchangeable.
+
+    inline Vector3 ToVector3(const Vector3Info& info)
+    {
+        return Vector3(static_cast<Real>(info.X), static_cast<Real>(info.Y), static_cast<Real>(info.Z));
+    }
+
+    inline RenderCameraConfiguration ToRenderConfig(const CameraConfiguration& config)
+    {
+        RenderCameraConfiguration renderConfig;
+        renderConfig.LookFrom        = ToVector3(config.LookFrom);
+        renderConfig.LookAt          = ToVector3(config.LookAt);
+        renderConfig.ViewUp          = ToVector3(config.ViewUp);
+        renderConfig.DistanceToFocus = static_cast<Real>(config.DistanceToFocus);
+        renderConfig.Aperture        = static_cast<Real>(config.Aperture);
+        renderConfig.FOV             = static_cast<Real>(config.FOV);
+        return renderConfig;
+    }
+
+    // Relative environment map paths are resolved against the Resources directory, absolute ones are kept.
+    inline std::string ToEnvironmentMapPath(const std::string& environmentMap)
+    {
+        if (environmentMap.empty())
+            return environmentMap;
+
+        return FileSystem::GetExecutableRelativeDirectory(std::filesystem::path("Resources") / environmentMap).string();
+    }
+
+    inline RenderQualityConfiguration ToRenderConfig(const QualityConfiguration& config)
+    {
+        RenderQualityConfiguration renderConfig;
+        renderConfig.SamplesPerPixel = config.SamplesPerPixel;
+        renderConfig.MaxDepth        = config.MaxDepth;
+        renderConfig.MinDepth        = config.MinDepth;
+        renderConfig.SortRays        = config.SortRays;
+        renderConfig.ErrorThreshold  = static_cast<Real>(config.ErrorThreshold);
+
+        auto nameIt = std::find(std::begin(SamplerTypeNames), std::end(SamplerTypeNames), config.Sampler);
+        if (nameIt != std::end(SamplerTypeNames))
+        {
+            renderConfig.Sampler = static_cast<SamplerType>(nameIt - std::begin(SamplerTypeNames));
+        }
+        else
+        {
+            VRT_WARN("Unknown sampler {0}, using {1}", config.Sampler, SamplerTypeNames[(int)renderConfig.Sampler]);
+        }
+
+        auto integratorIt =
+            std::find(std::begin(IntegratorTypeNames), std::end(IntegratorTypeNames), config.Integrator);
+        if (integratorIt != std::end(IntegratorTypeNames))
+        {
+            renderConfig.Integrator = static_cast<IntegratorType>(integratorIt - std::begin(IntegratorTypeNames));
+        }
+        else
+        {
+            VRT_WARN("Unknown integrator {0}, using {1}",
+                     config.Integrator,
+                     IntegratorTypeNames[(int)renderConfig.Integrator]);
+        }
+
+        return renderConfig;
+    }
+
     class ConfigLoader
     {
     public:
@@ -3,46 +3,190 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <limits>
 #include <memory>
 #include <mutex>
+#include <numeric>
 #include <queue>
 #include <stdexcept>
+#include <string>
 #include <thread>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
 #include <vector>
 
+#include <stb_image.h>
+
+#if defined(VRT_SIMD_AVX2) || defined(VRT_SIMD_SSE4)
+#include <immintrin.h>
+#elif defined(VRT_SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace VRaytracer
 {
+    // Precision
+    //
+    // The core is written against Real, which is float when VRT_USE_FLOAT is defined (VRT_PRECISION in CMake) and
+    // double otherwise.
+
+#ifdef VRT_USE_FLOAT
+    using Real = float;
+#else
+    using Real = double;
+#endif
+
     // Constants
 
-    const double Infinity = std::numeric_limits<double>::infinity();
-    const double Pi       = 3.1415926535897932385;
+    const Real Infinity        = std::numeric_limits<Real>::infinity();
+    const Real Pi              = 3.1415926535897932385;
+    const Real MachineEpsilon  = std::numeric_limits<Real>::epsilon() * 0.5;
+    const Real OneMinusEpsilon = 1 - MachineEpsilon; // Largest Real below one
+
+    // Random Number Generation
+
+    // 64-bit finalizer (MurmurHash3 fmix64 variant), turns structured inputs like pixel indices into well spread seeds.
+    inline uint64_t MixBits(uint64_t v)
+    {
+        v ^= (v >> 31);
+        v *= 0x7fb5d329728ea185ull;
+        v ^= (v >> 27);
+        v *= 0x81dadef4bc2dd44dull;
+        v ^= (v >> 33);
+        return v;
+    }
+
+    /*
+     * PCG32 random number generator (pcg-random.org): 64 bits of state, a selectable stream and 32-bit outputs.
+     * Every thread owns one (see GetThreadRNG), and the renderer reseeds it per pixel so images are reproducible no
+     * matter which worker renders which tile.
+     */
+    class PCG32
+    {
+    public:
+        PCG32() : m_State(DefaultState), m_Increment(DefaultStream) {}
+        PCG32(uint64_t sequenceIndex, uint64_t offset) { SetSequence(sequenceIndex, offset); }
+        explicit PCG32(uint64_t sequenceIndex) { SetSequence(sequenceIndex); }
+
+        // Selects the stream and the starting position in it.
+        void SetSequence(uint64_t sequenceIndex, uint64_t offset)
+        {
+            m_State     = 0u;
+            m_Increment = (sequenceIndex << 1u) | 1u;
+            NextUInt();
+            m_State += offset;
+            NextUInt();
+        }
+
+        void SetSequence(uint64_t sequenceIndex) { SetSequence(sequenceIndex, MixBits(sequenceIndex)); }
+
+        uint32_t NextUInt()
+        {
+            uint64_t oldState   = m_State;
+            m_State             = oldState * Multiplier + m_Increment;
+            uint32_t xorShifted = static_cast<uint32_t>(((oldState >> 18u) ^ oldState) >> 27u);
+            uint32_t rotation   = static_cast<uint32_t>(oldState >> 59u);
+            return (xorShifted >> rotation) | (xorShifted << ((~rotation + 1u) & 31));
+        }
+
+        // Skips delta outputs in O(log delta), so streams can be positioned without drawing from them.
+        void Advance(uint64_t delta)
+        {
+            uint64_t multiplier            = Multiplier;
+            uint64_t increment             = m_Increment;
+            uint64_t accumulatedMultiplier = 1u;
+            uint64_t accumulatedIncrement  = 0u;
+            while (delta > 0)
+            {
+                if (delta & 1)
+                {
+                    accumulatedMultiplier *= multiplier;
+                    accumulatedIncrement = accumulatedIncrement * multiplier + increment;
+                }
+                increment = (multiplier + 1) * increment;
+                multiplier *= multiplier;
+                delta /= 2;
+            }
+            m_State = accumulatedMultiplier * m_State + accumulatedIncrement;
+        }
+
+        // Returns a random real in [0, 1), the product can round up to one in single precision.
+        Real NextReal() { return std::min(static_cast<Real>(NextUInt() * 0x1p-32), OneMinusEpsilon); }
+
+    private:
+        static constexpr uint64_t DefaultState  = 0x853c49e6748fea9bull;
+        static constexpr uint64_t DefaultStream = 0xda3e39cb94b95bdbull;
+        static constexpr uint64_t Multiplier    = 0x5851f42d4c957f2dull;
+
+        uint64_t m_State;
+        uint64_t m_Increment;
+    };
+
+    // The generator of the calling thread. Workers never share state, so sampling needs no synchronization.
+    inline PCG32& GetThreadRNG()
+    {
+        static thread_local PCG32 rng;
+        return rng;
+    }
 
     // Utility Functions
 
-    inline double Degrees2Radians(double degrees) { return degrees * Pi / 180.0; }
+    inline Real Degrees2Radians(Real degrees) { return degrees * Pi / 180.0; }
 
-    inline double GetRandomDouble()
+    inline Real GetRandomReal()
     {
         // Returns a random real in [0, 1).
-        return rand() / (RAND_MAX + 1.0);
+        return GetThreadRNG().NextReal();
     }
 
-    inline double GetRandomDouble(double min, double max)
+    inline Real GetRandomReal(Real min, Real max)
     {
         // Returns a random real in [min, max).
-        return min + (max - min) * GetRandomDouble();
+        return min + (max - min) * GetRandomReal();
+    }
+
+    inline int GetRandomInt(int min, int max) { return static_cast<int>(GetRandomReal(min, max + 1)); }
+
+    // Conservative bound on the relative rounding error of n consecutive floating-point operations.
+    inline Real Gamma(int n) { return (n * MachineEpsilon) / (1 - n * MachineEpsilon); }
+
+    // Step to the adjacent representable value by working on the bit pattern, std::nextafter is far slower.
+
+#ifdef VRT_USE_FLOAT
+    using RealBits = uint32_t;
+#else
+    using RealBits = uint64_t;
+#endif
+
+    inline Real NextRealUp(Real v)
+    {
+        if (std::isinf(v) && v > 0)
+            return v;
+        if (v == 0)
+            v = 0; // Turn -0 into +0
+
+        RealBits bits;
+        std::memcpy(&bits, &v, sizeof(Real));
+        bits = v >= 0 ? bits + 1 : bits - 1;
+        std::memcpy(&v, &bits, sizeof(Real));
+        return v;
     }
 
-    inline int GetRandomInt(int min, int max) { return static_cast<int>(GetRandomDouble(min, max + 1)); }
+    inline Real NextRealDown(Real v) { return -NextRealUp(-v); }
 
-    inline double Clamp(double x, double min, double max)
+    inline Real Clamp(Real x, Real min, Real max)
     {
         if (x < min)
             return min;
@@ -51,56 +195,572 @@ namespace VRaytracer
         return x;
     }
 
-    class Vector3
+    // Memory Arena
+
+    /*
+     * A bump allocator for objects that live exactly as long as a scene. Allocations are carved out of large blocks
+     * one after another, so objects built together end up next to each other, and the blocks are only released as a
+     * whole when the arena is destroyed. Not thread-safe, scenes are built on a single thread.
+     */
+    class MemoryArena
+    {
+    public:
+        struct Stats
+        {
+            size_t BytesUsed       = 0; // Handed out to allocations, including alignment padding
+            size_t BytesReserved   = 0; // Held in blocks
+            size_t BlockCount      = 0;
+            size_t AllocationCount = 0;
+        };
+
+        // Standard allocator interface over an arena, deallocation is a no-op.
+        template<typename T>
+        struct Allocator
+        {
+            using value_type = T;
+
+            explicit Allocator(MemoryArena* arena) : Arena(arena) {}
+
+            template<typename U>
+            Allocator(const Allocator<U>& other) : Arena(other.Arena)
+            {}
+
+            T*   allocate(size_t n) { return static_cast<T*>(Arena->Allocate(n * sizeof(T), alignof(T))); }
+            void deallocate(T* pointer, size_t n) {}
+
+            template<typename U>
+            bool operator==(const Allocator<U>& other) const
+            {
+                return Arena == other.Arena;
+            }
+
+            template<typename U>
+            bool operator!=(const Allocator<U>& other) const
+            {
+                return Arena != other.Arena;
+            }
+
+            MemoryArena* Arena;
+        };
+
+        explicit MemoryArena(size_t blockSize = 256 * 1024) : m_BlockSize(blockSize) {}
+        MemoryArena(const MemoryArena&)            = delete;
+        MemoryArena& operator=(const MemoryArena&) = delete;
+
+        void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+        {
+            uintptr_t aligned = (m_Current + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+            if (m_Blocks.empty() || aligned + size > m_End)
+            {
+                // Requests larger than a block get a block of their own.
+                size_t blockSize = std::max(m_BlockSize, size + alignment);
+                m_Blocks.emplace_back(new uint8_t[blockSize]);
+                m_Current = reinterpret_cast<uintptr_t>(m_Blocks.back().get());
+                m_End     = m_Current + blockSize;
+                aligned   = (m_Current + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+
+                m_Stats.BytesReserved += blockSize;
+                m_Stats.BlockCount++;
+            }
+
+            m_Stats.BytesUsed += aligned + size - m_Current;
+            m_Stats.AllocationCount++;
+            m_Current = aligned + size;
+            return reinterpret_cast<void*>(aligned);
+        }
+
+        // Like std::make_shared, with the object and its control block placed in the arena. The destructor still runs
+        // when the last reference goes away, only the memory waits for the arena, which must outlive every reference.
+        template<typename T, typename... Args>
+        std::shared_ptr<T> MakeShared(Args&&... args)
+        {
+            return std::allocate_shared<T>(Allocator<T>(this), std::forward<Args>(args)...);
+        }
+
+        const Stats& GetStats() const { return m_Stats; }
+
+    private:
+        std::vector<std::unique_ptr<uint8_t[]>> m_Blocks;
+        size_t                                  m_BlockSize;
+        uintptr_t                               m_Current = 0;
+        uintptr_t                               m_End     = 0;
+        Stats                                   m_Stats;
+    };
+
+    /*
+     * A fixed-size array copied into an arena. The elements are never destroyed, the arena releases their memory
+     * with its blocks, so they must not own anything. Copies share the elements.
+     */
+    template<typename T>
+    class ArenaArray
+    {
+    public:
+        ArenaArray() {}
+        ArenaArray(MemoryArena& arena, const std::vector<T>& elements) : m_Size(elements.size())
+        {
+            if (elements.empty())
+                return;
+
+            m_Data = static_cast<T*>(arena.Allocate(m_Size * sizeof(T), alignof(T)));
+            std::uninitialized_copy(elements.begin(), elements.end(), m_Data);
+        }
+
+        const T& operator[](size_t index) const { return m_Data[index]; }
+        const T* begin() const { return m_Data; }
+        const T* end() const { return m_Data + m_Size; }
+        size_t   size() const { return m_Size; }
+        bool     empty() const { return m_Size == 0; }
+
+    private:
+        T*     m_Data = nullptr;
+        size_t m_Size = 0;
+    };
+
+    // SIMD Backend
+    //
+    // The backend is selected at configure time (VRT_SIMD in CMake). All backends store a Vector3 as 4 aligned
+    // lanes, the 4th lane is padding and always kept at zero so it never leaks into dot products. Double precision
+    // needs two 128-bit registers per vector on SSE4 and NEON, float precision fits a single one on every backend.
+
+#if defined(VRT_SIMD_NEON) && !defined(__aarch64__)
+#undef VRT_SIMD_NEON // The NEON backend relies on AArch64-only intrinsics
+#endif
+
+#if defined(VRT_SIMD_AVX2) || defined(VRT_SIMD_SSE4) || defined(VRT_SIMD_NEON)
+#define VRT_SIMD_ENABLED
+#endif
+
+    namespace Simd
+    {
+#if defined(VRT_USE_FLOAT) && (defined(VRT_SIMD_AVX2) || defined(VRT_SIMD_SSE4))
+        // A single 128-bit register holds (x, y, z, w), AVX2 only adds wider registers that Vector3 can't use.
+        using Register = __m128;
+
+        constexpr size_t Alignment = 16;
+
+        inline Register Load(const Real* p) { return _mm_load_ps(p); }
+        inline void     Store(Real* p, Register a) { _mm_store_ps(p, a); }
+        inline Register Broadcast3(Real t) { return _mm_setr_ps(t, t, t, 0.0f); }
+        inline Register Add(Register a, Register b) { return _mm_add_ps(a, b); }
+        inline Register Sub(Register a, Register b) { return _mm_sub_ps(a, b); }
+        inline Register Mul(Register a, Register b) { return _mm_mul_ps(a, b); }
+        inline Register Min(Register a, Register b) { return _mm_min_ps(a, b); }
+        inline Register Max(Register a, Register b) { return _mm_max_ps(a, b); }
+        inline Register Negate(Register a) { return _mm_sub_ps(_mm_setzero_ps(), a); }
+
+        // (x, y, z, w) -> (y, z, x, w)
+        inline Register ShuffleYZX(Register a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+
+        inline Real HorizontalSum(Register a)
+        {
+            __m128 shuffled = _mm_movehdup_ps(a);
+            __m128 sum      = _mm_add_ps(a, shuffled);
+            return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(shuffled, sum)));
+        }
+#elif defined(VRT_USE_FLOAT) && defined(VRT_SIMD_NEON)
+        using Register = float32x4_t;
+
+        constexpr size_t Alignment = 16;
+
+        inline Register Load(const Real* p) { return vld1q_f32(p); }
+        inline void     Store(Real* p, Register a) { vst1q_f32(p, a); }
+        inline Register Broadcast3(Real t) { return vsetq_lane_f32(0.0f, vdupq_n_f32(t), 3); }
+        inline Register Add(Register a, Register b) { return vaddq_f32(a, b); }
+        inline Register Sub(Register a, Register b) { return vsubq_f32(a, b); }
+        inline Register Mul(Register a, Register b) { return vmulq_f32(a, b); }
+        inline Register Min(Register a, Register b) { return vminq_f32(a, b); }
+        inline Register Max(Register a, Register b) { return vmaxq_f32(a, b); }
+        inline Register Negate(Register a) { return vnegq_f32(a); }
+
+        // (x, y, z, w) -> (y, z, x, w)
+        inline Register ShuffleYZX(Register a)
+        {
+            Register rotated = vextq_f32(a, a, 1); // (y, z, w, x)
+            return vcopyq_laneq_f32(vcopyq_laneq_f32(rotated, 2, a, 0), 3, a, 3);
+        }
+
+        inline Real HorizontalSum(Register a) { return vaddvq_f32(a); }
+#elif defined(VRT_SIMD_AVX2)
+        using Register = __m256d;
+
+        constexpr size_t Alignment = 32;
+
+        inline Register Load(const Real* p) { return _mm256_load_pd(p); }
+        inline void     Store(Real* p, Register a) { _mm256_store_pd(p, a); }
+        inline Register Broadcast3(Real t) { return _mm256_setr_pd(t, t, t, 0.0); }
+        inline Register Add(Register a, Register b) { return _mm256_add_pd(a, b); }
+        inline Register Sub(Register a, Register b) { return _mm256_sub_pd(a, b); }
+        inline Register Mul(Register a, Register b) { return _mm256_mul_pd(a, b); }
+        inline Register Min(Register a, Register b) { return _mm256_min_pd(a, b); }
+        inline Register Max(Register a, Register b) { return _mm256_max_pd(a, b); }
+        inline Register Negate(Register a) { return _mm256_sub_pd(_mm256_setzero_pd(), a); }
+
+        // (x, y, z, w) -> (y, z, x, w)
+        inline Register ShuffleYZX(Register a) { return _mm256_permute4x64_pd(a, _MM_SHUFFLE(3, 0, 2, 1)); }
+
+        inline Real HorizontalSum(Register a)
+        {
+            __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+            return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+        }
+#elif defined(VRT_SIMD_SSE4)
+        // Two 128-bit registers hold (x, y) and (z, w).
+        struct Register
+        {
+            __m128d XY;
+            __m128d ZW;
+        };
+
+        constexpr size_t Alignment = 16;
+
+        inline Register Load(const Real* p) { return {_mm_load_pd(p), _mm_load_pd(p + 2)}; }
+        inline void     Store(Real* p, Register a)
+        {
+            _mm_store_pd(p, a.XY);
+            _mm_store_pd(p + 2, a.ZW);
+        }
+        inline Register Broadcast3(Real t) { return {_mm_set1_pd(t), _mm_set_sd(t)}; }
+        inline Register Add(Register a, Register b) { return {_mm_add_pd(a.XY, b.XY), _mm_add_pd(a.ZW, b.ZW)}; }
+        inline Register Sub(Register a, Register b) { return {_mm_sub_pd(a.XY, b.XY), _mm_sub_pd(a.ZW, b.ZW)}; }
+        inline Register Mul(Register a, Register b) { return {_mm_mul_pd(a.XY, b.XY), _mm_mul_pd(a.ZW, b.ZW)}; }
+        inline Register Min(Register a, Register b) { return {_mm_min_pd(a.XY, b.XY), _mm_min_pd(a.ZW, b.ZW)}; }
+        inline Register Max(Register a, Register b) { return {_mm_max_pd(a.XY, b.XY), _mm_max_pd(a.ZW, b.ZW)}; }
+        inline Register Negate(Register a) { return Sub({_mm_setzero_pd(), _mm_setzero_pd()}, a); }
+
+        // (x, y, z, w) -> (y, z, x, w)
+        inline Register ShuffleYZX(Register a)
+        {
+            return {_mm_shuffle_pd(a.XY, a.ZW, _MM_SHUFFLE2(0, 1)), _mm_shuffle_pd(a.XY, a.ZW, _MM_SHUFFLE2(1, 0))};
+        }
+
+        inline Real HorizontalSum(Register a)
+        {
+            __m128d sum = _mm_add_pd(a.XY, a.ZW);
+            return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+        }
+#elif defined(VRT_SIMD_NEON)
+        // Two 128-bit registers hold (x, y) and (z, w).
+        struct Register
+        {
+            float64x2_t XY;
+            float64x2_t ZW;
+        };
+
+        constexpr size_t Alignment = 16;
+
+        inline Register Load(const Real* p) { return {vld1q_f64(p), vld1q_f64(p + 2)}; }
+        inline void     Store(Real* p, Register a)
+        {
+            vst1q_f64(p, a.XY);
+            vst1q_f64(p + 2, a.ZW);
+        }
+        inline Register Broadcast3(Real t) { return {vdupq_n_f64(t), vsetq_lane_f64(t, vdupq_n_f64(0.0), 0)}; }
+        inline Register Add(Register a, Register b) { return {vaddq_f64(a.XY, b.XY), vaddq_f64(a.ZW, b.ZW)}; }
+        inline Register Sub(Register a, Register b) { return {vsubq_f64(a.XY, b.XY), vsubq_f64(a.ZW, b.ZW)}; }
+        inline Register Mul(Register a, Register b) { return {vmulq_f64(a.XY, b.XY), vmulq_f64(a.ZW, b.ZW)}; }
+        inline Register Min(Register a, Register b) { return {vminq_f64(a.XY, b.XY), vminq_f64(a.ZW, b.ZW)}; }
+        inline Register Max(Register a, Register b) { return {vmaxq_f64(a.XY, b.XY), vmaxq_f64(a.ZW, b.ZW)}; }
+        inline Register Negate(Register a) { return {vnegq_f64(a.XY), vnegq_f64(a.ZW)}; }
+
+        // (x, y, z, w) -> (y, z, x, w)
+        inline Register ShuffleYZX(Register a)
+        {
+            return {vextq_f64(a.XY, a.ZW, 1), vcombine_f64(vget_low_f64(a.XY), vget_high_f64(a.ZW))};
+        }
+
+        inline Real HorizontalSum(Register a) { return vaddvq_f64(vaddq_f64(a.XY, a.ZW)); }
+#else
+        constexpr size_t Alignment = alignof(Real);
+#endif
+
+        /*
+         * Packets of independent values for structure-of-arrays kernels, one value per lane and as many lanes as the
+         * widest register of the backend holds. Comparisons return masks that only feed And, Or, Select and
+         * MoveMask. Without a SIMD backend a packet is a single Real.
+         *
+         * Load and Store are aligned. Kernels keep their arrays a multiple of Alignment bytes long, so aligning the
+         * first array of a structure of arrays aligns them all.
+         */
+        namespace Wide
+        {
+            constexpr size_t Alignment = 32;
+
+#if defined(VRT_USE_FLOAT) && defined(VRT_SIMD_AVX2)
+            using Register = __m256;
+            using Mask     = __m256;
+
+            constexpr int Width = 8;
+
+            inline Register Load(const Real* p) { return _mm256_load_ps(p); }
+            inline void     Store(Real* p, Register a) { _mm256_store_ps(p, a); }
+            inline Register Broadcast(Real t) { return _mm256_set1_ps(t); }
+            inline Register Add(Register a, Register b) { return _mm256_add_ps(a, b); }
+            inline Register Sub(Register a, Register b) { return _mm256_sub_ps(a, b); }
+            inline Register Mul(Register a, Register b) { return _mm256_mul_ps(a, b); }
+            inline Register Div(Register a, Register b) { return _mm256_div_ps(a, b); }
+            inline Register Sqrt(Register a) { return _mm256_sqrt_ps(a); }
+            inline Register Min(Register a, Register b) { return _mm256_min_ps(a, b); }
+            inline Register Max(Register a, Register b) { return _mm256_max_ps(a, b); }
+            inline Mask     Greater(Register a, Register b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+            inline Mask     GreaterEqual(Register a, Register b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+            inline Mask     Less(Register a, Register b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+            inline Mask     LessEqual(Register a, Register b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+            inline Mask     Equal(Register a, Register b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+            inline Mask     And(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+            inline Mask     Or(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+            inline Mask     AndNot(Mask a, Mask b) { return _mm256_andnot_ps(b, a); } // a && !b
+            inline Register Select(Mask m, Register a, Register b) { return _mm256_blendv_ps(b, a, m); }
+            inline int      MoveMask(Mask m) { return _mm256_movemask_ps(m); }
+#elif defined(VRT_USE_FLOAT) && defined(VRT_SIMD_SSE4)
+            using Register = __m128;
+            using Mask     = __m128;
+
+            constexpr int Width = 4;
+
+            inline Register Load(const Real* p) { return _mm_load_ps(p); }
+            inline void     Store(Real* p, Register a) { _mm_store_ps(p, a); }
+            inline Register Broadcast(Real t) { return _mm_set1_ps(t); }
+            inline Register Add(Register a, Register b) { return _mm_add_ps(a, b); }
+            inline Register Sub(Register a, Register b) { return _mm_sub_ps(a, b); }
+            inline Register Mul(Register a, Register b) { return _mm_mul_ps(a, b); }
+            inline Register Div(Register a, Register b) { return _mm_div_ps(a, b); }
+            inline Register Sqrt(Register a) { return _mm_sqrt_ps(a); }
+            inline Register Min(Register a, Register b) { return _mm_min_ps(a, b); }
+            inline Register Max(Register a, Register b) { return _mm_max_ps(a, b); }
+            inline Mask     Greater(Register a, Register b) { return _mm_cmpgt_ps(a, b); }
+            inline Mask     GreaterEqual(Register a, Register b) { return _mm_cmpge_ps(a, b); }
+            inline Mask     Less(Register a, Register b) { return _mm_cmplt_ps(a, b); }
+            inline Mask     LessEqual(Register a, Register b) { return _mm_cmple_ps(a, b); }
+            inline Mask     Equal(Register a, Register b) { return _mm_cmpeq_ps(a, b); }
+            inline Mask     And(Mask a, Mask b) { return _mm_and_ps(a, b); }
+            inline Mask     Or(Mask a, Mask b) { return _mm_or_ps(a, b); }
+            inline Mask     AndNot(Mask a, Mask b) { return _mm_andnot_ps(b, a); } // a && !b
+            inline Register Select(Mask m, Register a, Register b) { return _mm_blendv_ps(b, a, m); }
+            inline int      MoveMask(Mask m) { return _mm_movemask_ps(m); }
+#elif defined(VRT_USE_FLOAT) && defined(VRT_SIMD_NEON)
+            using Register = float32x4_t;
+            using Mask     = uint32x4_t;
+
+            constexpr int Width = 4;
+
+            inline Register Load(const Real* p) { return vld1q_f32(p); }
+            inline void     Store(Real* p, Register a) { vst1q_f32(p, a); }
+            inline Register Broadcast(Real t) { return vdupq_n_f32(t); }
+            inline Register Add(Register a, Register b) { return vaddq_f32(a, b); }
+            inline Register Sub(Register a, Register b) { return vsubq_f32(a, b); }
+            inline Register Mul(Register a, Register b) { return vmulq_f32(a, b); }
+            inline Register Div(Register a, Register b) { return vdivq_f32(a, b); }
+            inline Register Sqrt(Register a) { return vsqrtq_f32(a); }
+            inline Register Min(Register a, Register b) { return vminq_f32(a, b); }
+            inline Register Max(Register a, Register b) { return vmaxq_f32(a, b); }
+            inline Mask     Greater(Register a, Register b) { return vcgtq_f32(a, b); }
+            inline Mask     GreaterEqual(Register a, Register b) { return vcgeq_f32(a, b); }
+            inline Mask     Less(Register a, Register b) { return vcltq_f32(a, b); }
+            inline Mask     LessEqual(Register a, Register b) { return vcleq_f32(a, b); }
+            inline Mask     Equal(Register a, Register b) { return vceqq_f32(a, b); }
+            inline Mask     And(Mask a, Mask b) { return vandq_u32(a, b); }
+            inline Mask     Or(Mask a, Mask b) { return vorrq_u32(a, b); }
+            inline Mask     AndNot(Mask a, Mask b) { return vbicq_u32(a, b); } // a && !b
+            inline Register Select(Mask m, Register a, Register b) { return vbslq_f32(m, a, b); }
+            inline int      MoveMask(Mask m)
+            {
+                const uint32x4_t laneBits = {1, 2, 4, 8};
+                return static_cast<int>(vaddvq_u32(vandq_u32(m, laneBits)));
+            }
+#elif defined(VRT_SIMD_AVX2)
+            using Register = __m256d;
+            using Mask     = __m256d;
+
+            constexpr int Width = 4;
+
+            inline Register Load(const Real* p) { return _mm256_load_pd(p); }
+            inline void     Store(Real* p, Register a) { _mm256_store_pd(p, a); }
+            inline Register Broadcast(Real t) { return _mm256_set1_pd(t); }
+            inline Register Add(Register a, Register b) { return _mm256_add_pd(a, b); }
+            inline Register Sub(Register a, Register b) { return _mm256_sub_pd(a, b); }
+            inline Register Mul(Register a, Register b) { return _mm256_mul_pd(a, b); }
+            inline Register Div(Register a, Register b) { return _mm256_div_pd(a, b); }
+            inline Register Sqrt(Register a) { return _mm256_sqrt_pd(a); }
+            inline Register Min(Register a, Register b) { return _mm256_min_pd(a, b); }
+            inline Register Max(Register a, Register b) { return _mm256_max_pd(a, b); }
+            inline Mask     Greater(Register a, Register b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+            inline Mask     GreaterEqual(Register a, Register b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+            inline Mask     Less(Register a, Register b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+            inline Mask     LessEqual(Register a, Register b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+            inline Mask     Equal(Register a, Register b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+            inline Mask     And(Mask a, Mask b) { return _mm256_and_pd(a, b); }
+            inline Mask     Or(Mask a, Mask b) { return _mm256_or_pd(a, b); }
+            inline Mask     AndNot(Mask a, Mask b) { return _mm256_andnot_pd(b, a); } // a && !b
+            inline Register Select(Mask m, Register a, Register b) { return _mm256_blendv_pd(b, a, m); }
+            inline int      MoveMask(Mask m) { return _mm256_movemask_pd(m); }
+#elif defined(VRT_SIMD_SSE4)
+            using Register = __m128d;
+            using Mask     = __m128d;
+
+            constexpr int Width = 2;
+
+            inline Register Load(const Real* p) { return _mm_load_pd(p); }
+            inline void     Store(Real* p, Register a) { _mm_store_pd(p, a); }
+            inline Register Broadcast(Real t) { return _mm_set1_pd(t); }
+            inline Register Add(Register a, Register b) { return _mm_add_pd(a, b); }
+            inline Register Sub(Register a, Register b) { return _mm_sub_pd(a, b); }
+            inline Register Mul(Register a, Register b) { return _mm_mul_pd(a, b); }
+            inline Register Div(Register a, Register b) { return _mm_div_pd(a, b); }
+            inline Register Sqrt(Register a) { return _mm_sqrt_pd(a); }
+            inline Register Min(Register a, Register b) { return _mm_min_pd(a, b); }
+            inline Register Max(Register a, Register b) { return _mm_max_pd(a, b); }
+            inline Mask     Greater(Register a, Register b) { return _mm_cmpgt_pd(a, b); }
+            inline Mask     GreaterEqual(Register a, Register b) { return _mm_cmpge_pd(a, b); }
+            inline Mask     Less(Register a, Register b) { return _mm_cmplt_pd(a, b); }
+            inline Mask     LessEqual(Register a, Register b) { return _mm_cmple_pd(a, b); }
+            inline Mask     Equal(Register a, Register b) { return _mm_cmpeq_pd(a, b); }
+            inline Mask     And(Mask a, Mask b) { return _mm_and_pd(a, b); }
+            inline Mask     Or(Mask a, Mask b) { return _mm_or_pd(a, b); }
+            inline Mask     AndNot(Mask a, Mask b) { return _mm_andnot_pd(b, a); } // a && !b
+            inline Register Select(Mask m, Register a, Register b) { return _mm_blendv_pd(b, a, m); }
+            inline int      MoveMask(Mask m) { return _mm_movemask_pd(m); }
+#elif defined(VRT_SIMD_NEON)
+            using Register = float64x2_t;
+            using Mask     = uint64x2_t;
+
+            constexpr int Width = 2;
+
+            inline Register Load(const Real* p) { return vld1q_f64(p); }
+            inline void     Store(Real* p, Register a) { vst1q_f64(p, a); }
+            inline Register Broadcast(Real t) { return vdupq_n_f64(t); }
+            inline Register Add(Register a, Register b) { return vaddq_f64(a, b); }
+            inline Register Sub(Register a, Register b) { return vsubq_f64(a, b); }
+            inline Register Mul(Register a, Register b) { return vmulq_f64(a, b); }
+            inline Register Div(Register a, Register b) { return vdivq_f64(a, b); }
+            inline Register Sqrt(Register a) { return vsqrtq_f64(a); }
+            inline Register Min(Register a, Register b) { return vminq_f64(a, b); }
+            inline Register Max(Register a, Register b) { return vmaxq_f64(a, b); }
+            inline Mask     Greater(Register a, Register b) { return vcgtq_f64(a, b); }
+            inline Mask     GreaterEqual(Register a, Register b) { return vcgeq_f64(a, b); }
+            inline Mask     Less(Register a, Register b) { return vcltq_f64(a, b); }
+            inline Mask     LessEqual(Register a, Register b) { return vcleq_f64(a, b); }
+            inline Mask     Equal(Register a, Register b) { return vceqq_f64(a, b); }
+            inline Mask     And(Mask a, Mask b) { return vandq_u64(a, b); }
+            inline Mask     Or(Mask a, Mask b) { return vorrq_u64(a, b); }
+            inline Mask     AndNot(Mask a, Mask b) { return vbicq_u64(a, b); } // a && !b
+            inline Register Select(Mask m, Register a, Register b) { return vbslq_f64(m, a, b); }
+            inline int      MoveMask(Mask m)
+            {
+                const uint64x2_t laneBits = {1, 2};
+                return static_cast<int>(vaddvq_u64(vandq_u64(m, laneBits)));
+            }
+#else
+            using Register = Real;
+            using Mask     = bool;
+
+            constexpr int Width = 1;
+
+            inline Register Load(const Real* p) { return *p; }
+            inline void     Store(Real* p, Register a) { *p = a; }
+            inline Register Broadcast(Real t) { return t; }
+            inline Register Add(Register a, Register b) { return a + b; }
+            inline Register Sub(Register a, Register b) { return a - b; }
+            inline Register Mul(Register a, Register b) { return a * b; }
+            inline Register Div(Register a, Register b) { return a / b; }
+            inline Register Sqrt(Register a) { return std::sqrt(a); }
+            inline Register Min(Register a, Register b) { return a < b ? a : b; }
+            inline Register Max(Register a, Register b) { return a > b ? a : b; }
+            inline Mask     Greater(Register a, Register b) { return a > b; }
+            inline Mask     GreaterEqual(Register a, Register b) { return a >= b; }
+            inline Mask     Less(Register a, Register b) { return a < b; }
+            inline Mask     LessEqual(Register a, Register b) { return a <= b; }
+            inline Mask     Equal(Register a, Register b) { return a == b; }
+            inline Mask     And(Mask a, Mask b) { return a && b; }
+            inline Mask     Or(Mask a, Mask b) { return a || b; }
+            inline Mask     AndNot(Mask a, Mask b) { return a && !b; } // a && !b
+            inline Register Select(Mask m, Register a, Register b) { return m ? a : b; }
+            inline int      MoveMask(Mask m) { return m ? 1 : 0; }
+#endif
+        } // namespace Wide
+    } // namespace Simd
+
+    class alignas(Simd::Alignment) Vector3
     {
     public:
+#ifdef VRT_SIMD_ENABLED
+        Vector3() : m_Comp {0, 0, 0, 0} {}
+        Vector3(Real c1, Real c2, Real c3) : m_Comp {c1, c2, c3, 0} {}
+        explicit Vector3(Simd::Register r) { Simd::Store(m_Comp, r); }
+
+        Simd::Register Load() const { return Simd::Load(m_Comp); }
+#else
         Vector3() : m_Comp {0, 0, 0} {}
-        Vector3(double c1, double c2, double c3) : m_Comp {c1, c2, c3} {}
+        Vector3(Real c1, Real c2, Real c3) : m_Comp {c1, c2, c3} {}
+#endif
 
-        double x() const { return m_Comp[0]; }
-        double y() const { return m_Comp[1]; }
-        double z() const { return m_Comp[2]; }
+        Real x() const { return m_Comp[0]; }
+        Real y() const { return m_Comp[1]; }
+        Real z() const { return m_Comp[2]; }
 
+#ifdef VRT_SIMD_ENABLED
+        Vector3 operator-() const { return Vector3(Simd::Negate(Load())); }
+#else
         Vector3 operator-() const { return Vector3(-m_Comp[0], -m_Comp[1], -m_Comp[2]); }
-        double  operator[](int i) const { return m_Comp[i]; }
-        double& operator[](int i) { return m_Comp[i]; }
+#endif
+        Real  operator[](int i) const { return m_Comp[i]; }
+        Real& operator[](int i) { return m_Comp[i]; }
 
         Vector3 operator+=(const Vector3& v)
         {
+#ifdef VRT_SIMD_ENABLED
+            Simd::Store(m_Comp, Simd::Add(Load(), v.Load()));
+#else
             m_Comp[0] += v.m_Comp[0];
             m_Comp[1] += v.m_Comp[1];
             m_Comp[2] += v.m_Comp[2];
+#endif
             return *this;
         }
 
-        Vector3& operator*=(const double t)
+        Vector3& operator*=(const Real t)
         {
+#ifdef VRT_SIMD_ENABLED
+            Simd::Store(m_Comp, Simd::Mul(Load(), Simd::Broadcast3(t)));
+#else
             m_Comp[0] *= t;
             m_Comp[1] *= t;
             m_Comp[2] *= t;
+#endif
             return *this;
         }
 
-        Vector3& operator/=(const double t) { return *this *= 1 / t; }
+        Vector3& operator/=(const Real t) { return *this *= 1 / t; }
 
-        double LengthSquared() const { return m_Comp[0] * m_Comp[0] + m_Comp[1] * m_Comp[1] + m_Comp[2] * m_Comp[2]; }
-        double Length() const { return std::sqrt(LengthSquared()); }
+#ifdef VRT_SIMD_ENABLED
+        Real LengthSquared() const
+        {
+            Simd::Register r = Load();
+            return Simd::HorizontalSum(Simd::Mul(r, r));
+        }
+#else
+        Real LengthSquared() const { return m_Comp[0] * m_Comp[0] + m_Comp[1] * m_Comp[1] + m_Comp[2] * m_Comp[2]; }
+#endif
+        Real Length() const { return std::sqrt(LengthSquared()); }
 
         bool IsNearZero() const
         {
             // Return true if the vector is close to zero in all dimensions.
-            const double s = 1e-8;
+            const Real s = 1e-8;
             return (fabs(m_Comp[0]) < s) && (fabs(m_Comp[1]) < s) && (fabs(m_Comp[2]) < s);
         }
 
-        static Vector3 GetRandom() { return {GetRandomDouble(), GetRandomDouble(), GetRandomDouble()}; }
-        static Vector3 GetRandom(double min, double max)
+        static Vector3 GetRandom() { return {GetRandomReal(), GetRandomReal(), GetRandomReal()}; }
+        static Vector3 GetRandom(Real min, Real max)
         {
-            return {GetRandomDouble(min, max), GetRandomDouble(min, max), GetRandomDouble(min, max)};
+            return {GetRandomReal(min, max), GetRandomReal(min, max), GetRandomReal(min, max)};
         }
 
     private:
-        double m_Comp[3];
+#ifdef VRT_SIMD_ENABLED
+        Real m_Comp[4];
+#else
+        Real m_Comp[3];
+#endif
     };
 
     using Point3 = Vector3;          // 3D Point
@@ -117,6 +777,35 @@ namespace VRaytracer
         return out << v.x() << ' ' << v.y() << ' ' << v.z();
     }
 
+#ifdef VRT_SIMD_ENABLED
+    inline Vector3 operator+(const Vector3& u, const Vector3& v) { return Vector3(Simd::Add(u.Load(), v.Load())); }
+
+    inline Vector3 operator-(const Vector3& u, const Vector3& v) { return Vector3(Simd::Sub(u.Load(), v.Load())); }
+
+    inline Vector3 operator*(const Vector3& u, const Vector3& v) { return Vector3(Simd::Mul(u.Load(), v.Load())); }
+
+    inline Vector3 operator*(Real t, const Vector3& v) { return Vector3(Simd::Mul(Simd::Broadcast3(t), v.Load())); }
+
+    inline Vector3 operator*(const Vector3& v, Real t) { return Vector3(Simd::Mul(Simd::Broadcast3(t), v.Load())); }
+
+    inline Real DotProduct(const Vector3& u, const Vector3& v)
+    {
+        return Simd::HorizontalSum(Simd::Mul(u.Load(), v.Load()));
+    }
+
+    inline Vector3 CrossProduct(const Vector3& u, const Vector3& v)
+    {
+        // u x v = (u * v.yzx - u.yzx * v).yzx
+        Simd::Register a = u.Load();
+        Simd::Register b = v.Load();
+        Simd::Register c = Simd::Sub(Simd::Mul(a, Simd::ShuffleYZX(b)), Simd::Mul(Simd::ShuffleYZX(a), b));
+        return Vector3(Simd::ShuffleYZX(c));
+    }
+
+    inline Vector3 Min(const Vector3& u, const Vector3& v) { return Vector3(Simd::Min(u.Load(), v.Load())); }
+
+    inline Vector3 Max(const Vector3& u, const Vector3& v) { return Vector3(Simd::Max(u.Load(), v.Load())); }
+#else
     inline Vector3 operator+(const Vector3& u, const Vector3& v)
     {
         return Vector3(u.x() + v.x(), u.y() + v.y(), u.z() + v.z());
@@ -132,13 +821,11 @@ namespace VRaytracer
         return Vector3(u.x() * v.x(), u.y() * v.y(), u.z() * v.z());
     }
 
-    inline Vector3 operator*(double t, const Vector3& v) { return Vector3(t * v.x(), t * v.y(), t * v.z()); }
+    inline Vector3 operator*(Real t, const Vector3& v) { return Vector3(t * v.x(), t * v.y(), t * v.z()); }
 
-    inline Vector3 operator*(const Vector3& v, double t) { return Vector3(t * v.x(), t * v.y(), t * v.z()); }
+    inline Vector3 operator*(const Vector3& v, Real t) { return Vector3(t * v.x(), t * v.y(), t * v.z()); }
 
-    inline Vector3 operator/(Vector3 v, double t) { return (1 / t) * v; }
-
-    inline double DotProduct(const Vector3& u, const Vector3& v)
+    inline Real DotProduct(const Vector3& u, const Vector3& v)
     {
         return u.x() * v.x() + u.y() * v.y() + u.z() * v.z();
     }
@@ -148,8 +835,28 @@ namespace VRaytracer
         return Vector3(u.y() * v.z() - u.z() * v.y(), u.z() * v.x() - u.x() * v.z(), u.x() * v.y() - u.y() * v.x());
     }
 
+    inline Vector3 Min(const Vector3& u, const Vector3& v)
+    {
+        return Vector3(std::min(u.x(), v.x()), std::min(u.y(), v.y()), std::min(u.z(), v.z()));
+    }
+
+    inline Vector3 Max(const Vector3& u, const Vector3& v)
+    {
+        return Vector3(std::max(u.x(), v.x()), std::max(u.y(), v.y()), std::max(u.z(), v.z()));
+    }
+#endif
+
+    inline Vector3 operator/(Vector3 v, Real t) { return (1 / t) * v; }
+
     inline Vector3 Normalize(Vector3 v) { return v / v.Length(); }
 
+    inline Vector3 Abs(const Vector3& v) { return Max(v, -v); }
+
+    inline Real MaxComponent(const Vector3& v) { return std::max(v.x(), std::max(v.y(), v.z())); }
+
+    // Rec. 709 luminance of a linear RGB color.
+    inline Real Luminance(const Color& c) { return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z(); }
+
     inline Vector3 GetRandomInUnitSphere()
     {
         while (true)
@@ -178,7 +885,7 @@ namespace VRaytracer
     {
         while (true)
         {
-            Vector3 p = Vector3(GetRandomDouble(-1, 1), GetRandomDouble(-1, 1), 0);
+            Vector3 p = Vector3(GetRandomReal(-1, 1), GetRandomReal(-1, 1), 0);
             if (p.LengthSquared() >= 1)
                 continue;
             return p;
@@ -187,175 +894,678 @@ namespace VRaytracer
 
     inline Vector3 Reflect(const Vector3& v, const Vector3& n) { return v - 2 * DotProduct(v, n) * n; }
 
-    inline Vector3 Refract(const Vector3& uv, const Vector3& n, double refractionRatio)
+    inline Vector3 Refract(const Vector3& uv, const Vector3& n, Real refractionRatio)
     {
-        double  cosTheta          = fmin(DotProduct(-uv, n), 1.0);
+        Real    cosTheta          = fmin(DotProduct(-uv, n), 1.0);
         Vector3 rOutPerpendicular = refractionRatio * (uv + cosTheta * n);
         Vector3 rOutParallel      = -std::sqrt(fabs(1.0 - rOutPerpendicular.LengthSquared())) * n;
         return rOutPerpendicular + rOutParallel;
     }
 
-    class Ray
-    {
-    public:
-        Ray() {}
-        Ray(const Point3& origin, const Vector3& direction, double time) :
-            m_Origin(origin), m_Direction(direction), m_Time(time)
-        {}
+    // Sampling
 
-        Point3  Origin() const { return m_Origin; }
-        Vector3 Direction() const { return m_Direction; }
-        double  Time() const { return m_Time; }
+    struct Sample2D
+    {
+        Real X;
+        Real Y;
+    };
 
-        Point3 At(double t) const { return m_Origin + t * m_Direction; }
+    // Combines a hash with another value, used to derive independent seeds per pixel and dimension.
+    inline uint64_t HashCombine(uint64_t seed, uint64_t v) { return MixBits(seed ^ (v + 0x9e3779b97f4a7c15ull)); }
 
-    private:
-        Point3  m_Origin;
-        Vector3 m_Direction;
-        double  m_Time;
-    };
+    inline uint32_t ReverseBits32(uint32_t v)
+    {
+        v = (v << 16) | (v >> 16);
+        v = ((v & 0x00ff00ffu) << 8) | ((v & 0xff00ff00u) >> 8);
+        v = ((v & 0x0f0f0f0fu) << 4) | ((v & 0xf0f0f0f0u) >> 4);
+        v = ((v & 0x33333333u) << 2) | ((v & 0xccccccccu) >> 2);
+        v = ((v & 0x55555555u) << 1) | ((v & 0xaaaaaaaau) >> 1);
+        return v;
+    }
 
-    class AABB
+    inline int Log2Int(uint32_t v)
     {
-    public:
-        AABB() {}
-        AABB(const Point3& a, const Point3& b) : m_Min(a), m_Max(b) {}
+        int log2 = 0;
+        while (v >>= 1)
+            ++log2;
+        return log2;
+    }
 
-        Point3 GetMin() const { return m_Min; }
-        Point3 GetMax() const { return m_Max; }
+    inline uint32_t RoundUpPow2(uint32_t v)
+    {
+        uint32_t pow2 = 1;
+        while (pow2 < v)
+            pow2 <<= 1;
+        return pow2;
+    }
 
-        bool Hit(const Ray& r, double tMin, double tMax) const
-        {
-            for (int a = 0; a < 3; a++)
-            {
-                /*double t0 =
-                    std::fmin((m_Min[a] - r.Origin()[a]) / r.Direction()[a], (m_Max[a] - r.Origin()[a]) /
-                r.Direction()[a]); double t1 = std::fmax((m_Min[a] - r.Origin()[a]) / r.Direction()[a], (m_Max[a] -
-                r.Origin()[a]) / r.Direction()[a]);
+    // Interleaves the bits of x and y (x in the even bits), which orders 2D points along a Z-curve.
+    inline uint64_t EncodeMorton2(uint32_t x, uint32_t y)
+    {
+        auto spread = [](uint64_t v) {
+            v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+            v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+            v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+            v = (v | (v << 2)) & 0x3333333333333333ull;
+            v = (v | (v << 1)) & 0x5555555555555555ull;
+            return v;
+        };
+        return spread(x) | (spread(y) << 1);
+    }
 
-                tMin = std::fmax(t0, tMin);
-                tMax = std::fmin(t1, tMax);*/
+    // Interleaves the low 10 bits of x, y and z (x in the lowest bit), which orders 3D grid cells along a Z-curve.
+    inline uint32_t EncodeMorton3(uint32_t x, uint32_t y, uint32_t z)
+    {
+        auto spread = [](uint32_t v) {
+            v &= 0x3ff;
+            v = (v | (v << 16)) & 0x030000ffu;
+            v = (v | (v << 8)) & 0x0300f00fu;
+            v = (v | (v << 4)) & 0x030c30c3u;
+            v = (v | (v << 2)) & 0x09249249u;
+            return v;
+        };
+        return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+    }
 
-                double invD = 1.0 / r.Direction()[a];
-                double t0   = (m_Min[a] - r.Origin()[a]) * invD;
-                double t1   = (m_Max[a] - r.Origin()[a]) * invD;
+    // Element i of a random permutation of [0, n) selected by seed, without storing the permutation (Kensler 2013).
+    inline uint32_t PermutationElement(uint32_t i, uint32_t n, uint32_t seed)
+    {
+        uint32_t w = n - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do
+        {
+            i ^= seed;
+            i *= 0xe170893du;
+            i ^= seed >> 16;
+            i ^= (i & w) >> 4;
+            i ^= seed >> 8;
+            i *= 0x0929eb3fu;
+            i ^= seed >> 23;
+            i ^= (i & w) >> 1;
+            i *= 1 | seed >> 27;
+            i *= 0x6935fa69u;
+            i ^= (i & w) >> 11;
+            i *= 0x74dcb303u;
+            i ^= (i & w) >> 2;
+            i *= 0x9e501cc3u;
+            i ^= (i & w) >> 2;
+            i *= 0xc860a3dfu;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= n);
+        return (i + seed) % n;
+    }
 
-                if (invD < 0.0)
-                {
-                    std::swap(t0, t1);
-                }
+    /*
+     * Nested uniform (Owen) scrambling of a 32-bit fixed-point value: every bit is flipped by a hash of the bits above
+     * it (Burley 2020, "Practical Hash-based Owen Scrambling"). Applied to an index it shuffles the index within every
+     * aligned power-of-two block.
+     */
+    inline uint32_t OwenScramble(uint32_t v, uint32_t seed)
+    {
+        v = ReverseBits32(v);
+        v += seed;
+        v ^= v * 0x6c50b47cu;
+        v ^= v * 0xb82f1e52u;
+        v ^= v * 0xc7afe638u;
+        v ^= v * 0x8d22f6e6u;
+        return ReverseBits32(v);
+    }
 
-                tMin = t0 > tMin ? t0 : tMin;
-                tMax = t1 < tMax ? t1 : tMax;
+    /*
+     * The first two dimensions of the Sobol sequence as 32-bit fixed-point fractions. Together they form a
+     * (0, 2)-sequence: every power-of-two prefix is stratified in all elementary intervals. The samplers pad
+     * independently scrambled 2D points for the higher dimensions instead of using more Sobol dimensions.
+     */
+    inline uint32_t SobolSample(uint64_t index, int dimension)
+    {
+        if (dimension == 0)
+        {
+            // Van der Corput, index bits above the 32nd only affect digits below the fixed-point precision.
+            return ReverseBits32(static_cast<uint32_t>(index));
+        }
 
-                if (tMax <= tMin)
+        // The generator matrix of the second dimension is the Pascal matrix mod 2, binomial(k, r) is odd exactly when
+        // the bits of r are a subset of the bits of k.
+        static const std::array<uint32_t, 64> pascalMatrix = [] {
+            std::array<uint32_t, 64> columns {};
+            for (uint32_t k = 0; k < 64; ++k)
+            {
+                for (uint32_t r = 0; r < 32; ++r)
                 {
-                    return false;
+                    if ((r & k) == r)
+                        columns[k] |= 1u << (31 - r);
                 }
             }
+            return columns;
+        }();
 
-            return true;
+        uint32_t v = 0;
+        for (int k = 0; index != 0; index >>= 1, ++k)
+        {
+            if (index & 1)
+                v ^= pascalMatrix[k];
         }
+        return v;
+    }
 
-    private:
-        Point3 m_Min;
-        Point3 m_Max;
-    };
+    inline Real FixedPointToReal(uint32_t v) { return std::min(static_cast<Real>(v * 0x1p-32), OneMinusEpsilon); }
 
-    inline AABB GetSurroundingBox(AABB box0, AABB box1)
+    enum class SamplerType : uint32_t
     {
-        Point3 small(std::fmin(box0.GetMin().x(), box1.GetMin().x()),
-                     std::fmin(box0.GetMin().y(), box1.GetMin().y()),
-                     std::fmin(box0.GetMin().z(), box1.GetMin().z()));
-
-        Point3 big(std::fmin(box0.GetMax().x(), box1.GetMax().x()),
-                   std::fmin(box0.GetMax().y(), box1.GetMax().y()),
-                   std::fmin(box0.GetMax().z(), box1.GetMax().z()));
+        Independent = 0,
+        Stratified,
+        Sobol,
+        BlueNoise,
+    };
 
-        return AABB(small, big);
-    }
+    inline const char* SamplerTypeNames[] = {"Independent", "Stratified", "Sobol", "BlueNoise"};
 
-    class Camera
+    /*
+     * Generates the sample values of a pixel sample, one dimension at a time. The camera owns the first dimensions and
+     * every bounce owns a fixed range after that, so a bounce sees the same dimensions no matter how many values the
+     * bounces before it consumed.
+     */
+    class Sampler
     {
     public:
-        Camera() {}
-        Camera(Point3  lookFrom,
-               Point3  lookAt,
-               Vector3 viewUp,
-               double  verticalFOV,
-               double  aspectRatio,
-               double  aperture,
-               double  focusDistance,
-               double  time0 = 0,
-               double  time1 = 0)
-        {
-            double       theta          = Degrees2Radians(verticalFOV);
-            double       h              = std::tan(theta / 2);
-            const double viewportHeight = 2.0 * h;
-            const double viewportWidth  = aspectRatio * viewportHeight;
+        static constexpr uint32_t CameraDimensions    = 5; // Film (2D), lens (2D), time (1D)
+        static constexpr uint32_t DimensionsPerBounce = 8;
 
-            m_W = Normalize(lookFrom - lookAt);
-            m_U = Normalize(CrossProduct(viewUp, m_W));
-            m_V = CrossProduct(m_W, m_U);
+        // The tail of every bounce is reserved for the integrator: light selection (1D) and the position on the light
+        // (2D) for next-event estimation, and the Russian roulette decision after the bounce.
+        static constexpr uint32_t LightSampleDimension     = 4;
+        static constexpr uint32_t RussianRouletteDimension = DimensionsPerBounce - 1;
 
-            m_Origin          = lookFrom;
-            m_Horizontal      = focusDistance * viewportWidth * m_U;
-            m_Vertical        = focusDistance * viewportHeight * m_V;
-            m_LowerLeftCorner = m_Origin - m_Horizontal / 2 - m_Vertical / 2 - focusDistance * m_W;
-            m_LensRadius      = aperture / 2;
+        Sampler(uint32_t samplesPerPixel, uint64_t seed) : m_SamplesPerPixel(samplesPerPixel), m_Seed(seed) {}
+        virtual ~Sampler() = default;
 
-            m_Time0 = time0;
-            m_Time1 = time1;
+        virtual void StartPixelSample(uint32_t x, uint32_t y, uint32_t sampleIndex)
+        {
+            m_PixelX      = x;
+            m_PixelY      = y;
+            m_SampleIndex = sampleIndex;
+            m_PixelHash   = HashCombine(HashCombine(m_Seed, x), y);
+            SetDimension(0);
         }
 
-        Ray GetRay(double s, double t) const
+        // Moves to the dimensions of a bounce, offset selects a dimension within the bounce's range.
+        void StartBounce(uint32_t bounce, uint32_t offset = 0)
         {
-            Vector3 rd     = m_LensRadius * GetRandomInUnitDisk();
-            Vector3 offset = m_U * rd.x() + m_V * rd.y();
-            return Ray(m_Origin + offset,
-                       m_LowerLeftCorner + s * m_Horizontal + t * m_Vertical - m_Origin - offset,
-                       GetRandomDouble(m_Time0, m_Time1));
+            SetDimension(CameraDimensions + bounce * DimensionsPerBounce + offset);
         }
 
-    private:
-        Point3  m_Origin;
-        Point3  m_LowerLeftCorner;
-        Vector3 m_Horizontal;
-        Vector3 m_Vertical;
-        Vector3 m_U, m_V, m_W;
-        double  m_LensRadius;
-        double  m_Time0, m_Time1;
+        virtual Real     Get1D() = 0;
+        virtual Sample2D Get2D() = 0;
+
+        uint32_t GetSamplesPerPixel() const { return m_SamplesPerPixel; }
+
+    protected:
+        virtual void SetDimension(uint32_t dimension) { m_Dimension = dimension; }
+
+    protected:
+        uint32_t m_SamplesPerPixel;
+        uint64_t m_Seed;
+        uint32_t m_PixelX      = 0;
+        uint32_t m_PixelY      = 0;
+        uint32_t m_SampleIndex = 0;
+        uint32_t m_Dimension   = 0;
+        uint64_t m_PixelHash   = 0;
     };
 
-    class Perlin
+    /*
+     * Uniform random values, each pixel sample and dimension starts at a fixed position of a per-pixel PCG32 stream.
+     */
+    class IndependentSampler : public Sampler
     {
     public:
-        Perlin()
-        {
-            m_RanVec = new Vector3[PointCount];
-            for (int i = 0; i < PointCount; ++i)
-            {
-                m_RanVec[i] = Normalize(Vector3::GetRandom(-1, 1));
-            }
+        using Sampler::Sampler;
 
-            m_PermX = GeneratePerlinPerm();
-            m_PermY = GeneratePerlinPerm();
-            m_PermZ = GeneratePerlinPerm();
+        virtual Real     Get1D() override { return m_RNG.NextReal(); }
+        virtual Sample2D Get2D() override
+        {
+            Real x = m_RNG.NextReal();
+            return {x, m_RNG.NextReal()};
         }
 
-        ~Perlin()
+    protected:
+        virtual void SetDimension(uint32_t dimension) override
         {
-            delete[] m_RanVec;
-            delete[] m_PermX;
-            delete[] m_PermY;
-            delete[] m_PermZ;
+            Sampler::SetDimension(dimension);
+            m_RNG.SetSequence(m_PixelHash);
+            m_RNG.Advance(static_cast<uint64_t>(m_SampleIndex) * 65536ull + dimension);
         }
 
-        double Turb(const Point3& point, int depth = 7) const
+    private:
+        PCG32 m_RNG;
+    };
+
+    /*
+     * Jittered stratification: each dimension splits [0, 1) (or [0, 1)^2) into one stratum per pixel sample, and the
+     * samples visit the strata in a random order per pixel and dimension.
+     */
+    class StratifiedSampler : public Sampler
+    {
+    public:
+        StratifiedSampler(uint32_t samplesPerPixel, uint64_t seed) : Sampler(samplesPerPixel, seed)
+        {
+            // The 2D grid has to use exactly samplesPerPixel cells, pick the most square factorization.
+            m_XStrata = static_cast<uint32_t>(std::sqrt(static_cast<double>(samplesPerPixel)));
+            while (samplesPerPixel % m_XStrata != 0)
+                --m_XStrata;
+            m_YStrata = samplesPerPixel / m_XStrata;
+        }
+
+        virtual Real Get1D() override
+        {
+            uint64_t hash    = HashCombine(m_PixelHash, m_Dimension++);
+            uint32_t stratum = PermutationElement(m_SampleIndex, m_SamplesPerPixel, static_cast<uint32_t>(hash));
+            return (stratum + GetJitter(hash, 0)) / m_SamplesPerPixel;
+        }
+
+        virtual Sample2D Get2D() override
+        {
+            uint64_t hash    = HashCombine(m_PixelHash, m_Dimension);
+            uint32_t stratum = PermutationElement(m_SampleIndex, m_SamplesPerPixel, static_cast<uint32_t>(hash));
+            m_Dimension += 2;
+            return {(stratum % m_XStrata + GetJitter(hash, 0)) / m_XStrata,
+                    (stratum / m_XStrata + GetJitter(hash, 1)) / m_YStrata};
+        }
+
+    private:
+        Real GetJitter(uint64_t hash, uint64_t axis) const
+        {
+            return FixedPointToReal(static_cast<uint32_t>(HashCombine(hash, m_SampleIndex * 2ull + axis) >> 32));
+        }
+
+    private:
+        uint32_t m_XStrata;
+        uint32_t m_YStrata;
+    };
+
+    /*
+     * Owen-scrambled Sobol points. Every dimension (pair) shuffles the sample index and scrambles the values with its
+     * own hash, which decorrelates the padded dimensions and the pixels while keeping each 2D projection a scrambled
+     * (0, 2)-sequence. Works best with power-of-two sample counts.
+     */
+    class SobolSampler : public Sampler
+    {
+    public:
+        using Sampler::Sampler;
+
+        virtual Real Get1D() override
+        {
+            uint64_t hash  = HashCombine(m_PixelHash, m_Dimension++);
+            uint32_t index = OwenScramble(m_SampleIndex, static_cast<uint32_t>(hash));
+            return FixedPointToReal(OwenScramble(SobolSample(index, 0), static_cast<uint32_t>(hash >> 32)));
+        }
+
+        virtual Sample2D Get2D() override
+        {
+            uint64_t hash  = HashCombine(m_PixelHash, m_Dimension);
+            uint32_t index = OwenScramble(m_SampleIndex, static_cast<uint32_t>(hash));
+            m_Dimension += 2;
+            return {FixedPointToReal(OwenScramble(SobolSample(index, 0), static_cast<uint32_t>(hash >> 32))),
+                    FixedPointToReal(OwenScramble(SobolSample(index, 1), static_cast<uint32_t>(MixBits(hash))))};
+        }
+    };
+
+    /*
+     * Screen-space blue-noise error distribution from a single Sobol sequence (Ahmed and Wonka 2020, "Screen-Space
+     * Blue-Noise Diffusion of Monte Carlo Sampling Error via Hierarchical Ordering of Pixels"). Pixels take consecutive
+     * blocks of the sequence in Morton order, and the base-4 digits of the index are randomly permuted per dimension,
+     * so neighbouring pixels get well distributed, complementary samples.
+     */
+    class BlueNoiseSampler : public Sampler
+    {
+    public:
+        BlueNoiseSampler(uint32_t samplesPerPixel, uint32_t width, uint32_t height, uint64_t seed) :
+            Sampler(samplesPerPixel, seed)
+        {
+            m_Log2SamplesPerPixel = Log2Int(RoundUpPow2(samplesPerPixel));
+            int log2Resolution    = Log2Int(RoundUpPow2(std::max(width, height)));
+            m_BaseFourDigits      = (2 * log2Resolution + m_Log2SamplesPerPixel + 1) / 2;
+        }
+
+        virtual void StartPixelSample(uint32_t x, uint32_t y, uint32_t sampleIndex) override
+        {
+            m_MortonIndex = (EncodeMorton2(x, y) << m_Log2SamplesPerPixel) | sampleIndex;
+            Sampler::StartPixelSample(x, y, sampleIndex);
+        }
+
+        virtual Real Get1D() override
+        {
+            uint64_t index = GetSampleIndex();
+            uint64_t hash  = HashCombine(m_Seed, m_Dimension++);
+            return FixedPointToReal(OwenScramble(SobolSample(index, 0), static_cast<uint32_t>(hash)));
+        }
+
+        virtual Sample2D Get2D() override
+        {
+            uint64_t index = GetSampleIndex();
+            uint64_t hash  = HashCombine(m_Seed, m_Dimension);
+            m_Dimension += 2;
+            return {FixedPointToReal(OwenScramble(SobolSample(index, 0), static_cast<uint32_t>(hash))),
+                    FixedPointToReal(OwenScramble(SobolSample(index, 1), static_cast<uint32_t>(hash >> 32)))};
+        }
+
+    private:
+        uint64_t GetSampleIndex() const
+        {
+            static constexpr uint8_t permutations[24][4] = {
+                {0, 1, 2, 3}, {0, 1, 3, 2}, {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 2, 1}, {0, 3, 1, 2},
+                {1, 0, 2, 3}, {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 2, 0}, {1, 3, 0, 2},
+                {2, 1, 0, 3}, {2, 1, 3, 0}, {2, 0, 1, 3}, {2, 0, 3, 1}, {2, 3, 0, 1}, {2, 3, 1, 0},
+                {3, 1, 2, 0}, {3, 1, 0, 2}, {3, 2, 1, 0}, {3, 2, 0, 1}, {3, 0, 2, 1}, {3, 0, 1, 2}};
+
+            // With an odd power of two samples per pixel the last digit is a base-2 digit.
+            bool     oddPower    = m_Log2SamplesPerPixel & 1;
+            uint64_t sampleIndex = 0;
+            for (int i = m_BaseFourDigits - 1; i >= (oddPower ? 1 : 0); --i)
+            {
+                int      digitShift   = 2 * i - (oddPower ? 1 : 0);
+                int      digit        = (m_MortonIndex >> digitShift) & 3;
+                uint64_t higherDigits = m_MortonIndex >> (digitShift + 2);
+                int      permutation  = (MixBits(higherDigits ^ (0x55555555ull * m_Dimension)) >> 24) % 24;
+                sampleIndex |= static_cast<uint64_t>(permutations[permutation][digit]) << digitShift;
+            }
+
+            if (oddPower)
+            {
+                uint64_t digit = m_MortonIndex & 1;
+                sampleIndex |= digit ^ (MixBits((m_MortonIndex >> 1) ^ (0x55555555ull * m_Dimension)) & 1);
+            }
+
+            return sampleIndex;
+        }
+
+    private:
+        int      m_Log2SamplesPerPixel;
+        int      m_BaseFourDigits;
+        uint64_t m_MortonIndex = 0;
+    };
+
+    inline std::unique_ptr<Sampler>
+    CreateSampler(SamplerType type, uint32_t samplesPerPixel, uint32_t width, uint32_t height, uint64_t seed = 0)
+    {
+        // Samplers stratify over samplesPerPixel, a render without samples still needs a valid one.
+        samplesPerPixel = std::max<uint32_t>(1, samplesPerPixel);
+        switch (type)
+        {
+            case SamplerType::Independent:
+                return std::make_unique<IndependentSampler>(samplesPerPixel, seed);
+            case SamplerType::Stratified:
+                return std::make_unique<StratifiedSampler>(samplesPerPixel, seed);
+            case SamplerType::BlueNoise:
+                return std::make_unique<BlueNoiseSampler>(samplesPerPixel, width, height, seed);
+            case SamplerType::Sobol:
+            default:
+                return std::make_unique<SobolSampler>(samplesPerPixel, seed);
+        }
+    }
+
+    // Sample Warping
+
+    // Maps the unit square to the unit disk (in the XY plane) keeping strata compact (Shirley and Chiu 1997).
+    inline Vector3 SampleUniformDiskConcentric(Sample2D u)
+    {
+        Real x = 2 * u.X - 1;
+        Real y = 2 * u.Y - 1;
+        if (x == 0 && y == 0)
+            return Vector3(0, 0, 0);
+
+        Real r, theta;
+        if (std::fabs(x) > std::fabs(y))
+        {
+            r     = x;
+            theta = (Pi / 4) * (y / x);
+        }
+        else
+        {
+            r     = y;
+            theta = (Pi / 2) - (Pi / 4) * (x / y);
+        }
+        return Vector3(r * std::cos(theta), r * std::sin(theta), 0);
+    }
+
+    inline Vector3 SampleUniformSphere(Sample2D u)
+    {
+        Real z   = 1 - 2 * u.X;
+        Real r   = std::sqrt(std::max<Real>(0, 1 - z * z));
+        Real phi = 2 * Pi * u.Y;
+        return Vector3(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    // Uniform point inside the unit ball: a uniform direction scaled by the cube root of a uniform radius sample.
+    inline Vector3 SampleUniformBall(Sample2D u, Real uRadius) { return std::cbrt(uRadius) * SampleUniformSphere(u); }
+
+    // Uniform direction within the cone around +Z whose half-angle has the cosine cosThetaMax.
+    inline Vector3 SampleUniformCone(Sample2D u, Real cosThetaMax)
+    {
+        Real cosTheta = (1 - u.X) + u.X * cosThetaMax;
+        Real sinTheta = std::sqrt(std::max<Real>(0, 1 - cosTheta * cosTheta));
+        Real phi      = 2 * Pi * u.Y;
+        return Vector3(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta);
+    }
+
+    // Completes the unit vector w to an orthonormal basis (Duff et al. 2017), without branches on w's direction.
+    inline void CoordinateSystem(const Vector3& w, Vector3& u, Vector3& v)
+    {
+        Real sign = std::copysign(Real(1), w.z());
+        Real a    = -1 / (sign + w.z());
+        Real b    = w.x() * w.y() * a;
+        u         = Vector3(1 + sign * w.x() * w.x() * a, sign * b, -sign * w.x());
+        v         = Vector3(b, sign + w.y() * w.y() * a, -w.y());
+    }
+
+    // The power heuristic (beta = 2) weight of a sample taken with density pdf, against one other strategy's density.
+    inline Real PowerHeuristic(Real pdf, Real otherPdf) { return (pdf * pdf) / (pdf * pdf + otherPdf * otherPdf); }
+
+    class Ray
+    {
+    public:
+        Ray() {}
+        Ray(const Point3& origin, const Vector3& direction, Real time) :
+            m_Origin(origin), m_Direction(direction), m_Time(time)
+        {}
+
+        Point3  Origin() const { return m_Origin; }
+        Vector3 Direction() const { return m_Direction; }
+        Real    Time() const { return m_Time; }
+
+        Point3 At(Real t) const { return m_Origin + t * m_Direction; }
+
+    private:
+        Point3  m_Origin;
+        Vector3 m_Direction;
+        Real    m_Time;
+    };
+
+    /*
+     * Traversal-side copy of a ray. The reciprocal direction and its signs are computed once per ray, so a slab test
+     * needs a subtract and a multiply per plane and no divides or branches on the direction.
+     */
+    struct RayQuery
+    {
+        explicit RayQuery(const Ray& ray) : Origin(ray.Origin()), Direction(ray.Direction()), Time(ray.Time())
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                InvDirection[a]        = 1 / Direction[a];
+                DirectionIsNegative[a] = InvDirection[a] < 0;
+            }
+        }
+
+        Point3  Origin;
+        Vector3 Direction;
+        Real    Time;
+        Real    InvDirection[3];
+        uint8_t DirectionIsNegative[3];
+    };
+
+    /*
+     * Branchless slab test of a box given by its min and max corners. The sign bits pick the near and far planes per
+     * axis. The far distances are scaled up by 2 * Gamma(3), so rounding can't make a grazing ray miss the box. That
+     * bound needs the plane distance to be computed as (plane - origin) * reciprocal, folding the origin into a
+     * precomputed origin * reciprocal term cancels catastrophically for planes close to the origin. A NaN slab (a
+     * zero direction component whose origin lies on a plane) is ignored by the comparisons.
+     */
+    template<typename T>
+    inline bool IntersectSlabs(const RayQuery& query, const T boundsMin[3], const T boundsMax[3], Real tMin, Real tMax)
+    {
+        static const Real farScale = 1 + 2 * Gamma(3);
+        for (int a = 0; a < 3; ++a)
+        {
+            Real nearPlane = query.DirectionIsNegative[a] ? boundsMax[a] : boundsMin[a];
+            Real farPlane  = query.DirectionIsNegative[a] ? boundsMin[a] : boundsMax[a];
+            Real tNear     = (nearPlane - query.Origin[a]) * query.InvDirection[a];
+            Real tFar      = (farPlane - query.Origin[a]) * query.InvDirection[a] * farScale;
+
+            tMin = tNear > tMin ? tNear : tMin;
+            tMax = tFar < tMax ? tFar : tMax;
+        }
+
+        return tMin <= tMax;
+    }
+
+    /*
+     * Offsets a ray origin off a surface, so the spawned ray can't hit that surface again due to rounding. The point is
+     * pushed along the normal past its error bounds and then rounded away from the surface (see pbrt, 3.9).
+     */
+    inline Point3 OffsetRayOrigin(const Point3& point, const Vector3& pointError, Vector3 normal, const Vector3& w)
+    {
+        if (DotProduct(w, normal) < 0)
+        {
+            normal = -normal;
+        }
+
+        // Rounding away from the surface also moves points that are exact (zero error) off it.
+        Point3 origin = point + DotProduct(Abs(normal), pointError) * normal;
+        for (int a = 0; a < 3; ++a)
+        {
+            if (normal[a] > 0)
+                origin[a] = NextRealUp(origin[a]);
+            else if (normal[a] < 0)
+                origin[a] = NextRealDown(origin[a]);
+        }
+
+        return origin;
+    }
+
+    class AABB
+    {
+    public:
+        AABB() {}
+        AABB(const Point3& a, const Point3& b) : m_Min(a), m_Max(b) {}
+
+        Point3 GetMin() const { return m_Min; }
+        Point3 GetMax() const { return m_Max; }
+
+        bool Hit(const RayQuery& query, Real tMin, Real tMax) const
+        {
+            Real boundsMin[3] = {m_Min.x(), m_Min.y(), m_Min.z()};
+            Real boundsMax[3] = {m_Max.x(), m_Max.y(), m_Max.z()};
+            return IntersectSlabs(query, boundsMin, boundsMax, tMin, tMax);
+        }
+
+        bool Hit(const Ray& r, Real tMin, Real tMax) const { return Hit(RayQuery(r), tMin, tMax); }
+
+    private:
+        Point3 m_Min;
+        Point3 m_Max;
+    };
+
+    inline AABB GetSurroundingBox(AABB box0, AABB box1)
+    {
+        return AABB(Min(box0.GetMin(), box1.GetMin()), Max(box0.GetMax(), box1.GetMax()));
+    }
+
+    class Camera
+    {
+    public:
+        Camera() {}
+        Camera(Point3  lookFrom,
+               Point3  lookAt,
+               Vector3 viewUp,
+               Real    verticalFOV,
+               Real    aspectRatio,
+               Real    aperture,
+               Real    focusDistance,
+               Real    time0 = 0,
+               Real    time1 = 0)
+        {
+            Real       theta          = Degrees2Radians(verticalFOV);
+            Real       h              = std::tan(theta / 2);
+            const Real viewportHeight = 2.0 * h;
+            const Real viewportWidth  = aspectRatio * viewportHeight;
+
+            m_W = Normalize(lookFrom - lookAt);
+            m_U = Normalize(CrossProduct(viewUp, m_W));
+            m_V = CrossProduct(m_W, m_U);
+
+            m_Origin          = lookFrom;
+            m_Horizontal      = focusDistance * viewportWidth * m_U;
+            m_Vertical        = focusDistance * viewportHeight * m_V;
+            m_LowerLeftCorner = m_Origin - m_Horizontal / 2 - m_Vertical / 2 - focusDistance * m_W;
+            m_LensRadius      = aperture / 2;
+
+            m_Time0 = time0;
+            m_Time1 = time1;
+        }
+
+        // Takes the lens and time dimensions from the sampler, the film position (s, t) is chosen by the caller.
+        Ray GetRay(Real s, Real t, Sampler& sampler) const
+        {
+            Vector3 rd     = m_LensRadius * SampleUniformDiskConcentric(sampler.Get2D());
+            Vector3 offset = m_U * rd.x() + m_V * rd.y();
+            Real    time   = m_Time0 + (m_Time1 - m_Time0) * sampler.Get1D();
+            return Ray(
+                m_Origin + offset, m_LowerLeftCorner + s * m_Horizontal + t * m_Vertical - m_Origin - offset, time);
+        }
+
+    private:
+        Point3  m_Origin;
+        Point3  m_LowerLeftCorner;
+        Vector3 m_Horizontal;
+        Vector3 m_Vertical;
+        Vector3 m_U, m_V, m_W;
+        Real    m_LensRadius;
+        Real    m_Time0, m_Time1;
+    };
+
+    class Perlin
+    {
+    public:
+        Perlin()
+        {
+            m_RanVec = new Vector3[PointCount];
+            for (int i = 0; i < PointCount; ++i)
+            {
+                m_RanVec[i] = Normalize(Vector3::GetRandom(-1, 1));
+            }
+
+            m_PermX = GeneratePerlinPerm();
+            m_PermY = GeneratePerlinPerm();
+            m_PermZ = GeneratePerlinPerm();
+        }
+
+        ~Perlin()
+        {
+            delete[] m_RanVec;
+            delete[] m_PermX;
+            delete[] m_PermY;
+            delete[] m_PermZ;
+        }
+
+        Real Turb(const Point3& point, int depth = 7) const
         {
-            double accum     = 0.0;
+            Real   accum     = 0.0;
             Point3 tempPoint = point;
-            double weight    = 1.0;
+            Real   weight    = 1.0;
 
             for (int i = 0; i < depth; ++i)
             {
@@ -367,11 +1577,11 @@ namespace VRaytracer
             return fabs(accum);
         }
 
-        double Noise(const Point3& point) const
+        Real Noise(const Point3& point) const
         {
-            double u = point.x() - floor(point.x());
-            double v = point.y() - floor(point.y());
-            double w = point.z() - floor(point.z());
+            Real u = point.x() - floor(point.x());
+            Real v = point.y() - floor(point.y());
+            Real w = point.z() - floor(point.z());
 
             int i = static_cast<int>(floor(point.x()));
             int j = static_cast<int>(floor(point.y()));
@@ -421,13 +1631,13 @@ namespace VRaytracer
             }
         }
 
-        static double PerlinInterpolate(Vector3 c[2][2][2], double u, double v, double w)
+        static Real PerlinInterpolate(Vector3 c[2][2][2], Real u, Real v, Real w)
         {
             // Hermitian Smoothing
-            u            = u * u * (3 - 2 * u);
-            v            = v * v * (3 - 2 * v);
-            w            = w * w * (3 - 2 * w);
-            double accum = 0.0;
+            u          = u * u * (3 - 2 * u);
+            v          = v * v * (3 - 2 * v);
+            w          = w * w * (3 - 2 * w);
+            Real accum = 0.0;
 
             for (int i = 0; i < 2; ++i)
             {
@@ -457,7 +1667,7 @@ namespace VRaytracer
     class Texture
     {
     public:
-        virtual Color GetValue(double u, double v, const Point3& point) const = 0;
+        virtual Color GetValue(Real u, Real v, const Point3& point) const = 0;
     };
 
     class SolidColor : public Texture
@@ -465,9 +1675,9 @@ namespace VRaytracer
     public:
         SolidColor() {}
         SolidColor(Color color) : m_ColorValue(color) {}
-        SolidColor(double red, double green, double blue) : SolidColor(Color(red, green, blue)) {}
+        SolidColor(Real red, Real green, Real blue) : SolidColor(Color(red, green, blue)) {}
 
-        virtual Color GetValue(double u, double v, const Point3& point) const override { return m_ColorValue; }
+        virtual Color GetValue(Real u, Real v, const Point3& point) const override { return m_ColorValue; }
 
     private:
         Color m_ColorValue;
@@ -486,7 +1696,7 @@ namespace VRaytracer
             m_Even(std::make_shared<SolidColor>(c1)), m_Odd(std::make_shared<SolidColor>(c2))
         {}
 
-        virtual Color GetValue(double u, double v, const Point3& point) const override
+        virtual Color GetValue(Real u, Real v, const Point3& point) const override
         {
             auto sines = sin(10 * point.x()) * sin(10 * point.y()) * sin(10 * point.z());
             if (sines < 0)
@@ -504,21 +1714,18 @@ namespace VRaytracer
     {
     public:
         NoiseTexture() {}
-        NoiseTexture(double scale) : m_Scale(scale) {}
+        NoiseTexture(Real scale) : m_Scale(scale) {}
 
-        virtual Color GetValue(double u, double v, const Point3& point) const override
+        virtual Color GetValue(Real u, Real v, const Point3& point) const override
         {
             return Color(1, 1, 1) * 0.5 * (1 + sin(m_Scale * point.z() + 10 * m_Noise.Turb(point)));
         }
 
     private:
         Perlin m_Noise;
-        double m_Scale;
+        Real   m_Scale;
     };
 
-    // need to link with stb_image
-    extern unsigned char* stbi_load(const char* fileName, int* width, int* height, int* pcpp, int cpp);
-
     class ImageTexture : public Texture
     {
     public:
@@ -538,9 +1745,9 @@ namespace VRaytracer
             m_BytesPerScanline = BytesPerPixel * m_Width;
         }
 
-        ~ImageTexture() { delete m_Data; }
+        ~ImageTexture() { stbi_image_free(m_Data); }
 
-        Color GetValue(double u, double v, const Point3& point) const override
+        Color GetValue(Real u, Real v, const Point3& point) const override
         {
             // If we have no texture data, then return solid cyan as a debugging aid.
             if (m_Data == nullptr)
@@ -559,7 +1766,7 @@ namespace VRaytracer
             if (j >= m_Height)
                 j = m_Height - 1;
 
-            const double   colorScale = 1.0 / 255.0;
+            const Real     colorScale = 1.0 / 255.0;
             unsigned char* pixel      = m_Data + j * m_BytesPerScanline + i * BytesPerPixel;
 
             return Color(colorScale * pixel[0], colorScale * pixel[1], colorScale * pixel[2]);
@@ -582,152 +1789,356 @@ namespace VRaytracer
      */
     struct HitRecord
     {
-        Point3                    Point;
-        Vector3                   Normal;
-        std::shared_ptr<Material> MaterialPtr;
-        double                    T;
-        double                    U;
-        double                    V;
-        bool                      IsFrontFace;
+        Point3   Point;
+        Vector3  PointError; // Conservative absolute error bounds of Point
+        Vector3  Normal;
+        uint32_t MaterialID; // Index into the MaterialTable of the scene
+        Real     T;
+        Real     U;
+        Real     V;
+        bool     IsFrontFace;
 
         inline void SetFaceNormal(const Ray& r, const Vector3& outwardNormal)
         {
             IsFrontFace = DotProduct(r.Direction(), outwardNormal) < 0;
             Normal      = IsFrontFace ? outwardNormal : -outwardNormal;
         }
+
+        // Spawns a ray leaving the hit point, its origin is moved to the side of the surface the direction points to.
+        inline Ray SpawnRay(const Vector3& direction, Real time) const
+        {
+            return Ray(OffsetRayOrigin(Point, PointError, Normal, direction), direction, time);
+        }
     };
 
     /*
-     * An abstraction of hittable objects.
+     * A point sampled on the surface of an emitter for light sampling. Pdf is with respect to solid angle at the point
+     * the sample was taken for.
      */
-    class Hittable
+    struct ShapeSample
     {
-    public:
-        virtual ~Hittable()                                                            = default;
-        virtual bool Hit(const Ray& r, double tMin, double tMax, HitRecord& rec) const = 0;
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const    = 0;
+        Point3   Point;
+        Vector3  Normal;
+        Real     U;
+        Real     V;
+        Real     Pdf;
+        uint32_t MaterialID;
+    };
+
+    class Hittable;
+
+    /*
+     * The result of the intersection phase: the closest t, the primitive that produced it, and the (folded) instance
+     * the primitive was reached through if any. Instances are one level deep, a Transform must not be placed inside
+     * the list or BVH of another Transform.
+     */
+    struct SurfaceHit
+    {
+        Real            T         = Infinity;
+        const Hittable* Primitive = nullptr;
+        const Hittable* Instance  = nullptr;
+        uint32_t        Element   = 0; // Primitive specific, e.g. the lane of a group or the face of a box
+        Real            B1        = 0; // Barycentrics of a triangle hit, b0 is 1 - B1 - B2
+        Real            B2        = 0;
+
+        inline void Set(Real t, const Hittable* primitive, uint32_t element = 0)
+        {
+            T         = t;
+            Primitive = primitive;
+            Instance  = nullptr;
+            Element   = element;
+        }
+
+        // Runs the surface phase for this hit, r is the ray that was intersected.
+        inline void ComputeSurfaceInteraction(const Ray& r, HitRecord& rec) const;
     };
 
-    class Translate : public Hittable
+    /*
+     * An abstraction of hittable objects.
+     *
+     * Intersection runs in two phases. Intersect only finds the closest t and records what was hit, so candidates
+     * that a nearer hit replaces later never pay for normals, UVs or material references. ComputeSurfaceInteraction
+     * then fills the HitRecord once, for the winner.
+     */
+    class Hittable
     {
     public:
-        Translate(std::shared_ptr<Hittable> ptr, const Vector3& displacement) : m_Ptr(ptr), m_Offset(displacement) {}
+        virtual ~Hittable() = default;
 
-        virtual bool Hit(const Ray& ray, double tMin, double tMax, HitRecord& rec) const override
-        {
-            Ray movedR(ray.Origin() - m_Offset, ray.Direction(), ray.Time());
-            if (!m_Ptr->Hit(movedR, tMin, tMax, rec))
-            {
-                return false;
-            }
+        // Returns true and updates hit if something is hit in [tMin, tMax].
+        virtual bool Intersect(const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const = 0;
 
-            rec.Point += m_Offset;
-            rec.SetFaceNormal(movedR, rec.Normal);
+        // Fills the surface data of a hit this primitive recorded, r is the ray that was passed to Intersect.
+        // Aggregates never record hits themselves, so they keep the empty default.
+        virtual void ComputeSurfaceInteraction(const Ray& r, const SurfaceHit& hit, HitRecord& rec) const {}
 
-            return true;
-        }
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const = 0;
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        // Both phases in one call.
+        bool Hit(const Ray& r, Real tMin, Real tMax, HitRecord& rec) const
         {
-            if (!m_Ptr->BoundingBox(time0, time1, outputBox))
-            {
+            SurfaceHit hit;
+            if (!Intersect(r, tMin, tMax, hit))
                 return false;
-            }
-
-            outputBox = AABB(outputBox.GetMin() + m_Offset, outputBox.GetMax() + m_Offset);
 
+            hit.ComputeSurfaceInteraction(r, rec);
             return true;
         }
-
-    private:
-        std::shared_ptr<Hittable> m_Ptr;
-        Vector3                   m_Offset;
     };
 
-    class RotateY : public Hittable
+    inline void SurfaceHit::ComputeSurfaceInteraction(const Ray& r, HitRecord& rec) const
+    {
+        const Hittable* finalizer = Instance ? Instance : Primitive;
+        finalizer->ComputeSurfaceInteraction(r, *this, rec);
+    }
+
+    /*
+     * An affine transformation, stored as the top three rows of a 4x4 matrix whose last row is always (0, 0, 0, 1).
+     */
+    class Matrix3x4
     {
     public:
-        RotateY(std::shared_ptr<Hittable> ptr, double angle) : m_Ptr(ptr)
+        Matrix3x4()
         {
-            double radians = Degrees2Radians(angle);
-            m_SinTheta     = sin(radians);
-            m_CosTheta     = cos(radians);
-            m_HasBox       = m_Ptr->BoundingBox(0, 1, m_BBox);
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 4; ++c)
+                    m_M[r][c] = r == c ? 1 : 0;
+        }
 
-            Point3 min(Infinity, Infinity, Infinity);
-            Point3 max(-Infinity, -Infinity, -Infinity);
+        static Matrix3x4 Translation(const Vector3& offset)
+        {
+            Matrix3x4 m;
+            for (int r = 0; r < 3; ++r)
+                m.m_M[r][3] = offset[r];
+            return m;
+        }
 
-            for (int i = 0; i < 2; ++i)
+        static Matrix3x4 Scale(const Vector3& scale)
+        {
+            Matrix3x4 m;
+            for (int r = 0; r < 3; ++r)
+                m.m_M[r][r] = scale[r];
+            return m;
+        }
+
+        // Counter-clockwise rotation by angle degrees about the axis, looking down the axis towards the origin.
+        static Matrix3x4 Rotation(Real angle, const Vector3& axis)
+        {
+            Vector3 k        = Normalize(axis);
+            Real    radians  = Degrees2Radians(angle);
+            Real    sinTheta = std::sin(radians);
+            Real    cosTheta = std::cos(radians);
+
+            // Rodrigues' formula: R = cos * I + sin * [k]x + (1 - cos) * k * k^T
+            const Real cross[3][3] = {{0, -k.z(), k.y()}, {k.z(), 0, -k.x()}, {-k.y(), k.x(), 0}};
+
+            Matrix3x4 m;
+            for (int r = 0; r < 3; ++r)
             {
-                for (int j = 0; j < 2; ++j)
+                for (int c = 0; c < 3; ++c)
                 {
-                    for (int k = 0; k < 2; ++k)
-                    {
-                        double x = i * m_BBox.GetMax().x() + (1 - i) * m_BBox.GetMin().x();
-                        double y = j * m_BBox.GetMax().y() + (1 - j) * m_BBox.GetMin().y();
-                        double z = k * m_BBox.GetMax().z() + (1 - k) * m_BBox.GetMin().z();
+                    Real diagonal = r == c ? cosTheta : 0;
+                    m.m_M[r][c]   = diagonal + sinTheta * cross[r][c] + (1 - cosTheta) * k[r] * k[c];
+                }
+            }
+            return m;
+        }
 
-                        double newX = m_CosTheta * x + m_SinTheta * z;
-                        double newZ = -m_SinTheta * x + m_CosTheta * z;
+        Real operator()(int row, int column) const { return m_M[row][column]; }
 
-                        Vector3 tester(newX, y, newZ);
+        // The transformation that applies other first, then this one.
+        Matrix3x4 operator*(const Matrix3x4& other) const
+        {
+            Matrix3x4 m;
+            for (int r = 0; r < 3; ++r)
+            {
+                for (int c = 0; c < 4; ++c)
+                {
+                    m.m_M[r][c] = m_M[r][0] * other.m_M[0][c] + m_M[r][1] * other.m_M[1][c] +
+                                  m_M[r][2] * other.m_M[2][c] + (c == 3 ? m_M[r][3] : 0);
+                }
+            }
+            return m;
+        }
 
-                        for (int c = 0; c < 3; ++c)
-                        {
-                            min[c] = fmin(min[c], tester[c]);
-                            max[c] = fmax(max[c], tester[c]);
-                        }
-                    }
+        Matrix3x4 GetInverse() const
+        {
+            // Cofactors of the linear part, then the translation is undone by the inverse linear part.
+            const auto& a = m_M;
+            Real        cofactors[3][3];
+            for (int r = 0; r < 3; ++r)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    int r0 = (r + 1) % 3, r1 = (r + 2) % 3;
+                    int c0 = (c + 1) % 3, c1 = (c + 2) % 3;
+
+                    cofactors[r][c] = a[r0][c0] * a[r1][c1] - a[r0][c1] * a[r1][c0];
                 }
             }
+
+            Real determinant = a[0][0] * cofactors[0][0] + a[0][1] * cofactors[0][1] + a[0][2] * cofactors[0][2];
+            if (determinant == 0)
+                throw std::runtime_error("Matrix3x4 is singular");
+
+            Matrix3x4 inverse;
+            for (int r = 0; r < 3; ++r)
+            {
+                for (int c = 0; c < 3; ++c)
+                    inverse.m_M[r][c] = cofactors[c][r] / determinant;
+            }
+            for (int r = 0; r < 3; ++r)
+            {
+                inverse.m_M[r][3] =
+                    -(inverse.m_M[r][0] * a[0][3] + inverse.m_M[r][1] * a[1][3] + inverse.m_M[r][2] * a[2][3]);
+            }
+            return inverse;
         }
 
-        virtual bool Hit(const Ray& ray, double tMin, double tMax, HitRecord& rec) const override
+        Point3 ApplyPoint(const Point3& p) const
         {
-            auto origin    = ray.Origin();
-            auto direction = ray.Direction();
+            return Point3(m_M[0][0] * p.x() + m_M[0][1] * p.y() + m_M[0][2] * p.z() + m_M[0][3],
+                          m_M[1][0] * p.x() + m_M[1][1] * p.y() + m_M[1][2] * p.z() + m_M[1][3],
+                          m_M[2][0] * p.x() + m_M[2][1] * p.y() + m_M[2][2] * p.z() + m_M[2][3]);
+        }
 
-            origin[0] = m_CosTheta * ray.Origin()[0] - m_SinTheta * ray.Origin()[2];
-            origin[2] = m_SinTheta * ray.Origin()[0] + m_CosTheta * ray.Origin()[2];
+        // Transforms a point with error bounds, the incoming error is carried through and the rounding error of the
+        // transformation itself is added (see pbrt, 3.9.4).
+        Point3 ApplyPoint(const Point3& p, const Vector3& pointError, Vector3& outError) const
+        {
+            for (int r = 0; r < 3; ++r)
+            {
+                Real propagated = std::fabs(m_M[r][0]) * pointError.x() + std::fabs(m_M[r][1]) * pointError.y() +
+                                  std::fabs(m_M[r][2]) * pointError.z();
+                Real rounding = std::fabs(m_M[r][0] * p.x()) + std::fabs(m_M[r][1] * p.y()) +
+                                std::fabs(m_M[r][2] * p.z()) + std::fabs(m_M[r][3]);
+                outError[r] = (1 + Gamma(3)) * propagated + Gamma(3) * rounding;
+            }
+            return ApplyPoint(p);
+        }
 
-            direction[0] = m_CosTheta * ray.Direction()[0] - m_SinTheta * ray.Direction()[2];
-            direction[2] = m_SinTheta * ray.Direction()[0] + m_CosTheta * ray.Direction()[2];
+        Vector3 ApplyVector(const Vector3& v) const
+        {
+            return Vector3(m_M[0][0] * v.x() + m_M[0][1] * v.y() + m_M[0][2] * v.z(),
+                           m_M[1][0] * v.x() + m_M[1][1] * v.y() + m_M[1][2] * v.z(),
+                           m_M[2][0] * v.x() + m_M[2][1] * v.y() + m_M[2][2] * v.z());
+        }
 
-            Ray rotatedR(origin, direction, ray.Time());
+        // Applies the transposed linear part. Called on the inverse matrix this transforms normals.
+        Vector3 ApplyTransposed(const Vector3& v) const
+        {
+            return Vector3(m_M[0][0] * v.x() + m_M[1][0] * v.y() + m_M[2][0] * v.z(),
+                           m_M[0][1] * v.x() + m_M[1][1] * v.y() + m_M[2][1] * v.z(),
+                           m_M[0][2] * v.x() + m_M[1][2] * v.y() + m_M[2][2] * v.z());
+        }
 
-            if (!m_Ptr->Hit(rotatedR, tMin, tMax, rec))
+        AABB ApplyBox(const AABB& box) const
+        {
+            Point3 min(Infinity, Infinity, Infinity);
+            Point3 max(-Infinity, -Infinity, -Infinity);
+            for (int corner = 0; corner < 8; ++corner)
             {
-                return false;
+                Point3 p((corner & 1) ? box.GetMax().x() : box.GetMin().x(),
+                         (corner & 2) ? box.GetMax().y() : box.GetMin().y(),
+                         (corner & 4) ? box.GetMax().z() : box.GetMin().z());
+                Point3 transformed = ApplyPoint(p);
+                min                = Min(min, transformed);
+                max                = Max(max, transformed);
             }
+            return AABB(min, max);
+        }
 
-            auto point  = rec.Point;
-            auto normal = rec.Normal;
+    private:
+        Real m_M[3][4];
+    };
 
-            point[0] = m_CosTheta * rec.Point[0] + m_SinTheta * rec.Point[2];
-            point[2] = -m_SinTheta * rec.Point[0] + m_CosTheta * rec.Point[2];
+    /*
+     * Places an object in the world with an affine transformation. Rays are moved into object space, and the hit is
+     * moved back. Wrapping a Transform in another one folds both matrices into a single instance, so a chain of
+     * wrappers built in the scene setup costs one ray transformation.
+     */
+    class Transform : public Hittable
+    {
+    public:
+        Transform(std::shared_ptr<Hittable> ptr, const Matrix3x4& objectToWorld) :
+            m_Ptr(ptr), m_ObjectToWorld(objectToWorld)
+        {
+            // The inner transform already folded everything below it, so one level is enough.
+            if (auto inner = std::dynamic_pointer_cast<Transform>(m_Ptr))
+            {
+                m_Ptr           = inner->m_Ptr;
+                m_ObjectToWorld = m_ObjectToWorld * inner->m_ObjectToWorld;
+            }
 
-            normal[0] = m_CosTheta * rec.Normal[0] + m_SinTheta * rec.Normal[2];
-            normal[2] = -m_SinTheta * rec.Normal[0] + m_CosTheta * rec.Normal[2];
+            m_WorldToObject = m_ObjectToWorld.GetInverse();
+        }
 
-            rec.Point = point;
-            rec.SetFaceNormal(rotatedR, normal);
+        virtual bool Intersect(const Ray& ray, Real tMin, Real tMax, SurfaceHit& hit) const override
+        {
+            if (!m_Ptr->Intersect(ToObjectSpace(ray), tMin, tMax, hit))
+            {
+                return false;
+            }
 
+            hit.Instance = this;
             return true;
         }
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        virtual void ComputeSurfaceInteraction(const Ray& ray, const SurfaceHit& hit, HitRecord& rec) const override
+        {
+            hit.Primitive->ComputeSurfaceInteraction(ToObjectSpace(ray), hit, rec);
+
+            Vector3 error;
+            rec.Point      = m_ObjectToWorld.ApplyPoint(rec.Point, rec.PointError, error);
+            rec.PointError = error;
+
+            // Normals transform with the inverse transpose. Dot products with the ray direction keep their sign, so the
+            // normal still faces the ray and IsFrontFace stays valid.
+            rec.Normal = Normalize(m_WorldToObject.ApplyTransposed(rec.Normal));
+        }
+
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
         {
-            outputBox = m_BBox;
+            if (!m_Ptr->BoundingBox(time0, time1, outputBox))
+            {
+                return false;
+            }
 
-            return m_HasBox;
+            outputBox = m_ObjectToWorld.ApplyBox(outputBox);
+
+            return true;
+        }
+
+        const Matrix3x4& GetObjectToWorld() const { return m_ObjectToWorld; }
+
+    private:
+        // The direction isn't normalized, so t is the same in both spaces.
+        Ray ToObjectSpace(const Ray& ray) const
+        {
+            return Ray(
+                m_WorldToObject.ApplyPoint(ray.Origin()), m_WorldToObject.ApplyVector(ray.Direction()), ray.Time());
         }
 
     private:
         std::shared_ptr<Hittable> m_Ptr;
-        double                    m_SinTheta;
-        double                    m_CosTheta;
-        bool                      m_HasBox;
-        AABB                      m_BBox;
+        Matrix3x4                 m_ObjectToWorld;
+        Matrix3x4                 m_WorldToObject;
+    };
+
+    class Translate : public Transform
+    {
+    public:
+        Translate(std::shared_ptr<Hittable> ptr, const Vector3& displacement) :
+            Transform(ptr, Matrix3x4::Translation(displacement))
+        {}
+    };
+
+    class RotateY : public Transform
+    {
+    public:
+        RotateY(std::shared_ptr<Hittable> ptr, Real angle) :
+            Transform(ptr, Matrix3x4::Rotation(angle, Vector3(0, 1, 0)))
+        {}
     };
 
     class HittableList : public Hittable
@@ -736,30 +2147,31 @@ namespace VRaytracer
         HittableList() {}
         HittableList(std::shared_ptr<Hittable> object) {}
 
-        std::vector<std::shared_ptr<Hittable>> GetObjects() const { return m_Objects; }
-        void                                   Clear() { m_Objects.clear(); }
-        void                                   Add(std::shared_ptr<Hittable> object) { m_Objects.push_back(object); }
+        const std::vector<std::shared_ptr<Hittable>>& GetObjects() const { return m_Objects; }
+        void                                          Clear() { m_Objects.clear(); }
+        void                                          Add(std::shared_ptr<Hittable> object)
+        {
+            m_Objects.push_back(object);
+        }
 
-        virtual bool Hit(const Ray& r, double tMin, double tMax, HitRecord& rec) const override
+        virtual bool Intersect(const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const override
         {
-            HitRecord tempRec;
-            bool      hitAnything  = false;
-            double    closestSoFar = tMax;
+            bool hitAnything  = false;
+            Real closestSoFar = tMax;
 
             for (const auto& object : m_Objects)
             {
-                if (object->Hit(r, tMin, closestSoFar, tempRec))
+                if (object->Intersect(r, tMin, closestSoFar, hit))
                 {
                     hitAnything  = true;
-                    closestSoFar = tempRec.T;
-                    rec          = tempRec;
+                    closestSoFar = hit.T;
                 }
             }
 
             return hitAnything;
         }
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
         {
             if (m_Objects.empty())
                 return false;
@@ -783,710 +2195,3412 @@ namespace VRaytracer
         std::vector<std::shared_ptr<Hittable>> m_Objects;
     };
 
-    class XYRect : public Hittable
+    template<int Axis>
+    class AxisAlignedRectGroup;
+
+    /*
+     * A rectangle in the plane where the Axis component is K. The other two axes span it, U is the lower and V the
+     * higher one of them, so XYRect, XZRect and YZRect all take (u0, u1, v0, v1, k) in their natural order.
+     */
+    template<int Axis>
+    class AxisAlignedRect : public Hittable
     {
     public:
-        XYRect() {}
-        XYRect(double x0, double x1, double y0, double y1, double k, std::shared_ptr<Material> material) :
-            m_X0(x0), m_X1(x1), m_Y0(y0), m_Y1(y1), m_K(k), m_Material(material)
+        static_assert(Axis >= 0 && Axis < 3, "Axis must be 0 (X), 1 (Y) or 2 (Z)");
+
+        static constexpr int UAxis = Axis == 0 ? 1 : 0;
+        static constexpr int VAxis = Axis == 2 ? 1 : 2;
+
+        AxisAlignedRect() {}
+        AxisAlignedRect(Real u0, Real u1, Real v0, Real v1, Real k, uint32_t materialID) :
+            m_MaterialID(materialID), m_U0(u0), m_U1(u1), m_V0(v0), m_V1(v1), m_K(k), m_Area((u1 - u0) * (v1 - v0))
         {}
 
-        virtual bool Hit(const Ray& ray, double tMin, double tMax, HitRecord& rec) const override
+        virtual bool Intersect(const Ray& ray, Real tMin, Real tMax, SurfaceHit& hit) const override
         {
-            double t = (m_K - ray.Origin().z()) / ray.Direction().z();
+            Real t = (m_K - ray.Origin()[Axis]) / ray.Direction()[Axis];
             if (t < tMin || t > tMax)
             {
                 return false;
             }
 
-            double x = ray.Origin().x() + t * ray.Direction().x();
-            double y = ray.Origin().y() + t * ray.Direction().y();
-            if (x < m_X0 || x > m_X1 || y < m_Y0 || y > m_Y1)
+            Real u = ray.Origin()[UAxis] + t * ray.Direction()[UAxis];
+            Real v = ray.Origin()[VAxis] + t * ray.Direction()[VAxis];
+            if (u < m_U0 || u > m_U1 || v < m_V0 || v > m_V1)
             {
                 return false;
             }
 
-            rec.U = (x - m_X0) / (m_X1 - m_X0);
-            rec.V = (y - m_Y0) / (m_Y1 - m_Y0);
-            rec.T = t;
-
-            Vector3 outwardNormal = Vector3(0, 0, 1);
-            rec.SetFaceNormal(ray, outwardNormal);
-            rec.MaterialPtr = m_Material;
-            rec.Point       = ray.At(t);
-
+            hit.Set(t, this);
             return true;
         }
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        virtual void ComputeSurfaceInteraction(const Ray& ray, const SurfaceHit& hit, HitRecord& rec) const override
         {
-            // The bounding box must have non-zero width in each dimension, so pad the Z
-            // dimension a small amount.
-            outputBox = AABB(Point3(m_X0, m_Y0, m_K - 0.0001), Point3(m_X1, m_Y1, m_K + 0.0001));
+            SetHitRecord(ray, hit.T, m_U0, m_U1, m_V0, m_V1, m_K, m_MaterialID, rec);
+        }
+
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
+        {
+            // The bounding box must have non-zero width in each dimension, so pad the plane axis a small amount.
+            Point3 min, max;
+            min[Axis]  = m_K - 0.0001;
+            max[Axis]  = m_K + 0.0001;
+            min[UAxis] = m_U0;
+            max[UAxis] = m_U1;
+            min[VAxis] = m_V0;
+            max[VAxis] = m_V1;
+            outputBox  = AABB(min, max);
             return true;
         }
 
-    private:
-        std::shared_ptr<Material> m_Material;
-        double                    m_X0, m_X1, m_Y0, m_Y1, m_K;
-    };
+        Real     GetArea() const { return m_Area; }
+        uint32_t GetMaterialID() const { return m_MaterialID; }
+        Vector3  GetNormal() const
+        {
+            Vector3 normal(0, 0, 0);
+            normal[Axis] = 1;
+            return normal;
+        }
 
-    class XZRect : public Hittable
-    {
-    public:
-        XZRect() {}
-        XZRect(double x0, double x1, double z0, double z1, double k, std::shared_ptr<Material> material) :
-            m_X0(x0), m_X1(x1), m_Z0(z0), m_Z1(z1), m_K(k), m_Material(material)
-        {}
+        // Uniform point on the rect, the pdf is converted to solid angle at reference.
+        bool Sample(const Point3& reference, Sample2D u, ShapeSample& sample) const
+        {
+            sample.Point[Axis]  = m_K;
+            sample.Point[UAxis] = m_U0 + u.X * (m_U1 - m_U0);
+            sample.Point[VAxis] = m_V0 + u.Y * (m_V1 - m_V0);
+            sample.Normal       = GetNormal();
+            sample.U            = u.X;
+            sample.V            = u.Y;
+            sample.MaterialID   = m_MaterialID;
+
+            sample.Pdf = Pdf(reference, sample.Point);
+            return sample.Pdf > 0;
+        }
 
-        virtual bool Hit(const Ray& ray, double tMin, double tMax, HitRecord& rec) const override
+        // The solid angle density of Sample choosing point, a point of the rect, as seen from reference.
+        Real Pdf(const Point3& reference, const Point3& point) const
         {
-            double t = (m_K - ray.Origin().y()) / ray.Direction().y();
-            if (t < tMin || t > tMax)
-            {
-                return false;
-            }
+            Vector3 toPoint         = point - reference;
+            Real    distanceSquared = toPoint.LengthSquared();
+            Real    cosine          = std::fabs(toPoint[Axis]) / std::sqrt(distanceSquared);
+            if (cosine == 0)
+                return 0;
 
-            double x = ray.Origin().x() + t * ray.Direction().x();
-            double z = ray.Origin().z() + t * ray.Direction().z();
-            if (x < m_X0 || x > m_X1 || z < m_Z0 || z > m_Z1)
-            {
-                return false;
-            }
+            return distanceSquared / (cosine * m_Area);
+        }
 
-            rec.U = (x - m_X0) / (m_X1 - m_X0);
-            rec.V = (z - m_Z0) / (m_Z1 - m_Z0);
-            rec.T = t;
+        static void SetHitRecord(const Ray& ray,
+                                 Real       t,
+                                 Real       u0,
+                                 Real       u1,
+                                 Real       v0,
+                                 Real       v1,
+                                 Real       k,
+                                 uint32_t   materialID,
+                                 HitRecord& rec)
+        {
+            rec.T     = t;
+            rec.Point = ray.At(t);
+            rec.U     = (rec.Point[UAxis] - u0) / (u1 - u0);
+            rec.V     = (rec.Point[VAxis] - v0) / (v1 - v0);
 
-            Vector3 outwardNormal = Vector3(0, 1, 0);
+            Vector3 outwardNormal(0, 0, 0);
+            outwardNormal[Axis] = 1;
             rec.SetFaceNormal(ray, outwardNormal);
-            rec.MaterialPtr = m_Material;
-            rec.Point       = ray.At(t);
-
-            return true;
-        }
+            rec.MaterialID = materialID;
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
-        {
-            // The bounding box must have non-zero width in each dimension, so pad the Y
-            // dimension a small amount.
-            outputBox = AABB(Point3(m_X0, m_K - 0.0001, m_Z0), Point3(m_X1, m_K + 0.0001, m_Z1));
-            return true;
+            // Snap the hit point onto the plane. The error bound is kept for all axes, a zero bound would offset points
+            // on planes through the origin to denormals, which are very slow to compute with.
+            rec.Point[Axis] = k;
+            rec.PointError  = Gamma(3) * (Abs(ray.Origin()) + std::fabs(t) * Abs(ray.Direction()));
         }
 
     private:
-        std::shared_ptr<Material> m_Material;
-        double                    m_X0, m_X1, m_Z0, m_Z1, m_K;
+        friend class AxisAlignedRectGroup<Axis>;
+
+        uint32_t m_MaterialID;
+        Real     m_U0, m_U1, m_V0, m_V1, m_K;
+        Real     m_Area;
     };
 
-    class YZRect : public Hittable
+    using XYRect = AxisAlignedRect<2>;
+    using XZRect = AxisAlignedRect<1>;
+    using YZRect = AxisAlignedRect<0>;
+
+    /*
+     * Up to MaxRects rects of the same orientation stored as structure of arrays and tested Simd::Wide::Width at a
+     * time, the counterpart of SphereGroup for walls and other large rects. Unused lanes have NaN bounds, which fail
+     * every comparison.
+     */
+    template<int Axis>
+    class AxisAlignedRectGroup : public Hittable
     {
     public:
-        YZRect() {}
-        YZRect(double y0, double y1, double z0, double z1, double k, std::shared_ptr<Material> material) :
-            m_Y0(y0), m_Y1(y1), m_Z0(z0), m_Z1(z1), m_K(k), m_Material(material)
-        {}
-
-        virtual bool Hit(const Ray& ray, double tMin, double tMax, HitRecord& rec) const override
-        {
-            double t = (m_K - ray.Origin().x()) / ray.Direction().x();
-            if (t < tMin || t > tMax)
-            {
-                return false;
-            }
-
-            double y = ray.Origin().y() + t * ray.Direction().y();
-            double z = ray.Origin().z() + t * ray.Direction().z();
-            if (y < m_Y0 || y > m_Y1 || z < m_Z0 || z > m_Z1)
-            {
-                return false;
-            }
+        using Rect = AxisAlignedRect<Axis>;
 
-            rec.U = (y - m_Y0) / (m_Y1 - m_Y0);
-            rec.V = (z - m_Z0) / (m_Z1 - m_Z0);
-            rec.T = t;
-
-            Vector3 outwardNormal = Vector3(1, 0, 0);
-            rec.SetFaceNormal(ray, outwardNormal);
-            rec.MaterialPtr = m_Material;
-            rec.Point       = ray.At(t);
+        static constexpr uint32_t MaxRects = 8;
+        static_assert(MaxRects % Simd::Wide::Width == 0, "AxisAlignedRectGroup lanes must fill whole registers");
 
-            return true;
+        AxisAlignedRectGroup()
+        {
+            const Real nan = std::numeric_limits<Real>::quiet_NaN();
+            for (Real* lanes : {m_U0, m_U1, m_V0, m_V1, m_K})
+                std::fill(lanes, lanes + MaxRects, nan);
+            std::fill(std::begin(m_MaterialIDs), std::end(m_MaterialIDs), 0);
         }
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        bool IsFull() const { return m_Count == MaxRects; }
+
+        void Add(const Rect& rect)
         {
-            // The bounding box must have non-zero width in each dimension, so pad the X
-            // dimension a small amount.
-            outputBox = AABB(Point3(m_K - 0.0001, m_Y0, m_Z0), Point3(m_K + 0.0001, m_Y1, m_Z1));
-            return true;
+            if (IsFull())
+                throw std::out_of_range("AxisAlignedRectGroup is full");
+
+            AABB box;
+            rect.BoundingBox(0, 0, box);
+            m_Box = m_Count == 0 ? box : GetSurroundingBox(m_Box, box);
+
+            m_U0[m_Count]          = rect.m_U0;
+            m_U1[m_Count]          = rect.m_U1;
+            m_V0[m_Count]          = rect.m_V0;
+            m_V1[m_Count]          = rect.m_V1;
+            m_K[m_Count]           = rect.m_K;
+            m_MaterialIDs[m_Count] = rect.m_MaterialID;
+            ++m_Count;
         }
 
-    private:
-        std::shared_ptr<Material> m_Material;
-        double                    m_Y0, m_Y1, m_Z0, m_Z1, m_K;
-    };
-
-    class Box : public Hittable
-    {
-    public:
-        Box() {}
-        Box(const Point3& p0, const Point3& p1, std::shared_ptr<Material> ptr) : m_BoxMin(p0), m_BoxMax(p1)
+        virtual bool Intersect(const Ray& ray, Real tMin, Real tMax, SurfaceHit& hit) const override
         {
-            m_Sides.Add(std::make_shared<XYRect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-            m_Sides.Add(std::make_shared<XYRect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+            namespace W = Simd::Wide;
+
+            const W::Register origin     = W::Broadcast(ray.Origin()[Axis]);
+            const W::Register invD       = W::Broadcast(1 / ray.Direction()[Axis]);
+            const W::Register originU    = W::Broadcast(ray.Origin()[Rect::UAxis]);
+            const W::Register originV    = W::Broadcast(ray.Origin()[Rect::VAxis]);
+            const W::Register directionU = W::Broadcast(ray.Direction()[Rect::UAxis]);
+            const W::Register directionV = W::Broadcast(ray.Direction()[Rect::VAxis]);
+            const W::Register tMinV      = W::Broadcast(tMin);
+
+            int  hitIndex = -1;
+            Real closest  = tMax;
+            for (uint32_t base = 0; base < m_Count; base += W::Width)
+            {
+                W::Register t = W::Mul(W::Sub(W::Load(m_K + base), origin), invD);
+                W::Register u = W::Add(originU, W::Mul(t, directionU));
+                W::Register v = W::Add(originV, W::Mul(t, directionV));
+
+                W::Register u0 = W::Load(m_U0 + base);
+                W::Register u1 = W::Load(m_U1 + base);
+                W::Register v0 = W::Load(m_V0 + base);
+                W::Register v1 = W::Load(m_V1 + base);
+
+                W::Mask inRange  = W::And(W::GreaterEqual(t, tMinV), W::LessEqual(t, W::Broadcast(closest)));
+                W::Mask inU      = W::And(W::GreaterEqual(u, u0), W::LessEqual(u, u1));
+                W::Mask inV      = W::And(W::GreaterEqual(v, v0), W::LessEqual(v, v1));
+                int     laneMask = W::MoveMask(W::And(inRange, W::And(inU, inV)));
+                if (laneMask == 0)
+                    continue;
+
+                alignas(32) Real roots[W::Width];
+                W::Store(roots, t);
+                for (int lane = 0; lane < W::Width; ++lane)
+                {
+                    if ((laneMask & (1 << lane)) && roots[lane] <= closest)
+                    {
+                        closest  = roots[lane];
+                        hitIndex = static_cast<int>(base) + lane;
+                    }
+                }
+            }
 
-            m_Sides.Add(std::make_shared<XZRect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-            m_Sides.Add(std::make_shared<XZRect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+            if (hitIndex < 0)
+                return false;
 
-            m_Sides.Add(std::make_shared<YZRect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-            m_Sides.Add(std::make_shared<YZRect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+            hit.Set(closest, this, hitIndex);
+            return true;
         }
 
-        virtual bool Hit(const Ray& ray, double tMin, double tMax, HitRecord& rec) const override
+        virtual void ComputeSurfaceInteraction(const Ray& ray, const SurfaceHit& hit, HitRecord& rec) const override
         {
-            return m_Sides.Hit(ray, tMin, tMax, rec);
+            uint32_t hitIndex = hit.Element;
+            Rect::SetHitRecord(ray,
+                               hit.T,
+                               m_U0[hitIndex],
+                               m_U1[hitIndex],
+                               m_V0[hitIndex],
+                               m_V1[hitIndex],
+                               m_K[hitIndex],
+                               m_MaterialIDs[hitIndex],
+                               rec);
         }
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
         {
-            outputBox = AABB(m_BoxMin, m_BoxMax);
-            return true;
+            outputBox = m_Box;
+            return m_Count > 0;
         }
 
     private:
-        Point3       m_BoxMin;
-        Point3       m_BoxMax;
-        HittableList m_Sides;
+        // Aligned for Simd::Wide::Load, see Simd::Wide.
+        alignas(Simd::Wide::Alignment) Real m_U0[MaxRects];
+        Real                                m_U1[MaxRects];
+        Real                                m_V0[MaxRects];
+        Real                                m_V1[MaxRects];
+        Real                                m_K[MaxRects];
+        uint32_t                            m_MaterialIDs[MaxRects];
+        uint32_t                            m_Count = 0;
+        AABB                                m_Box;
     };
 
-    inline bool BoxCompare(const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b, int axis)
-    {
-        AABB boxA, boxB;
-
-        if (!a->BoundingBox(0, 0, boxA) || !b->BoundingBox(0, 0, boxB))
-            std::cerr << "No bounding box in BVHNode constructor." << std::endl;
-
-        return boxA.GetMin()[axis] < boxB.GetMin()[axis];
-    }
-
-    inline bool BoxCompareX(const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b)
-    {
-        return BoxCompare(a, b, 0);
-    }
-
-    inline bool BoxCompareY(const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b)
-    {
-        return BoxCompare(a, b, 1);
-    }
-
-    inline bool BoxCompareZ(const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b)
-    {
-        return BoxCompare(a, b, 2);
-    }
-
-    class BVHNode : public Hittable
+    /*
+     * An axis-aligned box intersected as the overlap of three slabs. The slab that limits the entry (or the exit, for
+     * rays starting inside) is the face that was hit, its UVs match the XYRect/XZRect/YZRect faces the box used to be
+     * made of.
+     */
+    class Box : public Hittable
     {
     public:
-        BVHNode() {}
-        BVHNode(const HittableList& list, double time0, double time1) :
-            BVHNode(list.GetObjects(), 0, list.GetObjects().size(), time0, time1)
+        Box() {}
+        Box(const Point3& p0, const Point3& p1, uint32_t materialID) :
+            m_BoxMin(p0), m_BoxMax(p1), m_MaterialID(materialID)
         {}
-        BVHNode(const std::vector<std::shared_ptr<Hittable>>& srcObjects,
-                size_t                                        start,
-                size_t                                        end,
-                double                                        time0,
-                double                                        time1)
-        {
-            auto objects = srcObjects; // Create a modifiable array of the source scene objects
 
-            // chose an axis to compare
-            int axis = GetRandomInt(0, 2);
+        virtual bool Intersect(const Ray& ray, Real tMin, Real tMax, SurfaceHit& hit) const override
+        {
+            const Point3  origin    = ray.Origin();
+            const Vector3 direction = ray.Direction();
+
+            Real tEnter    = -Infinity;
+            Real tExit     = Infinity;
+            int  enterAxis = 0;
+            int  exitAxis  = 0;
+            for (int a = 0; a < 3; ++a)
+            {
+                Real invD  = 1 / direction[a];
+                Real tNear = ((invD < 0 ? m_BoxMax[a] : m_BoxMin[a]) - origin[a]) * invD;
+                Real tFar  = ((invD < 0 ? m_BoxMin[a] : m_BoxMax[a]) - origin[a]) * invD;
 
-            auto comparator = (axis == 0) ? BoxCompareX : (axis == 1) ? BoxCompareY : BoxCompareZ;
+                // A NaN (the origin on a plane parallel to the ray) fails both comparisons and leaves the slab open.
+                if (tNear > tEnter)
+                {
+                    tEnter    = tNear;
+                    enterAxis = a;
+                }
+                if (tFar < tExit)
+                {
+                    tExit    = tFar;
+                    exitAxis = a;
+                }
+            }
 
-            size_t objectSpan = end - start;
+            if (tEnter > tExit)
+                return false;
 
-            if (objectSpan == 1)
+            Real t;
+            int  axis;
+            bool isExit;
+            if (tEnter >= tMin && tEnter <= tMax)
             {
-                m_Left = m_Right = objects[start];
+                t      = tEnter;
+                axis   = enterAxis;
+                isExit = false;
             }
-            else if (objectSpan == 2)
+            else if (tExit >= tMin && tExit <= tMax)
             {
-                if (comparator(objects[start], objects[start + 1]))
-                {
-                    m_Left  = objects[start];
-                    m_Right = objects[start + 1];
-                }
-                else
-                {
-                    m_Left  = objects[start + 1];
-                    m_Right = objects[start];
-                }
+                t      = tExit;
+                axis   = exitAxis;
+                isExit = true;
             }
             else
             {
-                std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
-                auto mid = start + objectSpan / 2;
-                m_Left   = std::make_shared<BVHNode>(objects, start, mid, time0, time1);
-                m_Right  = std::make_shared<BVHNode>(objects, mid, end, time0, time1);
+                return false;
             }
 
-            AABB boxLeft, boxRight;
-
-            if (!m_Left->BoundingBox(time0, time1, boxLeft) || !m_Right->BoundingBox(time0, time1, boxRight))
-            {
-                std::cerr << "No bounding box in BVHNode constructor." << std::endl;
-            }
+            // The ray enters through the face it moves towards and leaves through the opposite one.
+            bool isMaxFace = (direction[axis] < 0) != isExit;
 
-            m_Box = GetSurroundingBox(boxLeft, boxRight);
+            hit.Set(t, this, axis | (isMaxFace ? 4 : 0));
+            return true;
         }
 
-        virtual bool Hit(const Ray& r, double tMin, double tMax, HitRecord& rec) const override
+        virtual void ComputeSurfaceInteraction(const Ray& ray, const SurfaceHit& hit, HitRecord& rec) const override
         {
-            if (!m_Box.Hit(r, tMin, tMax))
-                return false;
+            const Point3  origin    = ray.Origin();
+            const Vector3 direction = ray.Direction();
+
+            Real t         = hit.T;
+            int  axis      = hit.Element & 3;
+            bool isMaxFace = (hit.Element & 4) != 0;
+
+            rec.T           = t;
+            rec.Point       = ray.At(t);
+            rec.Point[axis] = isMaxFace ? m_BoxMax[axis] : m_BoxMin[axis];
+            rec.PointError  = Gamma(3) * (Abs(origin) + std::fabs(t) * Abs(direction));
 
-            bool hitLeft  = m_Left->Hit(r, tMin, tMax, rec);
-            bool hitRight = m_Right->Hit(r, tMin, hitLeft ? rec.T : tMax, rec);
+            // Same parameterization as the rect faces, U and V follow the lower and higher of the two other axes.
+            int uAxis = axis == 0 ? 1 : 0;
+            int vAxis = axis == 2 ? 1 : 2;
+            rec.U     = (rec.Point[uAxis] - m_BoxMin[uAxis]) / (m_BoxMax[uAxis] - m_BoxMin[uAxis]);
+            rec.V     = (rec.Point[vAxis] - m_BoxMin[vAxis]) / (m_BoxMax[vAxis] - m_BoxMin[vAxis]);
 
-            return hitLeft || hitRight;
+            Vector3 outwardNormal(0, 0, 0);
+            outwardNormal[axis] = isMaxFace ? 1 : -1;
+            rec.SetFaceNormal(ray, outwardNormal);
+            rec.MaterialID = m_MaterialID;
         }
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
         {
-            outputBox = m_Box;
+            outputBox = AABB(m_BoxMin, m_BoxMax);
             return true;
         }
 
     private:
-        std::shared_ptr<Hittable> m_Left;
-        std::shared_ptr<Hittable> m_Right;
-        AABB                      m_Box;
-    };
-
-    class Material
-    {
-    public:
-        virtual bool  Scatter(const Ray& rIn, const HitRecord& rec, Color& attenuation, Ray& scattered) const = 0;
-        virtual Color Emitted(double u, double v, const Point3& point) const { return Black; }
+        Point3   m_BoxMin;
+        Point3   m_BoxMax;
+        uint32_t m_MaterialID;
     };
 
-    class Lambertian : public Material
+    class ThreadPool
     {
     public:
-        Lambertian(const Color& albedo) : m_Albedo(std::make_shared<SolidColor>(albedo)) {}
-        Lambertian(std::shared_ptr<Texture> albedo) : m_Albedo(std::move(albedo)) {}
-
-        virtual bool Scatter(const Ray& rIn, const HitRecord& rec, Color& attenuation, Ray& scattered) const override
+        // The constructor just launches some amount of workers
+        ThreadPool(size_t threads) : m_Stop(false)
         {
-            auto scatterDirection = rec.Normal + GetRandomUnitVector();
+            for (size_t i = 0; i < threads; ++i)
+                m_Workers.emplace_back([this] {
+                    s_IsWorkerThread = true;
 
-            // Catch degenerate scatter direction
-            if (scatterDirection.IsNearZero())
-                scatterDirection = rec.Normal;
+                    for (;;)
+                    {
+                        std::function<void()> task;
 
-            scattered   = Ray(rec.Point, scatterDirection, rIn.Time());
-            attenuation = m_Albedo->GetValue(rec.U, rec.V, rec.Point);
-            return true;
+                        {
+                            std::unique_lock<std::mutex> lock(this->m_QueueMutex);
+                            this->m_Condition.wait(lock, [this] { return this->m_Stop || !this->m_Tasks.empty(); });
+                            if (this->m_Stop && this->m_Tasks.empty())
+                                return;
+                            task = std::move(this->m_Tasks.front());
+                            this->m_Tasks.pop();
+                        }
+
+                        task();
+                    }
+                });
         }
 
-    private:
-        std::shared_ptr<Texture> m_Albedo;
-    };
+        // Add new work item to the pool
+        template<class F, class... Args>
+        std::future<typename std::result_of<F(Args...)>::type> Enqueue(F&& f, Args&&... args)
+        {
+            using return_type = typename std::result_of<F(Args...)>::type;
 
-    class Metal : public Material
-    {
-    public:
-        Metal(const Color& albedo, double fuzz) : m_Albedo(albedo), m_Fuzz(fuzz < 1 ? fuzz : 1) {}
+            auto task = std::make_shared<std::packaged_task<return_type()>>(
+                std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+
+            std::future<return_type> res = task->get_future();
+            {
+                std::unique_lock<std::mutex> lock(m_QueueMutex);
+
+                // don't allow enqueueing after stopping the pool
+                if (m_Stop)
+                    throw std::runtime_error("enqueue on stopped ThreadPool");
+
+                m_Tasks.emplace([task]() { (*task)(); });
+            }
+            m_Condition.notify_one();
+            return res;
+        }
+
+        size_t GetThreadCount() const { return m_Workers.size(); }
+
+        // Whether the calling thread is one of the workers of a pool. Blocking on pool tasks from a worker may
+        // deadlock, so callers that fan out work check this first.
+        static bool IsWorkerThread() { return s_IsWorkerThread; }
 
-        virtual bool Scatter(const Ray& rIn, const HitRecord& rec, Color& attenuation, Ray& scattered) const override
+        // The destructor joins all threads
+        ~ThreadPool()
         {
-            Vector3 reflected = Reflect(Normalize(rIn.Direction()), rec.Normal);
-            scattered         = Ray(rec.Point, reflected + m_Fuzz * GetRandomInUnitSphere(), rIn.Time());
-            attenuation       = m_Albedo;
-            return DotProduct(scattered.Direction(), rec.Normal) > 0;
+            {
+                std::unique_lock<std::mutex> lock(m_QueueMutex);
+                m_Stop = true;
+            }
+            m_Condition.notify_all();
+            for (std::thread& worker : m_Workers)
+                worker.join();
         }
 
     private:
-        Color  m_Albedo;
-        double m_Fuzz;
+        // need to keep track of threads so we can join them
+        std::vector<std::thread> m_Workers;
+        // the task queue
+        std::queue<std::function<void()>> m_Tasks;
+
+        // synchronization
+        std::mutex              m_QueueMutex;
+        std::condition_variable m_Condition;
+        bool                    m_Stop;
+
+        static thread_local bool s_IsWorkerThread;
     };
 
-    class Dielectric : public Material
+    inline thread_local bool ThreadPool::s_IsWorkerThread = false;
+
+    // Keep one hardware thread for the UI, but always have at least one worker.
+    inline ThreadPool Pool(std::max(2u, std::thread::hardware_concurrency()) - 1);
+
+    /*
+     * Calls body(i) for every i in [0, count), handing out chunks of chunkSize iterations to the pool. The calling
+     * thread helps and returns once every iteration is done. On a pool worker the loop runs serially, as blocking there
+     * may deadlock.
+     */
+    template<class Body>
+    void ParallelFor(size_t count, size_t chunkSize, const Body& body)
     {
-    public:
-        Dielectric(double indexOfRefraction) : m_IR(indexOfRefraction) {}
+        size_t chunkCount  = (count + chunkSize - 1) / chunkSize;
+        size_t helperCount = ThreadPool::IsWorkerThread() ? 0 : std::min(Pool.GetThreadCount(), chunkCount);
+        if (helperCount <= 1)
+        {
+            for (size_t i = 0; i < count; ++i)
+                body(i);
+            return;
+        }
 
-        virtual bool Scatter(const Ray& rIn, const HitRecord& rec, Color& attenuation, Ray& scattered) const override
+        struct SharedState
         {
-            attenuation            = White;
-            double refractionRatio = rec.IsFrontFace ? (1.0 / m_IR) : m_IR;
+            std::atomic<size_t>     NextChunk {0};
+            size_t                  ChunkCount    = 0;
+            size_t                  FinishedCount = 0;
+            std::mutex              Mutex;
+            std::condition_variable Finished;
+        };
+
+        auto state        = std::make_shared<SharedState>();
+        state->ChunkCount = chunkCount;
+
+        // Helpers that start after the last chunk was taken return without touching body.
+        auto runChunks = [state, count, chunkSize, &body]() {
+            size_t chunk;
+            while ((chunk = state->NextChunk.fetch_add(1)) < state->ChunkCount)
+            {
+                size_t end = std::min(count, (chunk + 1) * chunkSize);
+                for (size_t i = chunk * chunkSize; i < end; ++i)
+                    body(i);
 
-            Vector3 unitDirection = Normalize(rIn.Direction());
-            double  cosTheta      = fmin(DotProduct(-unitDirection, rec.Normal), 1.0);
-            double  sinTheta      = std::sqrt(1.0 - cosTheta * cosTheta);
+                std::lock_guard<std::mutex> lock(state->Mutex);
+                if (++state->FinishedCount == state->ChunkCount)
+                    state->Finished.notify_all();
+            }
+        };
 
-            bool    cannotRefract = refractionRatio * sinTheta > 1.0;
-            Vector3 direction;
+        for (size_t i = 0; i + 1 < helperCount; ++i)
+        {
+            Pool.Enqueue(runChunks);
+        }
 
-            if (cannotRefract || GetReflectance(cosTheta, refractionRatio) > GetRandomDouble())
+        runChunks();
+
+        std::unique_lock<std::mutex> lock(state->Mutex);
+        state->Finished.wait(lock, [&] { return state->FinishedCount == state->ChunkCount; });
+    }
+
+    /*
+     * A piecewise-constant distribution over [0, 1) with one segment per value of a non-negative function, sampled by
+     * inverting its CDF. A function that is zero everywhere is sampled uniformly.
+     */
+    class Distribution1D
+    {
+    public:
+        Distribution1D() {}
+        Distribution1D(std::vector<Real> function) : m_Function(std::move(function)), m_Cdf(m_Function.size() + 1)
+        {
+            size_t count = m_Function.size();
+            m_Cdf[0]     = 0;
+            for (size_t i = 0; i < count; ++i)
             {
-                // Must Reflect
-                direction = Reflect(unitDirection, rec.Normal);
+                m_Cdf[i + 1] = m_Cdf[i] + m_Function[i] / count;
             }
-            else
+
+            m_Integral = m_Cdf[count];
+            for (size_t i = 1; i <= count; ++i)
             {
-                direction = Refract(unitDirection, rec.Normal, refractionRatio);
+                m_Cdf[i] = m_Integral > 0 ? m_Cdf[i] / m_Integral : static_cast<Real>(i) / count;
             }
-
-            scattered = Ray(rec.Point, direction, rIn.Time());
-            return true;
         }
 
-    private:
-        static double GetReflectance(double cosine, double refIndex)
+        Real   GetIntegral() const { return m_Integral; }
+        size_t GetCount() const { return m_Function.size(); }
+
+        // Maps u to a point of [0, 1) and its density, offset receives the segment it falls in.
+        Real Sample(Real u, Real& pdf, size_t& offset) const
         {
-            // Use Schlick's approximation for reflectance.
-            double r0 = (1 - refIndex) / (1 + refIndex);
-            r0        = r0 * r0;
-            return r0 + (1 - r0) * pow((1 - cosine), 5);
+            // The last segment that starts at or before u, zero-width segments are skipped.
+            offset = std::upper_bound(m_Cdf.begin(), m_Cdf.end(), u) - m_Cdf.begin() - 1;
+            offset = std::min(offset, m_Function.size() - 1);
+
+            Real du    = u - m_Cdf[offset];
+            Real width = m_Cdf[offset + 1] - m_Cdf[offset];
+            if (width > 0)
+                du /= width;
+
+            pdf = Pdf(offset);
+            return std::min((offset + du) / m_Function.size(), OneMinusEpsilon);
         }
 
+        Real Pdf(size_t offset) const { return m_Integral > 0 ? m_Function[offset] / m_Integral : 1; }
+
     private:
-        double m_IR; // Index of Refraction
+        std::vector<Real> m_Function;
+        std::vector<Real> m_Cdf;
+        Real              m_Integral = 0;
     };
 
-    class DiffuseLight : public Material
+    /*
+     * A piecewise-constant distribution over [0, 1)^2, one cell per value of a function on a width x height grid. Y is
+     * picked from the marginal distribution of the rows, then X from the distribution within that row.
+     */
+    class Distribution2D
     {
     public:
-        DiffuseLight(std::shared_ptr<Texture> albedo) : m_Emit(albedo) {}
-        DiffuseLight(Color color) : m_Emit(std::make_shared<SolidColor>(color)) {}
+        Distribution2D() {}
 
-        virtual bool Scatter(const Ray& rIn, const HitRecord& rec, Color& attenuation, Ray& scattered) const override
+        // Evaluates function(x, y) for every cell, the rows are built in parallel.
+        template<class Function>
+        Distribution2D(uint32_t width, uint32_t height, const Function& function) : m_Rows(height)
         {
-            return false;
+            ParallelFor(height, 16, [&](size_t y) {
+                std::vector<Real> row(width);
+                for (uint32_t x = 0; x < width; ++x)
+                {
+                    row[x] = function(x, static_cast<uint32_t>(y));
+                }
+
+                m_Rows[y] = Distribution1D(std::move(row));
+            });
+
+            std::vector<Real> rowIntegrals(height);
+            for (uint32_t y = 0; y < height; ++y)
+            {
+                rowIntegrals[y] = m_Rows[y].GetIntegral();
+            }
+
+            m_Marginal = Distribution1D(std::move(rowIntegrals));
         }
 
-        virtual Color Emitted(double u, double v, const Point3& point) const override
+        Sample2D Sample(Sample2D u, Real& pdf) const
         {
-            return m_Emit->GetValue(u, v, point);
+            Real   rowPdf, columnPdf;
+            size_t row, column;
+            Real   y = m_Marginal.Sample(u.Y, rowPdf, row);
+            Real   x = m_Rows[row].Sample(u.X, columnPdf, column);
+            pdf      = rowPdf * columnPdf;
+            return {x, y};
+        }
+
+        Real Pdf(Sample2D point) const
+        {
+            size_t row    = std::min(static_cast<size_t>(point.Y * m_Rows.size()), m_Rows.size() - 1);
+            size_t column = std::min(static_cast<size_t>(point.X * m_Rows[row].GetCount()), m_Rows[row].GetCount() - 1);
+            return m_Marginal.Pdf(row) * m_Rows[row].Pdf(column);
         }
 
     private:
-        std::shared_ptr<Texture> m_Emit;
+        std::vector<Distribution1D> m_Rows;
+        Distribution1D              m_Marginal;
     };
 
-    class Sphere : public Hittable
+    /*
+     * A node of the linear BVH. Nodes are stored in depth-first order, so the first child of an interior node
+     * always follows its parent in the array and only the offset of the second child has to be stored.
+     * The bounds are kept in single precision (rounded outwards) to fit a node into 32 bytes.
+     */
+    struct LinearBVHNode
+    {
+        float BoundsMin[3];
+        float BoundsMax[3];
+        union
+        {
+            uint32_t PrimitivesOffset;  // Leaf node
+            uint32_t SecondChildOffset; // Interior node
+        };
+        uint16_t PrimitiveCount; // 0 -> interior node
+        uint8_t  Axis;           // Interior node: the axis that primitives were partitioned along
+        uint8_t  Pad[1];         // Ensure 32 byte total size
+
+        bool IsLeaf() const { return PrimitiveCount > 0; }
+
+        void SetBounds(const AABB& box)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                // Round outwards, so the node bounds always enclose the full precision box.
+                const float infinity = std::numeric_limits<float>::infinity();
+                float       boxMin   = static_cast<float>(box.GetMin()[a]);
+                float       boxMax   = static_cast<float>(box.GetMax()[a]);
+                BoundsMin[a]         = boxMin > box.GetMin()[a] ? std::nextafter(boxMin, -infinity) : boxMin;
+                BoundsMax[a]         = boxMax < box.GetMax()[a] ? std::nextafter(boxMax, infinity) : boxMax;
+            }
+        }
+
+        bool Hit(const RayQuery& query, Real tMin, Real tMax) const
+        {
+            return IntersectSlabs(query, BoundsMin, BoundsMax, tMin, tMax);
+        }
+    };
+
+    static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+    /*
+     * Builds a linear BVH over a set of primitive bounds using the binned surface area heuristic.
+     * The top of the tree is built on the calling thread. Once ranges get small enough they are handed out as
+     * independent subtrees to the thread pool, and the results are stitched together in depth-first order.
+     */
+    class BVHBuilder
     {
     public:
-        Sphere() {}
-        Sphere(Point3 center, double radius, std::shared_ptr<Material> materialPtr) :
-            m_Center(center), m_Radius(radius), m_MaterialPtr(materialPtr) {};
+        BVHBuilder(int maxPrimitivesInNode = 4) : m_MaxPrimitivesInNode(std::clamp(maxPrimitivesInNode, 1, 255)) {}
 
-        virtual bool Hit(const Ray& r, double tMin, double tMax, HitRecord& rec) const override
+        // Builds the hierarchy into `nodes`. Leaves reference ranges of `primitiveIndices`, which receives the
+        // reordered indices of the input primitives.
+        void Build(const std::vector<AABB>&    primitiveBounds,
+                   std::vector<LinearBVHNode>& nodes,
+                   std::vector<uint32_t>&      primitiveIndices) const
         {
-            Vector3 oc    = r.Origin() - m_Center;
-            double  a     = r.Direction().LengthSquared();
-            double  halfB = DotProduct(oc, r.Direction());
-            double  c     = oc.LengthSquared() - m_Radius * m_Radius;
+            nodes.clear();
+            primitiveIndices.clear();
+            if (primitiveBounds.empty())
+                return;
+
+            // Compute the centroids once, the build only moves these small records around.
+            auto                       primitiveCount = static_cast<uint32_t>(primitiveBounds.size());
+            std::vector<PrimitiveInfo> primitiveInfos(primitiveCount);
+            for (uint32_t i = 0; i < primitiveCount; ++i)
+            {
+                primitiveInfos[i].Bounds   = primitiveBounds[i];
+                primitiveInfos[i].Centroid = 0.5 * (primitiveBounds[i].GetMin() + primitiveBounds[i].GetMax());
+                primitiveInfos[i].Index    = i;
+            }
 
-            double delta = halfB * halfB - a * c;
-            if (delta < 0)
-                return false;
+            size_t threadCount = ThreadPool::IsWorkerThread() ? 0 : Pool.GetThreadCount();
+            size_t grainSize   = std::max<size_t>(MinParallelPrimitives, primitiveCount / (4 * (threadCount + 1)));
 
-            double sqrtd = std::sqrt(delta);
+            if (threadCount == 0 || primitiveCount <= grainSize)
+            {
+                nodes.reserve(2 * primitiveCount / m_MaxPrimitivesInNode + 1);
+                BuildRecursive(primitiveInfos.data(), 0, primitiveCount, 0, nodes);
+            }
+            else
+            {
+                BuildParallel(primitiveInfos.data(), primitiveCount, grainSize, threadCount, nodes);
+            }
 
-            // Find the nearest root that lies in the acceptable range.
-            double root = (-halfB - sqrtd) / a;
-            if (root < tMin || tMax < root)
+            primitiveIndices.reserve(primitiveCount);
+            for (const auto& info : primitiveInfos)
             {
-                root = (-halfB + sqrtd) / a;
-                if (root < tMin || tMax < root)
-                    return false;
+                primitiveIndices.push_back(info.Index);
             }
+        }
 
-            rec.T                 = root;
-            rec.Point             = r.At(rec.T);
-            Vector3 outwardNormal = (rec.Point - m_Center) / m_Radius;
-            rec.SetFaceNormal(r, outwardNormal);
-            GetSphereUV(outwardNormal, rec.U, rec.V);
-            rec.MaterialPtr = m_MaterialPtr;
+    private:
+        struct PrimitiveInfo
+        {
+            AABB     Bounds;
+            Point3   Centroid;
+            uint32_t Index;
+        };
 
-            return true;
+        // Bounds that start out empty and grow as boxes and points are added.
+        struct BuildBounds
+        {
+            Point3 Min = Point3(Infinity, Infinity, Infinity);
+            Point3 Max = Point3(-Infinity, -Infinity, -Infinity);
+
+            void Expand(const Point3& min, const Point3& max)
+            {
+                Min = VRaytracer::Min(Min, min);
+                Max = VRaytracer::Max(Max, max);
+            }
+
+            void Expand(const Point3& point) { Expand(point, point); }
+            void Expand(const AABB& box) { Expand(box.GetMin(), box.GetMax()); }
+            void Expand(const BuildBounds& bounds) { Expand(bounds.Min, bounds.Max); }
+
+            Real SurfaceArea() const
+            {
+                Vector3 d = Max - Min;
+                return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+            }
+        };
+
+        struct Split
+        {
+            BuildBounds Bounds;
+            BuildBounds CentroidBounds;
+            int         Axis      = -1; // -1 -> make a leaf
+            int         Bin       = 0;  // Primitives in bins [0, Bin] go left
+            int         BinCount  = MaxBinCount;
+            bool        UseMedian = false;
+        };
+
+        struct Subtree
+        {
+            uint32_t                   Start;
+            uint32_t                   End;
+            uint32_t                   Depth;
+            std::vector<LinearBVHNode> Nodes;
+        };
+
+        // An interior node of the serially built top of the tree, or a reference to a subtree built by a worker.
+        struct TopNode
+        {
+            BuildBounds Bounds;
+            int         Axis         = 0;
+            uint32_t    Children[2]  = {0, 0};
+            int         SubtreeIndex = -1;
+        };
+
+        static int GetBinIndex(const Point3& centroid, const Split& split, int axis, Real scale)
+        {
+            int bin = static_cast<int>((centroid[axis] - split.CentroidBounds.Min[axis]) * scale);
+            return std::clamp(bin, 0, split.BinCount - 1);
         }
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        static Real GetBinScale(const Split& split, int axis)
         {
-            outputBox = AABB(m_Center - Vector3(m_Radius, m_Radius, m_Radius),
-                             m_Center + Vector3(m_Radius, m_Radius, m_Radius));
-            return true;
+            return split.BinCount / (split.CentroidBounds.Max[axis] - split.CentroidBounds.Min[axis]);
         }
 
-    private:
-        static void GetSphereUV(const Point3& point, double& u, double& v)
+        Split FindSplit(const PrimitiveInfo* infos, uint32_t start, uint32_t end, uint32_t depth) const
         {
-            // point: a given point on the sphere of radius one, centered at the origin.
-            // u:     returned value [0,1] of angle around the Y axis from X=-1.
-            // v:     returned value [0,1] of angle from Y=-1 to Y=+1.
-            //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
-            //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
-            //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
+            Split split;
+            for (uint32_t i = start; i < end; ++i)
+            {
+                split.Bounds.Expand(infos[i].Bounds);
+                split.CentroidBounds.Expand(infos[i].Centroid);
+            }
 
-            double theta = acos(-point.y());
-            double phi   = atan2(-point.z(), point.x()) + Pi;
+            uint32_t primitiveCount = end - start;
+            if (primitiveCount == 1)
+                return split;
 
-            u = phi / (2 * Pi);
-            v = theta / Pi;
-        }
+            Vector3 extent      = split.CentroidBounds.Max - split.CentroidBounds.Min;
+            int     largestAxis = (extent.x() > extent.y() && extent.x() > extent.z()) ? 0 :
+                                  (extent.y() > extent.z())                           ? 1 :
+                                                                                        2;
 
-    private:
-        Point3                    m_Center;
-        double                    m_Radius;
-        std::shared_ptr<Material> m_MaterialPtr;
-    };
+            if (extent[largestAxis] <= 0)
+            {
+                // All centroids coincide, there is nothing to gain from splitting.
+                if (primitiveCount <= std::numeric_limits<uint16_t>::max())
+                    return split;
 
-    class MovingSphere : public Hittable
-    {
-    public:
-        MovingSphere() {}
-        MovingSphere(Point3                    center0,
-                     Point3                    center1,
-                     double                    time0,
-                     double                    time1,
-                     double                    radius,
-                     std::shared_ptr<Material> material) :
-            m_Center0(center0),
-            m_Center1(center1), m_Time0(time0), m_Time1(time1), m_Radius(radius), m_MaterialPtr(material)
-        {}
+                split.Axis      = largestAxis;
+                split.UseMedian = true;
+                return split;
+            }
 
-        virtual bool Hit(const Ray& r, double tMin, double tMax, HitRecord& rec) const override
-        {
-            Vector3 oc    = r.Origin() - GetCenter(r.Time());
-            double  a     = r.Direction().LengthSquared();
-            double  halfB = DotProduct(oc, r.Direction());
-            double  c     = oc.LengthSquared() - m_Radius * m_Radius;
+            // Deep trees would overflow the traversal stack, fall back to median splits which halve the range.
+            if (depth >= MaxSAHDepth)
+            {
+                split.Axis      = largestAxis;
+                split.UseMedian = true;
+                return split;
+            }
 
-            double delta = halfB * halfB - a * c;
-            if (delta < 0)
-                return false;
+            Real leafCost = primitiveCount;
+            Real bestCost = Infinity;
+            Real rootArea = split.Bounds.SurfaceArea();
 
-            double sqrtd = std::sqrt(delta);
+            // Small ranges gain nothing from fine bins, the sweep would dominate the cost of the bottom levels.
+            split.BinCount = std::min<int>(MaxBinCount, primitiveCount);
 
-            // Find the nearest root that lies in the acceptable range.
-            double root = (-halfB - sqrtd) / a;
-            if (root < tMin || tMax < root)
+            // Bin the centroids along all three axes in a single pass over the primitives.
+            BuildBounds binBounds[3][MaxBinCount];
+            uint32_t    binCounts[3][MaxBinCount] = {};
+            Real        scales[3];
+            for (int axis = 0; axis < 3; ++axis)
             {
-                root = (-halfB + sqrtd) / a;
-                if (root < tMin || tMax < root)
-                    return false;
+                scales[axis] = extent[axis] > 0 ? GetBinScale(split, axis) : 0;
             }
 
-            rec.T                 = root;
-            rec.Point             = r.At(rec.T);
-            Vector3 outwardNormal = (rec.Point - GetCenter(r.Time())) / m_Radius;
-            rec.SetFaceNormal(r, outwardNormal);
-            rec.MaterialPtr = m_MaterialPtr;
+            for (uint32_t i = start; i < end; ++i)
+            {
+                Point3 boundsMin = infos[i].Bounds.GetMin();
+                Point3 boundsMax = infos[i].Bounds.GetMax();
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    int bin = GetBinIndex(infos[i].Centroid, split, axis, scales[axis]);
+                    binCounts[axis][bin]++;
+                    binBounds[axis][bin].Expand(boundsMin, boundsMax);
+                }
+            }
 
-            return true;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                if (extent[axis] <= 0)
+                    continue;
+
+                // Sweep from the right to get the cost of everything above each split plane, then from the left.
+                Real        rightAreas[MaxBinCount - 1];
+                uint32_t    rightCounts[MaxBinCount - 1];
+                BuildBounds rightBounds;
+                uint32_t    rightCount = 0;
+                for (int bin = split.BinCount - 1; bin > 0; --bin)
+                {
+                    rightBounds.Expand(binBounds[axis][bin]);
+                    rightCount += binCounts[axis][bin];
+                    rightAreas[bin - 1]  = rightBounds.SurfaceArea();
+                    rightCounts[bin - 1] = rightCount;
+                }
+
+                BuildBounds leftBounds;
+                uint32_t    leftCount = 0;
+                for (int bin = 0; bin < split.BinCount - 1; ++bin)
+                {
+                    leftBounds.Expand(binBounds[axis][bin]);
+                    leftCount += binCounts[axis][bin];
+                    if (leftCount == 0 || rightCounts[bin] == 0)
+                        continue;
+
+                    Real leftCost  = leftCount * leftBounds.SurfaceArea();
+                    Real rightCost = rightCounts[bin] * rightAreas[bin];
+                    Real cost      = TraversalCost + (leftCost + rightCost) / rootArea;
+                    if (cost < bestCost)
+                    {
+                        bestCost   = cost;
+                        split.Axis = axis;
+                        split.Bin  = bin;
+                    }
+                }
+            }
+
+            if (split.Axis < 0)
+            {
+                split.Axis      = largestAxis;
+                split.UseMedian = true;
+            }
+            else if (primitiveCount <= static_cast<uint32_t>(m_MaxPrimitivesInNode) && bestCost >= leafCost)
+            {
+                split.Axis = -1;
+            }
+
+            return split;
         }
 
-        virtual bool BoundingBox(double time0, double time1, AABB& outputBox) const override
+        uint32_t Partition(PrimitiveInfo* infos, uint32_t start, uint32_t end, const Split& split) const
         {
-            AABB box0(GetCenter(time0) - Vector3(m_Radius, m_Radius, m_Radius),
-                      GetCenter(time0) + Vector3(m_Radius, m_Radius, m_Radius));
+            int axis = split.Axis;
 
-            AABB box1(GetCenter(time1) - Vector3(m_Radius, m_Radius, m_Radius),
-                      GetCenter(time1) + Vector3(m_Radius, m_Radius, m_Radius));
+            if (split.UseMedian)
+            {
+                uint32_t mid = start + (end - start) / 2;
+                std::nth_element(infos + start, infos + mid, infos + end, [axis](const auto& a, const auto& b) {
+                    return a.Centroid[axis] < b.Centroid[axis];
+                });
+                return mid;
+            }
 
-            outputBox = GetSurroundingBox(box0, box1);
-            return true;
+            Real           scale  = GetBinScale(split, axis);
+            PrimitiveInfo* midPtr = std::partition(infos + start, infos + end, [&](const PrimitiveInfo& info) {
+                return GetBinIndex(info.Centroid, split, axis, scale) <= split.Bin;
+            });
+            return static_cast<uint32_t>(midPtr - infos);
         }
 
-        Point3 GetCenter(double time) const
+        static void InitLeaf(LinearBVHNode& node, const BuildBounds& bounds, uint32_t start, uint32_t count)
         {
-            return m_Center0 + ((time - m_Time0) / (m_Time1 - m_Time0)) * (m_Center1 - m_Center0);
+            node.PrimitivesOffset = start;
+            node.PrimitiveCount   = static_cast<uint16_t>(count);
+            node.Axis             = 0;
+            node.SetBounds(AABB(bounds.Min, bounds.Max));
         }
 
-    private:
-        Point3                    m_Center0, m_Center1;
-        double                    m_Time0, m_Time1;
-        double                    m_Radius;
-        std::shared_ptr<Material> m_MaterialPtr;
-    };
+        static void InitInterior(LinearBVHNode& node, const BuildBounds& bounds, int axis, uint32_t secondChild)
+        {
+            node.SecondChildOffset = secondChild;
+            node.PrimitiveCount    = 0;
+            node.Axis              = static_cast<uint8_t>(axis);
+            node.SetBounds(AABB(bounds.Min, bounds.Max));
+        }
 
-    class ThreadPool
-    {
-    public:
-        // The constructor just launches some amount of workers
-        ThreadPool(size_t threads) : m_Stop(false)
+        // Builds [start, end) into `nodes` in depth-first order and returns the index of the subtree root.
+        uint32_t BuildRecursive(PrimitiveInfo*              infos,
+                                uint32_t                    start,
+                                uint32_t                    end,
+                                uint32_t                    depth,
+                                std::vector<LinearBVHNode>& nodes) const
         {
-            for (size_t i = 0; i < threads; ++i)
-                m_Workers.emplace_back([this] {
-                    for (;;)
-                    {
-                        std::function<void()> task;
+            auto nodeIndex = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
 
-                        {
-                            std::unique_lock<std::mutex> lock(this->m_QueueMutex);
-                            this->m_Condition.wait(lock, [this] { return this->m_Stop || !this->m_Tasks.empty(); });
-                            if (this->m_Stop && this->m_Tasks.empty())
-                                return;
-                            task = std::move(this->m_Tasks.front());
-                            this->m_Tasks.pop();
-                        }
+            Split split = FindSplit(infos, start, end, depth);
+            if (split.Axis < 0)
+            {
+                InitLeaf(nodes[nodeIndex], split.Bounds, start, end - start);
+                return nodeIndex;
+            }
 
-                        task();
-                    }
-                });
+            uint32_t mid = Partition(infos, start, end, split);
+            BuildRecursive(infos, start, mid, depth + 1, nodes);
+            uint32_t secondChild = BuildRecursive(infos, mid, end, depth + 1, nodes);
+
+            InitInterior(nodes[nodeIndex], split.Bounds, split.Axis, secondChild);
+            return nodeIndex;
         }
 
-        // Add new work item to the pool
-        template<class F, class... Args>
-        std::future<typename std::result_of<F(Args...)>::type> Enqueue(F&& f, Args&&... args)
+        uint32_t BuildTopLevel(PrimitiveInfo*        infos,
+                               uint32_t              start,
+                               uint32_t              end,
+                               uint32_t              depth,
+                               size_t                grainSize,
+                               std::vector<TopNode>& topNodes,
+                               std::vector<Subtree>& subtrees) const
         {
-            using return_type = typename std::result_of<F(Args...)>::type;
+            auto topIndex = static_cast<uint32_t>(topNodes.size());
+            topNodes.emplace_back();
 
-            auto task = std::make_shared<std::packaged_task<return_type()>>(
-                std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            Split split;
+            if (end - start > grainSize)
+                split = FindSplit(infos, start, end, depth);
 
-            std::future<return_type> res = task->get_future();
+            if (end - start <= grainSize || split.Axis < 0)
             {
-                std::unique_lock<std::mutex> lock(m_QueueMutex);
+                topNodes[topIndex].SubtreeIndex = static_cast<int>(subtrees.size());
+                subtrees.push_back({start, end, depth, {}});
+                return topIndex;
+            }
 
-                // don't allow enqueueing after stopping the pool
-                if (m_Stop)
-                    throw std::runtime_error("enqueue on stopped ThreadPool");
+            uint32_t mid   = Partition(infos, start, end, split);
+            uint32_t left  = BuildTopLevel(infos, start, mid, depth + 1, grainSize, topNodes, subtrees);
+            uint32_t right = BuildTopLevel(infos, mid, end, depth + 1, grainSize, topNodes, subtrees);
 
-                m_Tasks.emplace([task]() { (*task)(); });
-            }
-            m_Condition.notify_one();
-            return res;
+            TopNode& topNode    = topNodes[topIndex];
+            topNode.Bounds      = split.Bounds;
+            topNode.Axis        = split.Axis;
+            topNode.Children[0] = left;
+            topNode.Children[1] = right;
+            return topIndex;
         }
 
-        // The destructor joins all threads
-        ~ThreadPool()
+        uint32_t Flatten(const std::vector<TopNode>& topNodes,
+                         uint32_t                    topIndex,
+                         const std::vector<Subtree>& subtrees,
+                         std::vector<LinearBVHNode>& nodes) const
         {
+            const TopNode& topNode = topNodes[topIndex];
+            auto           base    = static_cast<uint32_t>(nodes.size());
+
+            if (topNode.SubtreeIndex >= 0)
             {
-                std::unique_lock<std::mutex> lock(m_QueueMutex);
-                m_Stop = true;
+                // Subtrees were built with local offsets, shift them to their final position.
+                for (LinearBVHNode node : subtrees[topNode.SubtreeIndex].Nodes)
+                {
+                    if (!node.IsLeaf())
+                        node.SecondChildOffset += base;
+                    nodes.push_back(node);
+                }
+                return base;
+            }
+
+            nodes.emplace_back();
+            Flatten(topNodes, topNode.Children[0], subtrees, nodes);
+            uint32_t secondChild = Flatten(topNodes, topNode.Children[1], subtrees, nodes);
+            InitInterior(nodes[base], topNode.Bounds, topNode.Axis, secondChild);
+            return base;
+        }
+
+        void BuildParallel(PrimitiveInfo*              infos,
+                           uint32_t                    primitiveCount,
+                           size_t                      grainSize,
+                           size_t                      threadCount,
+                           std::vector<LinearBVHNode>& nodes) const
+        {
+            std::vector<TopNode> topNodes;
+            std::vector<Subtree> subtrees;
+            BuildTopLevel(infos, 0, primitiveCount, 0, grainSize, topNodes, subtrees);
+
+            // Subtrees cover disjoint ranges of `infos`, so they can be built concurrently. The calling thread takes
+            // part as well, so the build still completes if the workers are busy with other tasks. Late workers only
+            // touch the shared counters and find nothing left to do.
+            struct SharedState
+            {
+                std::atomic<size_t>     NextSubtree {0};
+                size_t                  SubtreeCount  = 0;
+                size_t                  FinishedCount = 0;
+                std::mutex              Mutex;
+                std::condition_variable Finished;
+            };
+
+            auto state          = std::make_shared<SharedState>();
+            state->SubtreeCount = subtrees.size();
+
+            auto buildSubtrees = [this, state, infos, &subtrees]() {
+                size_t index;
+                while ((index = state->NextSubtree.fetch_add(1)) < state->SubtreeCount)
+                {
+                    Subtree& subtree = subtrees[index];
+                    BuildRecursive(infos, subtree.Start, subtree.End, subtree.Depth, subtree.Nodes);
+
+                    std::lock_guard<std::mutex> lock(state->Mutex);
+                    if (++state->FinishedCount == state->SubtreeCount)
+                        state->Finished.notify_all();
+                }
+            };
+
+            size_t helperCount = std::min(threadCount, subtrees.size() - 1);
+            for (size_t i = 0; i < helperCount; ++i)
+            {
+                Pool.Enqueue(buildSubtrees);
+            }
+
+            buildSubtrees();
+
+            {
+                std::unique_lock<std::mutex> lock(state->Mutex);
+                state->Finished.wait(lock, [&] { return state->FinishedCount == state->SubtreeCount; });
+            }
+
+            size_t nodeCount = 0;
+            for (const auto& subtree : subtrees)
+            {
+                nodeCount += subtree.Nodes.size();
+            }
+
+            nodes.reserve(nodeCount + topNodes.size());
+            Flatten(topNodes, 0, subtrees, nodes);
+        }
+
+    private:
+        static constexpr int      MaxBinCount           = 16;
+        static constexpr uint32_t MaxSAHDepth           = 32;
+        static constexpr size_t   MinParallelPrimitives = 4096;
+
+        // Cost of visiting a node relative to intersecting a primitive.
+        static constexpr Real TraversalCost = 0.5;
+
+        int m_MaxPrimitivesInNode;
+    };
+
+    /*
+     * Front-to-back traversal of a linear BVH with an explicit stack. nodes is a std::vector or an ArenaArray of
+     * LinearBVHNode. intersectLeaf(leaf, tMax) tests the primitives of a leaf, shrinks tMax to the closest hit and
+     * returns whether it found one.
+     */
+    template<typename NodeArray, typename LeafIntersector>
+    inline bool TraverseLinearBVH(const NodeArray&  nodes,
+                                  const RayQuery&   query,
+                                  Real              tMin,
+                                  Real              tMax,
+                                  LeafIntersector&& intersectLeaf)
+    {
+        constexpr int MaxTraversalDepth = 64;
+
+        if (nodes.empty())
+            return false;
+
+        bool hitAnything = false;
+
+        uint32_t nodesToVisit[MaxTraversalDepth];
+        int      toVisitOffset = 0;
+        uint32_t currentIndex  = 0;
+
+        while (true)
+        {
+            const LinearBVHNode& node = nodes[currentIndex];
+
+            if (node.Hit(query, tMin, tMax))
+            {
+                if (node.IsLeaf())
+                {
+                    if (intersectLeaf(node, tMax))
+                        hitAnything = true;
+
+                    if (toVisitOffset == 0)
+                        break;
+                    currentIndex = nodesToVisit[--toVisitOffset];
+                }
+                else
+                {
+                    // Visit the near child first, so that the far one can be culled by the closer hit.
+                    if (query.DirectionIsNegative[node.Axis])
+                    {
+                        nodesToVisit[toVisitOffset++] = currentIndex + 1;
+                        currentIndex                  = node.SecondChildOffset;
+                    }
+                    else
+                    {
+                        nodesToVisit[toVisitOffset++] = node.SecondChildOffset;
+                        currentIndex                  = currentIndex + 1;
+                    }
+                }
+            }
+            else
+            {
+                if (toVisitOffset == 0)
+                    break;
+                currentIndex = nodesToVisit[--toVisitOffset];
+            }
+        }
+
+        return hitAnything;
+    }
+
+    /*
+     * A bounding volume hierarchy flattened into a contiguous array of nodes and traversed with an explicit stack.
+     * Leaves reference ranges of the (reordered) primitive array.
+     */
+    class BVH : public Hittable
+    {
+    public:
+        BVH() {}
+        BVH(const HittableList& list, Real time0, Real time1, int maxPrimitivesInNode = 4)
+        {
+            const auto& objects = list.GetObjects();
+
+            std::vector<AABB> primitiveBounds(objects.size());
+            for (size_t i = 0; i < objects.size(); ++i)
+            {
+                if (!objects[i]->BoundingBox(time0, time1, primitiveBounds[i]))
+                    std::cerr << "No bounding box in BVH constructor." << std::endl;
+
+                m_Box = i == 0 ? primitiveBounds[i] : GetSurroundingBox(m_Box, primitiveBounds[i]);
+            }
+
+            std::vector<uint32_t> primitiveIndices;
+            BVHBuilder(maxPrimitivesInNode).Build(primitiveBounds, m_Nodes, primitiveIndices);
+
+            m_Primitives.reserve(objects.size());
+            for (uint32_t index : primitiveIndices)
+            {
+                m_Primitives.push_back(objects[index]);
+            }
+        }
+
+        virtual bool Intersect(const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const override
+        {
+            return TraverseLinearBVH(m_Nodes, RayQuery(r), tMin, tMax, [&](const LinearBVHNode& leaf, Real& tMax) {
+                bool hitAnything = false;
+                for (uint32_t i = 0; i < leaf.PrimitiveCount; ++i)
+                {
+                    if (m_Primitives[leaf.PrimitivesOffset + i]->Intersect(r, tMin, tMax, hit))
+                    {
+                        hitAnything = true;
+                        tMax        = hit.T;
+                    }
+                }
+                return hitAnything;
+            });
+        }
+
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
+        {
+            outputBox = m_Box;
+            return !m_Nodes.empty();
+        }
+
+        size_t GetNodeCount() const { return m_Nodes.size(); }
+
+    private:
+        std::vector<std::shared_ptr<Hittable>> m_Primitives;
+        std::vector<LinearBVHNode>             m_Nodes;
+        AABB                                   m_Box;
+    };
+
+    /*
+     * Vertex and index buffers of a triangle mesh. They are shared by pointer, so instances of a mesh (and meshes
+     * built from the same buffers) don't copy them.
+     */
+    struct TriangleMeshData
+    {
+        std::vector<Point3>   Positions;
+        std::vector<Real>     TexCoords; // Optional, two per vertex
+        std::vector<uint32_t> Indices;   // Three per triangle, counter-clockwise seen from the front
+    };
+
+    /*
+     * Per-ray setup of the watertight ray-triangle test (Woop, Benthin and Wald 2013, "Watertight Ray/Triangle
+     * Intersection"). The vertices are translated to the ray origin and sheared so the ray runs along +Z, then the
+     * 2D edge functions decide the hit. Edges shared by two triangles get the same edge function values in both, so
+     * rays can't slip through the cracks between them.
+     */
+    struct WatertightRay
+    {
+        explicit WatertightRay(const Ray& ray) : Origin(ray.Origin())
+        {
+            Vector3 direction = ray.Direction();
+            Vector3 absolute  = Abs(direction);
+
+            Kz = absolute.x() > absolute.y() ? (absolute.x() > absolute.z() ? 0 : 2)
+                                             : (absolute.y() > absolute.z() ? 1 : 2);
+            Kx = (Kz + 1) % 3;
+            Ky = (Kx + 1) % 3;
+
+            // Keep the winding of the triangles.
+            if (direction[Kz] < 0)
+                std::swap(Kx, Ky);
+
+            Sx = direction[Kx] / direction[Kz];
+            Sy = direction[Ky] / direction[Kz];
+            Sz = 1 / direction[Kz];
+        }
+
+        // Runs the whole test in double precision and returns the barycentrics of the hit. In float builds this
+        // is the fallback for edge functions close to zero, where float alone can't tell the sides apart.
+        bool Intersect(const Point3& p0, const Point3& p1, const Point3& p2, Real& t, Real barycentrics[3]) const
+        {
+            const Point3* vertices[3] = {&p0, &p1, &p2};
+            double        x[3], y[3], z[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                double ax = static_cast<double>((*vertices[i])[Kx]) - Origin[Kx];
+                double ay = static_cast<double>((*vertices[i])[Ky]) - Origin[Ky];
+                double az = static_cast<double>((*vertices[i])[Kz]) - Origin[Kz];
+                x[i]      = ax - static_cast<double>(Sx) * az;
+                y[i]      = ay - static_cast<double>(Sy) * az;
+                z[i]      = static_cast<double>(Sz) * az;
+            }
+
+            double u = x[2] * y[1] - y[2] * x[1];
+            double v = x[0] * y[2] - y[0] * x[2];
+            double w = x[1] * y[0] - y[1] * x[0];
+
+            double determinant = u + v + w;
+            if (((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) || determinant == 0)
+                return false;
+
+            t               = static_cast<Real>((u * z[0] + v * z[1] + w * z[2]) / determinant);
+            barycentrics[0] = static_cast<Real>(u / determinant);
+            barycentrics[1] = static_cast<Real>(v / determinant);
+            barycentrics[2] = static_cast<Real>(w / determinant);
+            return true;
+        }
+
+        Point3 Origin;
+        int    Kx, Ky, Kz;
+        Real   Sx, Sy, Sz;
+    };
+
+    /*
+     * An indexed triangle mesh with its own BVH. The triangles of every leaf are packed into structure-of-arrays
+     * packets of Simd::Wide::Width triangles, and the watertight test runs on a whole packet at once. The vertices,
+     * the triangles and the BVH are copied into the scene's arena, the TriangleMeshData isn't needed afterwards.
+     */
+    class TriangleMesh : public Hittable
+    {
+    public:
+        TriangleMesh(const TriangleMeshData& data, uint32_t materialID, MemoryArena& arena) : m_MaterialID(materialID)
+        {
+            const auto& positions = data.Positions;
+            const auto& indices   = data.Indices;
+            if (indices.size() % 3 != 0)
+                throw std::invalid_argument("TriangleMesh indices must come in threes");
+            if (!data.TexCoords.empty() && data.TexCoords.size() != 2 * positions.size())
+                throw std::invalid_argument("TriangleMesh needs two texture coordinates per vertex");
+            for (uint32_t index : indices)
+            {
+                if (index >= positions.size())
+                    throw std::out_of_range("TriangleMesh index out of range");
+            }
+
+            auto              triangleCount = static_cast<uint32_t>(indices.size() / 3);
+            std::vector<AABB> triangleBounds(triangleCount);
+            for (uint32_t i = 0; i < triangleCount; ++i)
+            {
+                const Point3& p0  = positions[indices[3 * i]];
+                const Point3& p1  = positions[indices[3 * i + 1]];
+                const Point3& p2  = positions[indices[3 * i + 2]];
+                triangleBounds[i] = AABB(Min(p0, Min(p1, p2)), Max(p0, Max(p1, p2)));
+                m_Box             = i == 0 ? triangleBounds[i] : GetSurroundingBox(m_Box, triangleBounds[i]);
+            }
+
+            std::vector<LinearBVHNode> nodes;
+            std::vector<uint32_t>      triangleIndices;
+            BVHBuilder(std::max(4, 2 * Simd::Wide::Width)).Build(triangleBounds, nodes, triangleIndices);
+
+            // Repack every leaf into whole packets, leaves then reference their first packet instead of a triangle.
+            std::vector<TrianglePacket> packets;
+            for (auto& node : nodes)
+            {
+                if (!node.IsLeaf())
+                    continue;
+
+                auto firstPacket = static_cast<uint32_t>(packets.size());
+                for (uint32_t i = 0; i < node.PrimitiveCount; ++i)
+                {
+                    int lane = i % Simd::Wide::Width;
+                    if (lane == 0)
+                        packets.emplace_back();
+
+                    uint32_t        triangle = triangleIndices[node.PrimitivesOffset + i];
+                    TrianglePacket& packet   = packets.back();
+                    packet.Triangles[lane]   = triangle;
+                    for (int vertex = 0; vertex < 3; ++vertex)
+                    {
+                        const Point3& p = positions[indices[3 * triangle + vertex]];
+                        for (int a = 0; a < 3; ++a)
+                            packet.Vertices[vertex][a][lane] = p[a];
+                    }
+                }
+                node.PrimitivesOffset = firstPacket;
+            }
+
+            m_Positions = ArenaArray<Point3>(arena, positions);
+            m_TexCoords = ArenaArray<Real>(arena, data.TexCoords);
+            m_Indices   = ArenaArray<uint32_t>(arena, indices);
+            m_Nodes     = ArenaArray<LinearBVHNode>(arena, nodes);
+            m_Packets   = ArenaArray<TrianglePacket>(arena, packets);
+        }
+
+        virtual bool Intersect(const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const override
+        {
+            namespace W = Simd::Wide;
+
+            const WatertightRay ray(r);
+            const W::Register   zero    = W::Broadcast(0);
+            const W::Register   tMinV   = W::Broadcast(tMin);
+            const W::Register   sx      = W::Broadcast(ray.Sx);
+            const W::Register   sy      = W::Broadcast(ray.Sy);
+            const W::Register   sz      = W::Broadcast(ray.Sz);
+            const W::Register   originX = W::Broadcast(ray.Origin[ray.Kx]);
+            const W::Register   originY = W::Broadcast(ray.Origin[ray.Ky]);
+            const W::Register   originZ = W::Broadcast(ray.Origin[ray.Kz]);
+
+            auto abs = [&](W::Register a) { return W::Max(a, W::Sub(zero, a)); };
+
+            auto intersectLeaf = [&](const LinearBVHNode& leaf, Real& tMax) {
+                bool     hitAnything = false;
+                uint32_t packetCount = (leaf.PrimitiveCount + W::Width - 1) / W::Width;
+                for (uint32_t p = 0; p < packetCount; ++p)
+                {
+                    const TrianglePacket& packet = m_Packets[leaf.PrimitivesOffset + p];
+
+                    // Sheared 2D positions and scaled depths of the three vertices relative to the ray origin, and
+                    // the magnitudes that bound the rounding errors of the 2D positions (see the float fallback).
+                    W::Register x[3], y[3], z[3], xMagnitude[3], yMagnitude[3];
+                    for (int vertex = 0; vertex < 3; ++vertex)
+                    {
+                        W::Register ax = W::Sub(W::Load(packet.Vertices[vertex][ray.Kx]), originX);
+                        W::Register ay = W::Sub(W::Load(packet.Vertices[vertex][ray.Ky]), originY);
+                        W::Register az = W::Sub(W::Load(packet.Vertices[vertex][ray.Kz]), originZ);
+                        x[vertex]      = W::Sub(ax, W::Mul(sx, az));
+                        y[vertex]      = W::Sub(ay, W::Mul(sy, az));
+                        z[vertex]      = W::Mul(sz, az);
+                        if constexpr (std::is_same_v<Real, float>)
+                        {
+                            xMagnitude[vertex] = W::Add(abs(ax), abs(W::Mul(sx, az)));
+                            yMagnitude[vertex] = W::Add(abs(ay), abs(W::Mul(sy, az)));
+                        }
+                    }
+
+                    W::Register u = W::Sub(W::Mul(x[2], y[1]), W::Mul(y[2], x[1]));
+                    W::Register v = W::Sub(W::Mul(x[0], y[2]), W::Mul(y[0], x[2]));
+                    W::Register w = W::Sub(W::Mul(x[1], y[0]), W::Mul(y[1], x[0]));
+
+                    W::Mask anyNegative = W::Or(W::Or(W::Less(u, zero), W::Less(v, zero)), W::Less(w, zero));
+                    W::Mask anyPositive = W::Or(W::Or(W::Greater(u, zero), W::Greater(v, zero)), W::Greater(w, zero));
+
+                    W::Register determinant = W::Add(W::Add(u, v), w);
+                    W::Register scaledT     = W::Add(W::Add(W::Mul(u, z[0]), W::Mul(v, z[1])), W::Mul(w, z[2]));
+                    W::Register t           = W::Div(scaledT, determinant);
+
+                    W::Mask nonDegenerate = W::Or(W::Less(determinant, zero), W::Greater(determinant, zero));
+                    W::Mask inside        = W::AndNot(nonDegenerate, W::And(anyNegative, anyPositive));
+                    W::Mask inRange       = W::And(W::GreaterEqual(t, tMinV), W::LessEqual(t, W::Broadcast(tMax)));
+                    int     laneMask      = W::MoveMask(W::And(inside, inRange));
+
+                    int fallbackMask = 0;
+                    if constexpr (std::is_same_v<Real, float>)
+                    {
+                        /*
+                         * Each sheared coordinate is off by at most Gamma(3) times its magnitude (|a| + |s * az|,
+                         * for the subtraction of the origin, the product and the difference). Each product of an
+                         * edge function then is off by 2 * Gamma(3) of the product of the magnitudes, plus one
+                         * rounding for the product and one for the difference, and Gamma(9) covers the sum along
+                         * with the second-order terms. Lanes where an edge function doesn't exceed that bound can
+                         * have the wrong sign, they go through the double test.
+                         */
+                        const W::Register gamma = W::Broadcast(Gamma(9));
+                        auto              bound = [&](int i, int j) {
+                            return W::Mul(gamma,
+                                          W::Add(W::Mul(xMagnitude[i], yMagnitude[j]),
+                                                 W::Mul(yMagnitude[i], xMagnitude[j])));
+                        };
+                        W::Mask uncertain = W::Or(W::Or(W::LessEqual(abs(u), bound(2, 1)),
+                                                        W::LessEqual(abs(v), bound(0, 2))),
+                                                  W::LessEqual(abs(w), bound(1, 0)));
+                        fallbackMask      = W::MoveMask(uncertain);
+                        laneMask &= ~fallbackMask;
+                    }
+
+                    if ((laneMask | fallbackMask) == 0)
+                        continue;
+
+                    alignas(32) Real roots[W::Width];
+                    alignas(32) Real b1[W::Width];
+                    alignas(32) Real b2[W::Width];
+                    W::Store(roots, t);
+                    W::Store(b1, W::Div(v, determinant));
+                    W::Store(b2, W::Div(w, determinant));
+                    for (int lane = 0; lane < W::Width; ++lane)
+                    {
+                        uint32_t index = p * W::Width + lane;
+                        if (index >= leaf.PrimitiveCount)
+                            break;
+
+                        Real root = roots[lane];
+                        Real barycentrics[3];
+                        if (fallbackMask & (1 << lane))
+                        {
+                            if (!ray.Intersect(GetVertex(packet.Triangles[lane], 0),
+                                               GetVertex(packet.Triangles[lane], 1),
+                                               GetVertex(packet.Triangles[lane], 2),
+                                               root,
+                                               barycentrics) ||
+                                root < tMin)
+                                continue;
+                        }
+                        else if (laneMask & (1 << lane))
+                        {
+                            barycentrics[1] = b1[lane];
+                            barycentrics[2] = b2[lane];
+                        }
+                        else
+                        {
+                            continue;
+                        }
+
+                        if (root <= tMax)
+                        {
+                            tMax        = root;
+                            hitAnything = true;
+                            hit.Set(root, this, packet.Triangles[lane]);
+                            hit.B1 = barycentrics[1];
+                            hit.B2 = barycentrics[2];
+                        }
+                    }
+                }
+                return hitAnything;
+            };
+
+            return TraverseLinearBVH(m_Nodes, RayQuery(r), tMin, tMax, intersectLeaf);
+        }
+
+        virtual void ComputeSurfaceInteraction(const Ray& r, const SurfaceHit& hit, HitRecord& rec) const override
+        {
+            const Point3& p0 = GetVertex(hit.Element, 0);
+            const Point3& p1 = GetVertex(hit.Element, 1);
+            const Point3& p2 = GetVertex(hit.Element, 2);
+
+            const Real b[3] = {1 - hit.B1 - hit.B2, hit.B1, hit.B2};
+
+            rec.T          = hit.T;
+            rec.Point      = b[0] * p0 + b[1] * p1 + b[2] * p2;
+            rec.PointError = Gamma(7) * (Abs(b[0] * p0) + Abs(b[1] * p1) + Abs(b[2] * p2));
+
+            const auto& texCoords = m_TexCoords;
+            if (texCoords.empty())
+            {
+                rec.U = b[1] + b[2];
+                rec.V = b[2];
+            }
+            else
+            {
+                const uint32_t* triangle = &m_Indices[3 * hit.Element];
+
+                rec.U = b[0] * texCoords[2 * triangle[0]] + b[1] * texCoords[2 * triangle[1]] +
+                        b[2] * texCoords[2 * triangle[2]];
+                rec.V = b[0] * texCoords[2 * triangle[0] + 1] + b[1] * texCoords[2 * triangle[1] + 1] +
+                        b[2] * texCoords[2 * triangle[2] + 1];
+            }
+
+            rec.SetFaceNormal(r, Normalize(CrossProduct(p1 - p0, p2 - p0)));
+            rec.MaterialID = m_MaterialID;
+        }
+
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
+        {
+            outputBox = m_Box;
+            return !m_Nodes.empty();
+        }
+
+        size_t GetTriangleCount() const { return m_Indices.size() / 3; }
+
+    private:
+        // Unused lanes of a leaf's last packet hold a degenerate triangle and are skipped by the leaf's triangle count.
+        struct alignas(32) TrianglePacket
+        {
+            Real     Vertices[3][3][Simd::Wide::Width] = {}; // [vertex][axis][lane]
+            uint32_t Triangles[Simd::Wide::Width]      = {};
+        };
+
+        const Point3& GetVertex(uint32_t triangle, int vertex) const
+        {
+            return m_Positions[m_Indices[3 * triangle + vertex]];
+        }
+
+    private:
+        uint32_t                   m_MaterialID;
+        ArenaArray<Point3>         m_Positions;
+        ArenaArray<Real>           m_TexCoords; // Empty, or two per vertex
+        ArenaArray<uint32_t>       m_Indices;
+        ArenaArray<LinearBVHNode>  m_Nodes;
+        ArenaArray<TrianglePacket> m_Packets;
+        AABB                       m_Box;
+    };
+
+    class Material
+    {
+    public:
+        virtual bool  Scatter(const Ray&       rIn,
+                              const HitRecord& rec,
+                              Color&           attenuation,
+                              Ray&             scattered,
+                              Sampler&         sampler) const = 0;
+        virtual Color Emitted(Real u, Real v, const Point3& point) const { return Black; }
+        virtual bool  IsEmissive() const { return false; }
+
+        /*
+         * Materials whose scattered directions have a density get their direct lighting from both light sampling and
+         * Scatter, combined with multiple importance sampling, which needs Eval and Pdf. Specular ones only scatter.
+         */
+        virtual bool HasPdf() const { return false; }
+
+        // The BSDF times the cosine at the surface, for light arriving from the unit vector direction.
+        virtual Color Eval(const Ray& rIn, const HitRecord& rec, const Vector3& direction) const { return Black; }
+
+        // The solid angle density of Scatter choosing the unit vector direction.
+        virtual Real Pdf(const Ray& rIn, const HitRecord& rec, const Vector3& direction) const { return 0; }
+    };
+
+    class Lambertian : public Material
+    {
+    public:
+        Lambertian(const Color& albedo) : m_Albedo(std::make_shared<SolidColor>(albedo)) {}
+        Lambertian(std::shared_ptr<Texture> albedo) : m_Albedo(std::move(albedo)) {}
+
+        virtual bool Scatter(const Ray&       rIn,
+                             const HitRecord& rec,
+                             Color&           attenuation,
+                             Ray&             scattered,
+                             Sampler&         sampler) const override
+        {
+            auto scatterDirection = rec.Normal + SampleUniformSphere(sampler.Get2D());
+
+            // Catch degenerate scatter direction
+            if (scatterDirection.IsNearZero())
+                scatterDirection = rec.Normal;
+
+            scattered   = rec.SpawnRay(scatterDirection, rIn.Time());
+            attenuation = m_Albedo->GetValue(rec.U, rec.V, rec.Point);
+            return true;
+        }
+
+        virtual bool HasPdf() const override { return true; }
+
+        virtual Color Eval(const Ray& rIn, const HitRecord& rec, const Vector3& direction) const override
+        {
+            Real cosine = DotProduct(rec.Normal, direction);
+            if (cosine <= 0)
+                return Black;
+
+            return (cosine / Pi) * m_Albedo->GetValue(rec.U, rec.V, rec.Point);
+        }
+
+        // The normal plus a uniform unit vector is cosine distributed.
+        virtual Real Pdf(const Ray& rIn, const HitRecord& rec, const Vector3& direction) const override
+        {
+            return std::max<Real>(0, DotProduct(rec.Normal, direction)) / Pi;
+        }
+
+    private:
+        std::shared_ptr<Texture> m_Albedo;
+    };
+
+    class Metal : public Material
+    {
+    public:
+        Metal(const Color& albedo, Real fuzz) : m_Albedo(albedo), m_Fuzz(fuzz < 1 ? fuzz : 1) {}
+
+        virtual bool Scatter(const Ray&       rIn,
+                             const HitRecord& rec,
+                             Color&           attenuation,
+                             Ray&             scattered,
+                             Sampler&         sampler) const override
+        {
+            Sample2D u         = sampler.Get2D();
+            Real     uRadius   = sampler.Get1D();
+            Vector3  reflected = Reflect(Normalize(rIn.Direction()), rec.Normal);
+            scattered          = rec.SpawnRay(reflected + m_Fuzz * SampleUniformBall(u, uRadius), rIn.Time());
+            attenuation        = m_Albedo;
+            return DotProduct(scattered.Direction(), rec.Normal) > 0;
+        }
+
+        virtual bool HasPdf() const override { return m_Fuzz > 0; }
+
+        // Scatter weights its directions by the albedo alone, so the BSDF times the cosine is the albedo times the pdf.
+        virtual Color Eval(const Ray& rIn, const HitRecord& rec, const Vector3& direction) const override
+        {
+            return Pdf(rIn, rec, direction) * m_Albedo;
+        }
+
+        /*
+         * Scatter picks a point uniformly in the ball of radius fuzz around the mirror direction, so the density of a
+         * direction is the ball's volume density integrated along the chord the direction cuts through it.
+         */
+        virtual Real Pdf(const Ray& rIn, const HitRecord& rec, const Vector3& direction) const override
+        {
+            if (DotProduct(direction, rec.Normal) <= 0)
+                return 0;
+
+            // The cross product keeps the sine accurate for directions close to the mirror one.
+            Vector3 reflected = Reflect(Normalize(rIn.Direction()), rec.Normal);
+            Real    cosine    = DotProduct(direction, reflected);
+            Real    sinSq     = CrossProduct(direction, reflected).LengthSquared();
+            Real    halfChord = std::sqrt(std::max<Real>(0, m_Fuzz * m_Fuzz - sinSq));
+            Real    tMax      = cosine + halfChord;
+            if (m_Fuzz * m_Fuzz <= sinSq || tMax <= 0)
+                return 0;
+
+            Real fuzzCubed = m_Fuzz * m_Fuzz * m_Fuzz;
+            if (cosine - halfChord <= 0)
+                return tMax * tMax * tMax / (4 * Pi * fuzzCubed);
+
+            return halfChord * (3 * cosine * cosine + halfChord * halfChord) / (2 * Pi * fuzzCubed);
+        }
+
+    private:
+        Color m_Albedo;
+        Real  m_Fuzz;
+    };
+
+    class Dielectric : public Material
+    {
+    public:
+        Dielectric(Real indexOfRefraction) : m_IR(indexOfRefraction) {}
+
+        virtual bool Scatter(const Ray&       rIn,
+                             const HitRecord& rec,
+                             Color&           attenuation,
+                             Ray&             scattered,
+                             Sampler&         sampler) const override
+        {
+            attenuation          = White;
+            Real refractionRatio = rec.IsFrontFace ? (1.0 / m_IR) : m_IR;
+
+            Vector3 unitDirection = Normalize(rIn.Direction());
+            Real    cosTheta      = fmin(DotProduct(-unitDirection, rec.Normal), 1.0);
+            Real    sinTheta      = std::sqrt(1.0 - cosTheta * cosTheta);
+
+            bool    cannotRefract = refractionRatio * sinTheta > 1.0;
+            Vector3 direction;
+
+            if (cannotRefract || GetReflectance(cosTheta, refractionRatio) > sampler.Get1D())
+            {
+                // Must Reflect
+                direction = Reflect(unitDirection, rec.Normal);
+            }
+            else
+            {
+                direction = Refract(unitDirection, rec.Normal, refractionRatio);
+            }
+
+            scattered = rec.SpawnRay(direction, rIn.Time());
+            return true;
+        }
+
+    private:
+        static Real GetReflectance(Real cosine, Real refIndex)
+        {
+            // Use Schlick's approximation for reflectance.
+            Real r0 = (1 - refIndex) / (1 + refIndex);
+            r0      = r0 * r0;
+            return r0 + (1 - r0) * pow((1 - cosine), 5);
+        }
+
+    private:
+        Real m_IR; // Index of Refraction
+    };
+
+    class DiffuseLight : public Material
+    {
+    public:
+        DiffuseLight(std::shared_ptr<Texture> albedo) : m_Emit(albedo) {}
+        DiffuseLight(Color color) : m_Emit(std::make_shared<SolidColor>(color)) {}
+
+        virtual bool Scatter(const Ray&       rIn,
+                             const HitRecord& rec,
+                             Color&           attenuation,
+                             Ray&             scattered,
+                             Sampler&         sampler) const override
+        {
+            return false;
+        }
+
+        virtual Color Emitted(Real u, Real v, const Point3& point) const override
+        {
+            return m_Emit->GetValue(u, v, point);
+        }
+
+        virtual bool IsEmissive() const override { return true; }
+
+    private:
+        std::shared_ptr<Texture> m_Emit;
+    };
+
+    /*
+     * The materials of a scene. Primitives and hit records refer to them by 32-bit ID, so a hit never touches the
+     * reference counts of shared pointers, which every worker thread would otherwise update for popular materials.
+     */
+    class MaterialTable
+    {
+    public:
+        // Returns the ID of the material, adding it if it's not in the table yet.
+        uint32_t Add(std::shared_ptr<Material> material)
+        {
+            if (!material)
+                throw std::invalid_argument("MaterialTable: null material");
+
+            auto it = m_IDs.find(material.get());
+            if (it != m_IDs.end())
+                return it->second;
+
+            const Material& instance  = *material;
+            uint32_t        typeIndex = static_cast<uint32_t>(m_TypeIndices.size());
+            typeIndex                 = m_TypeIndices.emplace(typeid(instance), typeIndex).first->second;
+
+            uint32_t id = static_cast<uint32_t>(m_Materials.size());
+            m_IDs.emplace(material.get(), id);
+            m_Materials.push_back(std::move(material));
+            m_Types.push_back(typeIndex);
+            return id;
+        }
+
+        const Material& Get(uint32_t id) const { return *m_Materials[id]; }
+        size_t          GetSize() const { return m_Materials.size(); }
+
+        // Materials of the same class share a dense type index, so work can be grouped by the code that shades it.
+        uint32_t GetTypeIndex(uint32_t id) const { return m_Types[id]; }
+        size_t   GetTypeCount() const { return m_TypeIndices.size(); }
+
+    private:
+        std::vector<std::shared_ptr<Material>>        m_Materials;
+        std::vector<uint32_t>                         m_Types;
+        std::unordered_map<const Material*, uint32_t> m_IDs;
+        std::unordered_map<std::type_index, uint32_t> m_TypeIndices;
+    };
+
+    /*
+     * Refines a ray-sphere hit point by projecting it back onto the sphere, which also gives it tight error bounds.
+     */
+    inline void ProjectOntoSphere(const Point3& point, const Point3& center, Real radius, HitRecord& rec)
+    {
+        Vector3 local = point - center;
+        local *= radius / local.Length();
+
+        rec.Point      = center + local;
+        rec.PointError = Gamma(5) * Abs(local) + Gamma(1) * Abs(rec.Point);
+    }
+
+    // Finds the nearest root of a ray-sphere intersection in [tMin, tMax].
+    inline bool IntersectSphere(const Ray& r, const Point3& center, Real radius, Real tMin, Real tMax, Real& root)
+    {
+        Vector3 oc    = r.Origin() - center;
+        Real    a     = r.Direction().LengthSquared();
+        Real    halfB = DotProduct(oc, r.Direction());
+        Real    c     = oc.LengthSquared() - radius * radius;
+
+        // halfB^2 - a * c cancels badly for distant or large spheres, use the distance from the center to the closest
+        // point on the line instead (Ray Tracing Gems, chapter 7).
+        Vector3 l     = oc - (halfB / a) * r.Direction();
+        Real    delta = a * (radius * radius - l.LengthSquared());
+        if (delta < 0)
+            return false;
+
+        // Get both roots without subtracting nearly equal values.
+        Real q  = halfB > 0 ? -halfB - std::sqrt(delta) : -halfB + std::sqrt(delta);
+        Real t0 = c / q;
+        Real t1 = q / a;
+        if (t0 > t1)
+            std::swap(t0, t1);
+
+        // Find the nearest root that lies in the acceptable range.
+        root = t0;
+        if (root < tMin || tMax < root)
+        {
+            root = t1;
+            if (root < tMin || tMax < root)
+                return false;
+        }
+
+        return true;
+    }
+
+    class Sphere : public Hittable
+    {
+    public:
+        Sphere() {}
+        Sphere(Point3 center, Real radius, uint32_t materialID) :
+            m_Center(center), m_Radius(radius), m_MaterialID(materialID) {};
+
+        virtual bool Intersect(const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const override
+        {
+            Real root;
+            if (!IntersectSphere(r, m_Center, m_Radius, tMin, tMax, root))
+                return false;
+
+            hit.Set(root, this);
+            return true;
+        }
+
+        virtual void ComputeSurfaceInteraction(const Ray& r, const SurfaceHit& hit, HitRecord& rec) const override
+        {
+            rec.T = hit.T;
+            ProjectOntoSphere(r.At(rec.T), m_Center, m_Radius, rec);
+
+            Vector3 outwardNormal = (rec.Point - m_Center) / m_Radius;
+            rec.SetFaceNormal(r, outwardNormal);
+            GetSphereUV(outwardNormal, rec.U, rec.V);
+            rec.MaterialID = m_MaterialID;
+        }
+
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
+        {
+            outputBox = AABB(m_Center - Vector3(m_Radius, m_Radius, m_Radius),
+                             m_Center + Vector3(m_Radius, m_Radius, m_Radius));
+            return true;
+        }
+
+        Real     GetArea() const { return 4 * Pi * m_Radius * m_Radius; }
+        uint32_t GetMaterialID() const { return m_MaterialID; }
+
+        /*
+         * Samples a point of the sphere visible from reference, uniformly over the cone of directions the sphere
+         * subtends there (pbrt's approach). From inside, the whole sphere is visible and its area is sampled instead.
+         */
+        bool Sample(const Point3& reference, Sample2D u, ShapeSample& sample) const
+        {
+            sample.MaterialID = m_MaterialID;
+
+            Vector3 toCenter        = m_Center - reference;
+            Real    distanceSquared = toCenter.LengthSquared();
+            Real    radiusSquared   = m_Radius * m_Radius;
+            if (distanceSquared <= radiusSquared)
+            {
+                sample.Normal = SampleUniformSphere(u);
+                sample.Point  = m_Center + m_Radius * sample.Normal;
+                sample.Pdf    = Pdf(reference, sample.Point);
+                GetSphereUV(sample.Normal, sample.U, sample.V);
+                return sample.Pdf > 0;
+            }
+
+            // Sample the angle theta from the direction to the center, then find the point of the sphere along it.
+            Real distance      = std::sqrt(distanceSquared);
+            Real sinThetaMaxSq = radiusSquared / distanceSquared;
+            Real cosThetaMax   = std::sqrt(std::max<Real>(0, 1 - sinThetaMaxSq));
+            Real cosTheta      = (1 - u.X) + u.X * cosThetaMax;
+            Real sinThetaSq    = std::max<Real>(0, 1 - cosTheta * cosTheta);
+            Real hitDistance   = distance * cosTheta -
+                               std::sqrt(std::max<Real>(0, radiusSquared - distanceSquared * sinThetaSq));
+            Real cosAlpha = (distanceSquared + radiusSquared - hitDistance * hitDistance) / (2 * distance * m_Radius);
+            Real sinAlpha = std::sqrt(std::max<Real>(0, 1 - cosAlpha * cosAlpha));
+            Real phi      = 2 * Pi * u.Y;
+
+            // Alpha is measured at the center, from the direction back to the reference point.
+            Vector3 w = -toCenter / distance;
+            Vector3 tangent, bitangent;
+            CoordinateSystem(w, tangent, bitangent);
+
+            sample.Normal = sinAlpha * std::cos(phi) * tangent + sinAlpha * std::sin(phi) * bitangent + cosAlpha * w;
+            sample.Point  = m_Center + m_Radius * sample.Normal;
+            sample.Pdf    = 1 / (2 * Pi * (1 - cosThetaMax));
+            GetSphereUV(sample.Normal, sample.U, sample.V);
+            return cosThetaMax < 1;
+        }
+
+        // The solid angle density of Sample choosing point, a point of the sphere visible from reference.
+        Real Pdf(const Point3& reference, const Point3& point) const
+        {
+            Real distanceSquared = (m_Center - reference).LengthSquared();
+            Real radiusSquared   = m_Radius * m_Radius;
+            if (distanceSquared <= radiusSquared)
+            {
+                Vector3 toPoint = point - reference;
+                Real    cosine  = std::fabs(DotProduct(Normalize(toPoint), (point - m_Center) / m_Radius));
+                if (cosine == 0)
+                    return 0;
+
+                return toPoint.LengthSquared() / (cosine * 4 * Pi * radiusSquared);
+            }
+
+            Real cosThetaMax = std::sqrt(std::max<Real>(0, 1 - radiusSquared / distanceSquared));
+            return cosThetaMax < 1 ? 1 / (2 * Pi * (1 - cosThetaMax)) : 0;
+        }
+
+        static void GetSphereUV(const Point3& point, Real& u, Real& v)
+        {
+            // point: a given point on the sphere of radius one, centered at the origin.
+            // u:     returned value [0,1] of angle around the Y axis from X=-1.
+            // v:     returned value [0,1] of angle from Y=-1 to Y=+1.
+            //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
+            //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
+            //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
+
+            Real theta = acos(-point.y());
+            Real phi   = atan2(-point.z(), point.x()) + Pi;
+
+            u = phi / (2 * Pi);
+            v = theta / Pi;
+        }
+
+    private:
+        Point3   m_Center;
+        Real     m_Radius;
+        uint32_t m_MaterialID;
+    };
+
+    /*
+     * Up to MaxSpheres static spheres stored as structure of arrays, so one pass of the SIMD kernel tests
+     * Simd::Wide::Width of them at once. Unused lanes have a NaN radius, which fails every comparison.
+     */
+    class SphereGroup : public Hittable
+    {
+    public:
+        static constexpr uint32_t MaxSpheres = 8;
+        static_assert(MaxSpheres % Simd::Wide::Width == 0, "SphereGroup lanes must fill whole registers");
+
+        struct Entry
+        {
+            Point3   Center;
+            Real     Radius;
+            uint32_t MaterialID;
+        };
+
+        SphereGroup()
+        {
+            const Real nan = std::numeric_limits<Real>::quiet_NaN();
+            std::fill(std::begin(m_Radius), std::end(m_Radius), nan);
+            std::fill(std::begin(m_CenterX), std::end(m_CenterX), 0);
+            std::fill(std::begin(m_CenterY), std::end(m_CenterY), 0);
+            std::fill(std::begin(m_CenterZ), std::end(m_CenterZ), 0);
+            std::fill(std::begin(m_MaterialIDs), std::end(m_MaterialIDs), 0);
+        }
+
+        bool IsFull() const { return m_Count == MaxSpheres; }
+
+        void Add(const Entry& sphere)
+        {
+            if (IsFull())
+                throw std::out_of_range("SphereGroup is full");
+
+            Vector3 extent(sphere.Radius, sphere.Radius, sphere.Radius);
+            AABB    box(sphere.Center - extent, sphere.Center + extent);
+            m_Box = m_Count == 0 ? box : GetSurroundingBox(m_Box, box);
+
+            m_CenterX[m_Count]     = sphere.Center.x();
+            m_CenterY[m_Count]     = sphere.Center.y();
+            m_CenterZ[m_Count]     = sphere.Center.z();
+            m_Radius[m_Count]      = sphere.Radius;
+            m_MaterialIDs[m_Count] = sphere.MaterialID;
+            ++m_Count;
+        }
+
+        virtual bool Intersect(const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const override
+        {
+            namespace W = Simd::Wide;
+
+            // Same math as IntersectSphere, see there for the reasoning behind the discriminant and the roots.
+            const Vector3     direction = r.Direction();
+            const Real        a         = direction.LengthSquared();
+            const W::Register zero      = W::Broadcast(0);
+            const W::Register aV        = W::Broadcast(a);
+            const W::Register invA      = W::Broadcast(1 / a);
+            const W::Register ox        = W::Broadcast(r.Origin().x());
+            const W::Register oy        = W::Broadcast(r.Origin().y());
+            const W::Register oz        = W::Broadcast(r.Origin().z());
+            const W::Register dx        = W::Broadcast(direction.x());
+            const W::Register dy        = W::Broadcast(direction.y());
+            const W::Register dz        = W::Broadcast(direction.z());
+            const W::Register tMinV     = W::Broadcast(tMin);
+
+            int  hitIndex = -1;
+            Real closest  = tMax;
+            for (uint32_t base = 0; base < m_Count; base += W::Width)
+            {
+                W::Register ocx     = W::Sub(ox, W::Load(m_CenterX + base));
+                W::Register ocy     = W::Sub(oy, W::Load(m_CenterY + base));
+                W::Register ocz     = W::Sub(oz, W::Load(m_CenterZ + base));
+                W::Register radius  = W::Load(m_Radius + base);
+                W::Register radius2 = W::Mul(radius, radius);
+
+                W::Register halfB = W::Add(W::Add(W::Mul(ocx, dx), W::Mul(ocy, dy)), W::Mul(ocz, dz));
+                W::Register oc2   = W::Add(W::Add(W::Mul(ocx, ocx), W::Mul(ocy, ocy)), W::Mul(ocz, ocz));
+                W::Register c     = W::Sub(oc2, radius2);
+
+                W::Register k     = W::Mul(halfB, invA);
+                W::Register lx    = W::Sub(ocx, W::Mul(k, dx));
+                W::Register ly    = W::Sub(ocy, W::Mul(k, dy));
+                W::Register lz    = W::Sub(ocz, W::Mul(k, dz));
+                W::Register l2    = W::Add(W::Add(W::Mul(lx, lx), W::Mul(ly, ly)), W::Mul(lz, lz));
+                W::Register delta = W::Mul(aV, W::Sub(radius2, l2));
+                W::Mask     isHit = W::GreaterEqual(delta, zero);
+
+                W::Register sqrtDelta = W::Sqrt(W::Max(delta, zero));
+                W::Register negHalfB  = W::Sub(zero, halfB);
+                W::Register q =
+                    W::Select(W::Greater(halfB, zero), W::Sub(negHalfB, sqrtDelta), W::Add(negHalfB, sqrtDelta));
+                W::Register t0    = W::Div(c, q);
+                W::Register t1    = W::Mul(q, invA);
+                W::Register tNear = W::Min(t0, t1);
+                W::Register tFar  = W::Max(t0, t1);
+
+                W::Register closestV = W::Broadcast(closest);
+                W::Mask     nearOk   = W::And(W::GreaterEqual(tNear, tMinV), W::LessEqual(tNear, closestV));
+                W::Mask     farOk    = W::And(W::GreaterEqual(tFar, tMinV), W::LessEqual(tFar, closestV));
+                int         laneMask = W::MoveMask(W::And(isHit, W::Or(nearOk, farOk)));
+                if (laneMask == 0)
+                    continue;
+
+                alignas(32) Real roots[W::Width];
+                W::Store(roots, W::Select(nearOk, tNear, tFar));
+                for (int lane = 0; lane < W::Width; ++lane)
+                {
+                    if ((laneMask & (1 << lane)) && roots[lane] <= closest)
+                    {
+                        closest  = roots[lane];
+                        hitIndex = static_cast<int>(base) + lane;
+                    }
+                }
+            }
+
+            if (hitIndex < 0)
+                return false;
+
+            hit.Set(closest, this, hitIndex);
+            return true;
+        }
+
+        virtual void ComputeSurfaceInteraction(const Ray& r, const SurfaceHit& hit, HitRecord& rec) const override
+        {
+            uint32_t hitIndex = hit.Element;
+            Point3   center(m_CenterX[hitIndex], m_CenterY[hitIndex], m_CenterZ[hitIndex]);
+            Real     radius = m_Radius[hitIndex];
+
+            rec.T = hit.T;
+            ProjectOntoSphere(r.At(rec.T), center, radius, rec);
+
+            Vector3 outwardNormal = (rec.Point - center) / radius;
+            rec.SetFaceNormal(r, outwardNormal);
+            Sphere::GetSphereUV(outwardNormal, rec.U, rec.V);
+            rec.MaterialID = m_MaterialIDs[hitIndex];
+        }
+
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
+        {
+            outputBox = m_Box;
+            return m_Count > 0;
+        }
+
+    private:
+        // Aligned for Simd::Wide::Load, see Simd::Wide.
+        alignas(Simd::Wide::Alignment) Real m_CenterX[MaxSpheres];
+        Real                                m_CenterY[MaxSpheres];
+        Real                                m_CenterZ[MaxSpheres];
+        Real                                m_Radius[MaxSpheres];
+        uint32_t                            m_MaterialIDs[MaxSpheres];
+        uint32_t                            m_Count = 0;
+        AABB                                m_Box;
+    };
+
+    /*
+     * Packs spheres into SphereGroups of spatial neighbours and adds the groups to a list, so the BVH built over the
+     * list has whole groups in its leaves. Spheres are sorted along a Morton curve over the grid of their centers,
+     * consecutive runs of the curve are compact, which keeps the group bounds tight.
+     */
+    inline void AddSphereGroups(HittableList& list, std::vector<SphereGroup::Entry> spheres)
+    {
+        if (spheres.empty())
+            return;
+
+        Point3 centerMin = spheres[0].Center;
+        Point3 centerMax = spheres[0].Center;
+        for (const auto& sphere : spheres)
+        {
+            centerMin = Min(centerMin, sphere.Center);
+            centerMax = Max(centerMax, sphere.Center);
+        }
+
+        const Vector3         extent = centerMax - centerMin;
+        std::vector<uint32_t> mortonCodes(spheres.size());
+        for (size_t i = 0; i < spheres.size(); ++i)
+        {
+            uint32_t cell[3];
+            for (int a = 0; a < 3; ++a)
+            {
+                Real offset = extent[a] > 0 ? (spheres[i].Center[a] - centerMin[a]) / extent[a] : 0;
+                cell[a]     = static_cast<uint32_t>(std::min<Real>(offset * 1024, 1023));
+            }
+            mortonCodes[i] = EncodeMorton3(cell[0], cell[1], cell[2]);
+        }
+
+        std::vector<uint32_t> order(spheres.size());
+        for (uint32_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::stable_sort(
+            order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return mortonCodes[a] < mortonCodes[b]; });
+
+        // Split the sorted range at the highest differing Morton bit until it fits into a group, so every group covers
+        // a single octree cell instead of straddling the jumps of the curve.
+        std::function<void(size_t, size_t)> emitGroups = [&](size_t begin, size_t end) {
+            uint32_t firstCode = mortonCodes[order[begin]];
+            uint32_t lastCode  = mortonCodes[order[end - 1]];
+            if (end - begin <= SphereGroup::MaxSpheres || firstCode == lastCode)
+            {
+                auto group = std::make_shared<SphereGroup>();
+                for (size_t i = begin; i < end; ++i)
+                {
+                    if (group->IsFull())
+                    {
+                        list.Add(group);
+                        group = std::make_shared<SphereGroup>();
+                    }
+                    group->Add(spheres[order[i]]);
+                }
+                list.Add(group);
+                return;
+            }
+
+            uint32_t splitBit = 1u << Log2Int(firstCode ^ lastCode);
+            size_t   split    = begin + 1;
+            while ((mortonCodes[order[split]] & splitBit) == 0)
+                ++split;
+            emitGroups(begin, split);
+            emitGroups(split, end);
+        };
+        emitGroups(0, order.size());
+    }
+
+    class MovingSphere : public Hittable
+    {
+    public:
+        MovingSphere() {}
+        MovingSphere(Point3 center0, Point3 center1, Real time0, Real time1, Real radius, uint32_t materialID) :
+            m_Center0(center0), m_Center1(center1), m_Time0(time0), m_Time1(time1), m_Radius(radius),
+            m_MaterialID(materialID)
+        {}
+
+        virtual bool Intersect(const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const override
+        {
+            Real root;
+            if (!IntersectSphere(r, GetCenter(r.Time()), m_Radius, tMin, tMax, root))
+                return false;
+
+            hit.Set(root, this);
+            return true;
+        }
+
+        virtual void ComputeSurfaceInteraction(const Ray& r, const SurfaceHit& hit, HitRecord& rec) const override
+        {
+            Point3 center = GetCenter(r.Time());
+
+            rec.T = hit.T;
+            ProjectOntoSphere(r.At(rec.T), center, m_Radius, rec);
+
+            Vector3 outwardNormal = (rec.Point - center) / m_Radius;
+            rec.SetFaceNormal(r, outwardNormal);
+            rec.MaterialID = m_MaterialID;
+        }
+
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
+        {
+            AABB box0(GetCenter(time0) - Vector3(m_Radius, m_Radius, m_Radius),
+                      GetCenter(time0) + Vector3(m_Radius, m_Radius, m_Radius));
+
+            AABB box1(GetCenter(time1) - Vector3(m_Radius, m_Radius, m_Radius),
+                      GetCenter(time1) + Vector3(m_Radius, m_Radius, m_Radius));
+
+            outputBox = GetSurroundingBox(box0, box1);
+            return true;
+        }
+
+        Point3 GetCenter(Real time) const
+        {
+            return m_Center0 + ((time - m_Time0) / (m_Time1 - m_Time0)) * (m_Center1 - m_Center0);
+        }
+
+    private:
+        Point3   m_Center0, m_Center1;
+        Real     m_Time0, m_Time1;
+        Real     m_Radius;
+        uint32_t m_MaterialID;
+    };
+
+    /*
+     * What the light BVH knows about a light, or a cluster of lights: where they are, their total power (Phi) and the
+     * directions they emit in. Surface normals lie within the cone of half-angle ThetaO around W, and light leaves a
+     * surface at most ThetaE away from its normal. Angles are stored as cosines.
+     */
+    struct LightBounds
+    {
+        Point3  Min       = Point3(Infinity, Infinity, Infinity);
+        Point3  Max       = Point3(-Infinity, -Infinity, -Infinity);
+        Vector3 W         = Vector3(0, 0, 1);
+        Real    Phi       = 0;
+        Real    CosThetaO = 1;
+        Real    CosThetaE = 1;
+        bool    TwoSided  = false;
+
+        Point3 GetCentroid() const { return 0.5 * (Min + Max); }
+
+        Real SurfaceArea() const
+        {
+            Vector3 d = Max - Min;
+            return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+        }
+
+        /*
+         * A conservative estimate of how much these lights contribute at point, a point of a surface with the given
+         * normal (pbrt's light BVH importance). It bounds the angles the lights can be seen and emit at, from the
+         * cluster's bounding sphere, and is 0 only if none of them can light the point.
+         */
+        Real Importance(const Point3& point, const Vector3& normal) const
+        {
+            // The cosine of max(0, a - b) for the angles a and b in [0, pi] with the given cosines.
+            auto sinFromCos    = [](Real cosine) { return std::sqrt(std::max<Real>(0, 1 - cosine * cosine)); };
+            auto cosSubClamped = [&](Real cosA, Real cosB) {
+                return cosA > cosB ? Real(1) : cosA * cosB + sinFromCos(cosA) * sinFromCos(cosB);
+            };
+
+            Point3  center          = GetCentroid();
+            Vector3 fromCenter      = point - center;
+            Real    distanceSquared = fromCenter.LengthSquared();
+            Real    radiusSquared   = (Max - Min).LengthSquared() / 4;
+            Vector3 wi              = distanceSquared > 0 ? fromCenter / std::sqrt(distanceSquared) : W;
+
+            // The angle the bounding sphere subtends at point, everything is possible from inside it.
+            Real cosThetaB = -1;
+            if (distanceSquared > radiusSquared)
+                cosThetaB = std::sqrt(1 - radiusSquared / distanceSquared);
+
+            // The smallest angle between an emitting normal and the direction to point, over the whole cluster.
+            Real cosThetaW = DotProduct(W, wi);
+            if (TwoSided)
+                cosThetaW = std::fabs(cosThetaW);
+
+            Real cosThetaP = cosSubClamped(cosSubClamped(cosThetaW, CosThetaO), cosThetaB);
+            if (cosThetaP <= CosThetaE)
+                return 0;
+
+            // Close to or inside the cluster the distance is clamped, so the estimate doesn't blow up.
+            Real importance = Phi * cosThetaP / std::max(distanceSquared, radiusSquared);
+            importance *= cosSubClamped(std::fabs(DotProduct(wi, normal)), cosThetaB);
+            return std::max<Real>(importance, 0);
+        }
+
+        static LightBounds Union(const LightBounds& a, const LightBounds& b)
+        {
+            if (a.Phi == 0)
+                return b;
+            if (b.Phi == 0)
+                return a;
+
+            LightBounds result;
+            result.Min       = VRaytracer::Min(a.Min, b.Min);
+            result.Max       = VRaytracer::Max(a.Max, b.Max);
+            result.Phi       = a.Phi + b.Phi;
+            result.CosThetaE = std::min(a.CosThetaE, b.CosThetaE);
+            result.TwoSided  = a.TwoSided || b.TwoSided;
+
+            // The smallest cone around both normal cones, unless one already contains the other.
+            bool sameAxis = a.W.x() == b.W.x() && a.W.y() == b.W.y() && a.W.z() == b.W.z();
+            if (a.CosThetaO == -1 || (sameAxis && a.CosThetaO <= b.CosThetaO))
+            {
+                result.W         = a.W;
+                result.CosThetaO = a.CosThetaO;
+                return result;
+            }
+
+            if (b.CosThetaO == -1 || (sameAxis && b.CosThetaO <= a.CosThetaO))
+            {
+                result.W         = b.W;
+                result.CosThetaO = b.CosThetaO;
+                return result;
+            }
+
+            Real thetaA = std::acos(Clamp(a.CosThetaO, -1, 1));
+            Real thetaB = std::acos(Clamp(b.CosThetaO, -1, 1));
+            Real thetaD = std::acos(Clamp(DotProduct(a.W, b.W), -1, 1));
+            if (std::min(thetaD + thetaB, Pi) <= thetaA)
+            {
+                result.W         = a.W;
+                result.CosThetaO = a.CosThetaO;
+                return result;
+            }
+
+            if (std::min(thetaD + thetaA, Pi) <= thetaB)
+            {
+                result.W         = b.W;
+                result.CosThetaO = b.CosThetaO;
+                return result;
+            }
+
+            Real    thetaO = (thetaA + thetaD + thetaB) / 2;
+            Vector3 axis   = CrossProduct(a.W, b.W);
+            if (thetaO >= Pi || axis.LengthSquared() == 0)
+            {
+                result.W         = a.W;
+                result.CosThetaO = -1;
+                return result;
+            }
+
+            // Rotate a's axis towards b's, around their common perpendicular.
+            Real thetaR      = thetaO - thetaA;
+            result.W         = std::cos(thetaR) * a.W + std::sin(thetaR) * CrossProduct(Normalize(axis), a.W);
+            result.CosThetaO = std::cos(thetaO);
+            return result;
+        }
+    };
+
+    /*
+     * A BVH over the lights of a scene, for picking the light to sample at a shading point by its importance there
+     * rather than uniformly. Each node bounds the position, power and emission directions of the lights below it;
+     * sampling walks from the root to a single light, choosing between the children in proportion to their importance,
+     * so the cost grows with the depth of the tree rather than the number of lights.
+     *
+     * Every leaf holds one light. The path to it is recorded as a bit trail (bit d set: second child at depth d), which
+     * lets Pmf retrace the choices Sample would have made for a light that was hit by a scattered ray.
+     */
+    class LightBVH
+    {
+    public:
+        // Builds the tree over the lights, they are referred to by their index in `lights`.
+        void Build(const std::vector<LightBounds>& lights)
+        {
+            m_Nodes.clear();
+            m_BitTrails.assign(lights.size(), 0);
+
+            std::vector<LightInfo> infos;
+            infos.reserve(lights.size());
+            for (uint32_t i = 0; i < lights.size(); ++i)
+            {
+                if (lights[i].Phi > 0)
+                    infos.push_back({lights[i], lights[i].GetCentroid(), i});
+            }
+
+            if (infos.empty())
+                return;
+
+            m_Nodes.reserve(2 * infos.size() - 1);
+            BuildRecursive(infos.data(), 0, static_cast<uint32_t>(infos.size()), 0, 0);
+        }
+
+        size_t GetNodeCount() const { return m_Nodes.size(); }
+
+        // Picks a light for point (on a surface with the given normal) with u, false if no light can contribute.
+        bool Sample(const Point3& point, const Vector3& normal, Real u, uint32_t& light, Real& pmf) const
+        {
+            if (m_Nodes.empty() || (m_Nodes[0].IsLeaf && m_Nodes[0].Bounds.Importance(point, normal) <= 0))
+                return false;
+
+            uint32_t nodeIndex = 0;
+            pmf                = 1;
+            while (!m_Nodes[nodeIndex].IsLeaf)
+            {
+                uint32_t secondChild = m_Nodes[nodeIndex].ChildOrLight;
+                Real     importance0 = m_Nodes[nodeIndex + 1].Bounds.Importance(point, normal);
+                Real     importance1 = m_Nodes[secondChild].Bounds.Importance(point, normal);
+                if (importance0 <= 0 && importance1 <= 0)
+                    return false;
+
+                // Reuse u for the next level by rescaling the part of [0, 1) that selected the child.
+                Real probability0 = importance0 / (importance0 + importance1);
+                if (u < probability0)
+                {
+                    nodeIndex = nodeIndex + 1;
+                    pmf *= probability0;
+                    u = std::min(u / probability0, OneMinusEpsilon);
+                }
+                else
+                {
+                    nodeIndex = secondChild;
+                    pmf *= 1 - probability0;
+                    u = std::min((u - probability0) / (1 - probability0), OneMinusEpsilon);
+                }
+            }
+
+            light = m_Nodes[nodeIndex].ChildOrLight;
+            return true;
+        }
+
+        // The probability of Sample picking light for point.
+        Real Pmf(const Point3& point, const Vector3& normal, uint32_t light) const
+        {
+            if (m_Nodes.empty() || (m_Nodes[0].IsLeaf && m_Nodes[0].Bounds.Importance(point, normal) <= 0))
+                return 0;
+
+            uint64_t bitTrail  = m_BitTrails[light];
+            uint32_t nodeIndex = 0;
+            Real     pmf       = 1;
+            while (!m_Nodes[nodeIndex].IsLeaf)
+            {
+                uint32_t secondChild = m_Nodes[nodeIndex].ChildOrLight;
+                Real     importance0 = m_Nodes[nodeIndex + 1].Bounds.Importance(point, normal);
+                Real     importance1 = m_Nodes[secondChild].Bounds.Importance(point, normal);
+                if (importance0 <= 0 && importance1 <= 0)
+                    return 0;
+
+                pmf *= ((bitTrail & 1) ? importance1 : importance0) / (importance0 + importance1);
+                nodeIndex = (bitTrail & 1) ? secondChild : nodeIndex + 1;
+                bitTrail >>= 1;
+            }
+
+            return m_Nodes[nodeIndex].ChildOrLight == light ? pmf : 0;
+        }
+
+    private:
+        static constexpr int      BucketCount = 12;
+        static constexpr uint32_t MaxSAHDepth = 32; // Deeper ranges are split at the median, the bit trails hold 64
+
+        struct LightInfo
+        {
+            LightBounds Bounds;
+            Point3      Centroid;
+            uint32_t    Index;
+        };
+
+        // Nodes are stored in depth-first order like LinearBVHNode, the first child follows its parent.
+        struct Node
+        {
+            LightBounds Bounds;
+            uint32_t    ChildOrLight; // Interior: index of the second child, leaf: the light
+            bool        IsLeaf;
+        };
+
+        /*
+         * The cost of a cluster in the split heuristic (pbrt's surface area orientation heuristic): its power times
+         * the solid angle its emission directions cover and its surface area, with splits across a thin dimension of
+         * the parent penalized by the parent's aspect ratio.
+         */
+        static Real EvaluateCost(const LightBounds& bounds, const Vector3& parentExtent, int axis)
+        {
+            Real cosThetaO  = bounds.CosThetaO;
+            Real thetaO     = std::acos(Clamp(cosThetaO, -1, 1));
+            Real thetaE     = std::acos(Clamp(bounds.CosThetaE, -1, 1));
+            Real thetaW     = std::min(thetaO + thetaE, Pi);
+            Real sinThetaO  = std::sqrt(std::max<Real>(0, 1 - cosThetaO * cosThetaO));
+            Real spread     = 2 * (thetaW - thetaO) * sinThetaO - std::cos(thetaO - 2 * thetaW) + cosThetaO;
+            Real solidAngle = 2 * Pi * (1 - cosThetaO) + Pi / 2 * spread;
+            Real aspect     = MaxComponent(parentExtent) / parentExtent[axis];
+            return bounds.Phi * solidAngle * aspect * bounds.SurfaceArea();
+        }
+
+        uint32_t BuildRecursive(LightInfo* infos, uint32_t start, uint32_t end, uint64_t bitTrail, uint32_t depth)
+        {
+            auto nodeIndex = static_cast<uint32_t>(m_Nodes.size());
+            m_Nodes.emplace_back();
+
+            if (end - start == 1)
+            {
+                m_Nodes[nodeIndex]              = {infos[start].Bounds, infos[start].Index, true};
+                m_BitTrails[infos[start].Index] = bitTrail;
+                return nodeIndex;
+            }
+
+            LightBounds bounds;
+            Point3      centroidMin = infos[start].Centroid;
+            Point3      centroidMax = infos[start].Centroid;
+            for (uint32_t i = start; i < end; ++i)
+            {
+                bounds      = LightBounds::Union(bounds, infos[i].Bounds);
+                centroidMin = Min(centroidMin, infos[i].Centroid);
+                centroidMax = Max(centroidMax, infos[i].Centroid);
+            }
+
+            // Find the cheapest split between buckets of centroids along any axis.
+            Vector3 extent     = bounds.Max - bounds.Min;
+            Real    bestCost   = Infinity;
+            int     bestAxis   = -1;
+            int     bestBucket = 0;
+            for (int axis = 0; axis < 3 && depth < MaxSAHDepth; ++axis)
+            {
+                if (centroidMax[axis] == centroidMin[axis])
+                    continue;
+
+                Real        scale = BucketCount / (centroidMax[axis] - centroidMin[axis]);
+                LightBounds buckets[BucketCount];
+                for (uint32_t i = start; i < end; ++i)
+                {
+                    int bucket      = GetBucket(infos[i].Centroid, centroidMin, axis, scale);
+                    buckets[bucket] = LightBounds::Union(buckets[bucket], infos[i].Bounds);
+                }
+
+                // Sweep from the right to get the cost of everything above each split, then from the left.
+                Real        aboveCosts[BucketCount - 1];
+                LightBounds above;
+                for (int split = BucketCount - 2; split >= 0; --split)
+                {
+                    above             = LightBounds::Union(above, buckets[split + 1]);
+                    aboveCosts[split] = above.Phi > 0 ? EvaluateCost(above, extent, axis) : -1;
+                }
+
+                LightBounds below;
+                for (int split = 0; split < BucketCount - 1; ++split)
+                {
+                    below = LightBounds::Union(below, buckets[split]);
+                    if (below.Phi == 0 || aboveCosts[split] < 0)
+                        continue;
+
+                    Real cost = EvaluateCost(below, extent, axis) + aboveCosts[split];
+                    if (cost < bestCost)
+                    {
+                        bestCost   = cost;
+                        bestAxis   = axis;
+                        bestBucket = split;
+                    }
+                }
             }
-            m_Condition.notify_all();
-            for (std::thread& worker : m_Workers)
-                worker.join();
+
+            uint32_t mid = start + (end - start) / 2;
+            if (bestAxis >= 0)
+            {
+                Real       scale  = BucketCount / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+                LightInfo* midPtr = std::partition(infos + start, infos + end, [&](const LightInfo& info) {
+                    return GetBucket(info.Centroid, centroidMin, bestAxis, scale) <= bestBucket;
+                });
+                mid = static_cast<uint32_t>(midPtr - infos);
+            }
+
+            // Coincident centroids, or a split that left one side empty, fall back to halving the range.
+            if (mid == start || mid == end)
+            {
+                Vector3 e    = centroidMax - centroidMin;
+                int     axis = (e.x() > e.y() && e.x() > e.z()) ? 0 : (e.y() > e.z()) ? 1 : 2;
+                mid          = start + (end - start) / 2;
+                std::nth_element(infos + start, infos + mid, infos + end, [axis](const auto& a, const auto& b) {
+                    return a.Centroid[axis] < b.Centroid[axis];
+                });
+            }
+
+            BuildRecursive(infos, start, mid, bitTrail, depth + 1);
+            uint32_t secondChild = BuildRecursive(infos, mid, end, bitTrail | (uint64_t(1) << depth), depth + 1);
+
+            m_Nodes[nodeIndex] = {bounds, secondChild, false};
+            return nodeIndex;
+        }
+
+        static int GetBucket(const Point3& centroid, const Point3& centroidMin, int axis, Real scale)
+        {
+            int bucket = static_cast<int>((centroid[axis] - centroidMin[axis]) * scale);
+            return std::clamp(bucket, 0, BucketCount - 1);
+        }
+
+        std::vector<Node>     m_Nodes;
+        std::vector<uint64_t> m_BitTrails;
+    };
+
+    enum class PrimitiveType : uint32_t
+    {
+        Sphere,
+        MovingSphere,
+        SphereGroup,
+        YZRect,
+        XZRect,
+        XYRect,
+        YZRectGroup,
+        XZRectGroup,
+        XYRectGroup,
+        Box,
+        TriangleMesh,
+        Instance, // Anything else (transforms, nested BVHs, user types), intersected through the virtual interface
+    };
+
+    /*
+     * A reference to a primitive of a CompiledScene: the type tag in the top 4 bits and the index into the array of
+     * that type in the rest, so leaves stay a compact array of 32-bit words.
+     */
+    struct PrimitiveRef
+    {
+        static constexpr uint32_t TypeShift = 28;
+        static constexpr uint32_t IndexMask = (1u << TypeShift) - 1;
+
+        PrimitiveRef() : Bits(0) {}
+        PrimitiveRef(PrimitiveType type, uint32_t index) : Bits((static_cast<uint32_t>(type) << TypeShift) | index) {}
+
+        PrimitiveType GetType() const { return static_cast<PrimitiveType>(Bits >> TypeShift); }
+        uint32_t      GetIndex() const { return Bits & IndexMask; }
+
+        uint32_t Bits;
+    };
+
+    /*
+     * The render-time form of a scene. Compiling flattens the authored lists and copies every primitive of a known
+     * type into a contiguous array of that type, the BVH leaves then reference them with tagged PrimitiveRefs and the
+     * intersection dispatches on the tag with direct calls instead of a virtual call per candidate. Only the winner
+     * of the intersection phase goes through the virtual ComputeSurfaceInteraction.
+     *
+     * Types are matched exactly, so subclasses (that may override the intersection) stay instances. Meshes are shared
+     * rather than copied, they own large buffers and already have a BVH of their own.
+     *
+     * The primitive arrays, the BVH and its leaf references are copied into the scene's arena, next to each other and
+     * released with it without running destructors. The authored list is only read while compiling.
+     *
+     * Rects and spheres with an emissive material are also collected as lights for next-event estimation, with a
+     * LightBVH over them to pick the one to sample. Emitters of any other kind are still found by the paths that hit
+     * them, they just aren't sampled directly.
+     */
+    class CompiledScene : public Hittable
+    {
+    public:
+        CompiledScene() {}
+        CompiledScene(CompiledScene&&)            = default;
+        CompiledScene& operator=(CompiledScene&&) = default;
+        CompiledScene(const HittableList&  list,
+                      const MaterialTable& materials,
+                      MemoryArena&         arena,
+                      Real                 time0,
+                      Real                 time1,
+                      int                  maxPrimitivesInNode = 4)
+        {
+            PrimitiveLists            lists;
+            std::vector<PrimitiveRef> refs;
+            AddObjects(list, lists, refs);
+            if (refs.size() > PrimitiveRef::IndexMask)
+                throw std::length_error("CompiledScene: too many primitives");
+
+            m_Spheres       = ArenaArray<Sphere>(arena, lists.Spheres);
+            m_MovingSpheres = ArenaArray<MovingSphere>(arena, lists.MovingSpheres);
+            m_SphereGroups  = ArenaArray<SphereGroup>(arena, lists.SphereGroups);
+            m_YZRects       = ArenaArray<YZRect>(arena, lists.YZRects);
+            m_XZRects       = ArenaArray<XZRect>(arena, lists.XZRects);
+            m_XYRects       = ArenaArray<XYRect>(arena, lists.XYRects);
+            m_YZRectGroups  = ArenaArray<AxisAlignedRectGroup<0>>(arena, lists.YZRectGroups);
+            m_XZRectGroups  = ArenaArray<AxisAlignedRectGroup<1>>(arena, lists.XZRectGroups);
+            m_XYRectGroups  = ArenaArray<AxisAlignedRectGroup<2>>(arena, lists.XYRectGroups);
+            m_Boxes         = ArenaArray<Box>(arena, lists.Boxes);
+            m_Meshes        = std::move(lists.Meshes);
+            m_Instances     = std::move(lists.Instances);
+
+            AddLights(materials);
+
+            std::vector<AABB> primitiveBounds(refs.size());
+            for (size_t i = 0; i < refs.size(); ++i)
+            {
+                if (!GetPrimitive(refs[i]).BoundingBox(time0, time1, primitiveBounds[i]))
+                    std::cerr << "No bounding box in CompiledScene constructor." << std::endl;
+
+                m_Box = i == 0 ? primitiveBounds[i] : GetSurroundingBox(m_Box, primitiveBounds[i]);
+            }
+
+            std::vector<LinearBVHNode> nodes;
+            std::vector<uint32_t>      primitiveIndices;
+            BVHBuilder(maxPrimitivesInNode).Build(primitiveBounds, nodes, primitiveIndices);
+
+            std::vector<PrimitiveRef> orderedRefs;
+            orderedRefs.reserve(refs.size());
+            for (uint32_t index : primitiveIndices)
+            {
+                orderedRefs.push_back(refs[index]);
+            }
+
+            m_Nodes      = ArenaArray<LinearBVHNode>(arena, nodes);
+            m_Primitives = ArenaArray<PrimitiveRef>(arena, orderedRefs);
+        }
+
+        virtual bool Intersect(const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const override
+        {
+            return TraverseLinearBVH(m_Nodes, RayQuery(r), tMin, tMax, [&](const LinearBVHNode& leaf, Real& tMax) {
+                bool hitAnything = false;
+                for (uint32_t i = 0; i < leaf.PrimitiveCount; ++i)
+                {
+                    if (IntersectPrimitive(m_Primitives[leaf.PrimitivesOffset + i], r, tMin, tMax, hit))
+                    {
+                        hitAnything = true;
+                        tMax        = hit.T;
+                    }
+                }
+                return hitAnything;
+            });
+        }
+
+        virtual bool BoundingBox(Real time0, Real time1, AABB& outputBox) const override
+        {
+            outputBox = m_Box;
+            return !m_Nodes.empty();
+        }
+
+        size_t GetNodeCount() const { return m_Nodes.size(); }
+        size_t GetPrimitiveCount() const { return m_Primitives.size(); }
+        size_t GetInstanceCount() const { return m_Instances.size(); }
+        size_t GetLightCount() const { return m_Lights.size(); }
+
+        /*
+         * The density of SampleLight choosing point, a point on the light that was hit, from reference (on a surface
+         * with the given normal). 0 for non-lights.
+         */
+        Real LightPdf(const Point3& reference, const Vector3& normal, const SurfaceHit& hit, const Point3& point) const
+        {
+            if (hit.Instance != nullptr)
+                return 0;
+
+            auto it = m_LightIndices.find(hit.Primitive);
+            if (it == m_LightIndices.end())
+                return 0;
+
+            Real pmf = m_LightBVH.Pmf(reference, normal, it->second);
+            return pmf > 0 ? pmf * ShapePdf(m_Lights[it->second], reference, point) : 0;
+        }
+
+        // Picks a light by its importance at reference and samples a point of it, the pdf includes the pick.
+        bool SampleLight(const Point3&  reference,
+                         const Vector3& normal,
+                         Real           uLight,
+                         Sample2D       u,
+                         ShapeSample&   sample) const
+        {
+            uint32_t light;
+            Real     pmf;
+            if (!m_LightBVH.Sample(reference, normal, uLight, light, pmf))
+                return false;
+
+            if (!SampleShape(m_Lights[light], reference, u, sample))
+                return false;
+
+            sample.Pdf *= pmf;
+            return true;
         }
 
     private:
-        // need to keep track of threads so we can join them
-        std::vector<std::thread> m_Workers;
-        // the task queue
-        std::queue<std::function<void()>> m_Tasks;
+        // The primitives of the authored lists by type, before they are copied into the arena.
+        struct PrimitiveLists
+        {
+            std::vector<Sphere>                              Spheres;
+            std::vector<MovingSphere>                        MovingSpheres;
+            std::vector<SphereGroup>                         SphereGroups;
+            std::vector<YZRect>                              YZRects;
+            std::vector<XZRect>                              XZRects;
+            std::vector<XYRect>                              XYRects;
+            std::vector<AxisAlignedRectGroup<0>>             YZRectGroups;
+            std::vector<AxisAlignedRectGroup<1>>             XZRectGroups;
+            std::vector<AxisAlignedRectGroup<2>>             XYRectGroups;
+            std::vector<Box>                                 Boxes;
+            std::vector<std::shared_ptr<const TriangleMesh>> Meshes;
+            std::vector<std::shared_ptr<Hittable>>           Instances;
+        };
+
+        // Qualified calls are resolved statically, which lets the compiler inline the primitive tests.
+        template<typename T>
+        static bool IntersectAs(const T& primitive, const Ray& r, Real tMin, Real tMax, SurfaceHit& hit)
+        {
+            return primitive.T::Intersect(r, tMin, tMax, hit);
+        }
 
-        // synchronization
-        std::mutex              m_QueueMutex;
-        std::condition_variable m_Condition;
-        bool                    m_Stop;
+        bool IntersectPrimitive(PrimitiveRef ref, const Ray& r, Real tMin, Real tMax, SurfaceHit& hit) const
+        {
+            const uint32_t index = ref.GetIndex();
+            switch (ref.GetType())
+            {
+                case PrimitiveType::Sphere:
+                    return IntersectAs(m_Spheres[index], r, tMin, tMax, hit);
+                case PrimitiveType::MovingSphere:
+                    return IntersectAs(m_MovingSpheres[index], r, tMin, tMax, hit);
+                case PrimitiveType::SphereGroup:
+                    return IntersectAs(m_SphereGroups[index], r, tMin, tMax, hit);
+                case PrimitiveType::YZRect:
+                    return IntersectAs(m_YZRects[index], r, tMin, tMax, hit);
+                case PrimitiveType::XZRect:
+                    return IntersectAs(m_XZRects[index], r, tMin, tMax, hit);
+                case PrimitiveType::XYRect:
+                    return IntersectAs(m_XYRects[index], r, tMin, tMax, hit);
+                case PrimitiveType::YZRectGroup:
+                    return IntersectAs(m_YZRectGroups[index], r, tMin, tMax, hit);
+                case PrimitiveType::XZRectGroup:
+                    return IntersectAs(m_XZRectGroups[index], r, tMin, tMax, hit);
+                case PrimitiveType::XYRectGroup:
+                    return IntersectAs(m_XYRectGroups[index], r, tMin, tMax, hit);
+                case PrimitiveType::Box:
+                    return IntersectAs(m_Boxes[index], r, tMin, tMax, hit);
+                case PrimitiveType::TriangleMesh:
+                    return IntersectAs(*m_Meshes[index], r, tMin, tMax, hit);
+                case PrimitiveType::Instance:
+                    return m_Instances[index]->Intersect(r, tMin, tMax, hit);
+            }
+            return false;
+        }
+
+        bool SampleShape(PrimitiveRef ref, const Point3& reference, Sample2D u, ShapeSample& sample) const
+        {
+            const uint32_t index = ref.GetIndex();
+            switch (ref.GetType())
+            {
+                case PrimitiveType::Sphere:
+                    return m_Spheres[index].Sample(reference, u, sample);
+                case PrimitiveType::YZRect:
+                    return m_YZRects[index].Sample(reference, u, sample);
+                case PrimitiveType::XZRect:
+                    return m_XZRects[index].Sample(reference, u, sample);
+                case PrimitiveType::XYRect:
+                    return m_XYRects[index].Sample(reference, u, sample);
+                default:
+                    return false;
+            }
+        }
+
+        Real ShapePdf(PrimitiveRef ref, const Point3& reference, const Point3& point) const
+        {
+            const uint32_t index = ref.GetIndex();
+            switch (ref.GetType())
+            {
+                case PrimitiveType::Sphere:
+                    return m_Spheres[index].Pdf(reference, point);
+                case PrimitiveType::YZRect:
+                    return m_YZRects[index].Pdf(reference, point);
+                case PrimitiveType::XZRect:
+                    return m_XZRects[index].Pdf(reference, point);
+                case PrimitiveType::XYRect:
+                    return m_XYRects[index].Pdf(reference, point);
+                default:
+                    return 0;
+            }
+        }
+
+        // Spheres emit in every direction from the whole of their surface.
+        static void SetEmissionCone(const Sphere& sphere, LightBounds& bounds) { bounds.CosThetaO = -1; }
+
+        // Rects emit from both faces (DiffuseLight doesn't check the side), so one normal covers them.
+        template<int Axis>
+        static void SetEmissionCone(const AxisAlignedRect<Axis>& rect, LightBounds& bounds)
+        {
+            bounds.W        = rect.GetNormal();
+            bounds.TwoSided = true;
+        }
+
+        void AddLights(const MaterialTable& materials)
+        {
+            std::vector<LightBounds> lightBounds;
+            auto addLights = [&](const auto& primitives, PrimitiveType type) {
+                for (uint32_t i = 0; i < primitives.size(); ++i)
+                {
+                    const Material& material = materials.Get(primitives[i].GetMaterialID());
+                    if (!material.IsEmissive())
+                        continue;
+
+                    // The power is estimated from the emission at the center, which is exact for solid colors.
+                    AABB box;
+                    primitives[i].BoundingBox(0, 0, box);
+                    LightBounds bounds;
+                    bounds.Min       = box.GetMin();
+                    bounds.Max       = box.GetMax();
+                    bounds.CosThetaE = 0; // Diffuse emission, up to 90 degrees from the normal
+                    SetEmissionCone(primitives[i], bounds);
+                    Color emission = material.Emitted(0.5, 0.5, bounds.GetCentroid());
+                    bounds.Phi     = MaxComponent(emission) * primitives[i].GetArea() * (bounds.TwoSided ? 2 : 1);
+
+                    m_LightIndices.emplace(&primitives[i], static_cast<uint32_t>(m_Lights.size()));
+                    m_Lights.push_back(PrimitiveRef(type, i));
+                    lightBounds.push_back(bounds);
+                }
+            };
+
+            addLights(m_Spheres, PrimitiveType::Sphere);
+            addLights(m_YZRects, PrimitiveType::YZRect);
+            addLights(m_XZRects, PrimitiveType::XZRect);
+            addLights(m_XYRects, PrimitiveType::XYRect);
+
+            m_LightBVH.Build(lightBounds);
+        }
+
+        const Hittable& GetPrimitive(PrimitiveRef ref) const
+        {
+            const uint32_t index = ref.GetIndex();
+            switch (ref.GetType())
+            {
+                case PrimitiveType::Sphere:
+                    return m_Spheres[index];
+                case PrimitiveType::MovingSphere:
+                    return m_MovingSpheres[index];
+                case PrimitiveType::SphereGroup:
+                    return m_SphereGroups[index];
+                case PrimitiveType::YZRect:
+                    return m_YZRects[index];
+                case PrimitiveType::XZRect:
+                    return m_XZRects[index];
+                case PrimitiveType::XYRect:
+                    return m_XYRects[index];
+                case PrimitiveType::YZRectGroup:
+                    return m_YZRectGroups[index];
+                case PrimitiveType::XZRectGroup:
+                    return m_XZRectGroups[index];
+                case PrimitiveType::XYRectGroup:
+                    return m_XYRectGroups[index];
+                case PrimitiveType::Box:
+                    return m_Boxes[index];
+                case PrimitiveType::TriangleMesh:
+                    return *m_Meshes[index];
+                case PrimitiveType::Instance:
+                    break;
+            }
+            return *m_Instances[index];
+        }
+
+        template<typename T>
+        static bool TryAdd(const std::shared_ptr<Hittable>& object,
+                           PrimitiveType                    type,
+                           std::vector<T>&                  primitives,
+                           std::vector<PrimitiveRef>&       refs)
+        {
+            if (typeid(*object) != typeid(T))
+                return false;
+
+            refs.push_back(PrimitiveRef(type, static_cast<uint32_t>(primitives.size())));
+            primitives.push_back(static_cast<const T&>(*object));
+            return true;
+        }
+
+        void AddObjects(const HittableList& list, PrimitiveLists& lists, std::vector<PrimitiveRef>& refs)
+        {
+            for (const auto& object : list.GetObjects())
+            {
+                if (typeid(*object) == typeid(HittableList))
+                {
+                    AddObjects(static_cast<const HittableList&>(*object), lists, refs);
+                    continue;
+                }
+
+                if (TryAdd(object, PrimitiveType::Sphere, lists.Spheres, refs) ||
+                    TryAdd(object, PrimitiveType::MovingSphere, lists.MovingSpheres, refs) ||
+                    TryAdd(object, PrimitiveType::SphereGroup, lists.SphereGroups, refs) ||
+                    TryAdd(object, PrimitiveType::YZRect, lists.YZRects, refs) ||
+                    TryAdd(object, PrimitiveType::XZRect, lists.XZRects, refs) ||
+                    TryAdd(object, PrimitiveType::XYRect, lists.XYRects, refs) ||
+                    TryAdd(object, PrimitiveType::YZRectGroup, lists.YZRectGroups, refs) ||
+                    TryAdd(object, PrimitiveType::XZRectGroup, lists.XZRectGroups, refs) ||
+                    TryAdd(object, PrimitiveType::XYRectGroup, lists.XYRectGroups, refs) ||
+                    TryAdd(object, PrimitiveType::Box, lists.Boxes, refs))
+                    continue;
+
+                if (typeid(*object) == typeid(TriangleMesh))
+                {
+                    auto index = static_cast<uint32_t>(lists.Meshes.size());
+                    refs.push_back(PrimitiveRef(PrimitiveType::TriangleMesh, index));
+                    lists.Meshes.push_back(std::static_pointer_cast<const TriangleMesh>(object));
+                    continue;
+                }
+
+                refs.push_back(PrimitiveRef(PrimitiveType::Instance, static_cast<uint32_t>(lists.Instances.size())));
+                lists.Instances.push_back(object);
+            }
+        }
+
+        ArenaArray<Sphere>                               m_Spheres;
+        ArenaArray<MovingSphere>                         m_MovingSpheres;
+        ArenaArray<SphereGroup>                          m_SphereGroups;
+        ArenaArray<YZRect>                               m_YZRects;
+        ArenaArray<XZRect>                               m_XZRects;
+        ArenaArray<XYRect>                               m_XYRects;
+        ArenaArray<AxisAlignedRectGroup<0>>              m_YZRectGroups;
+        ArenaArray<AxisAlignedRectGroup<1>>              m_XZRectGroups;
+        ArenaArray<AxisAlignedRectGroup<2>>              m_XYRectGroups;
+        ArenaArray<Box>                                  m_Boxes;
+        std::vector<std::shared_ptr<const TriangleMesh>> m_Meshes;
+        std::vector<std::shared_ptr<Hittable>>           m_Instances;
+
+        ArenaArray<PrimitiveRef>  m_Primitives;
+        ArenaArray<LinearBVHNode> m_Nodes;
+        AABB                      m_Box;
+
+        // The lights point into the primitive arrays, which stay where they are in the arena when the scene is moved.
+        std::vector<PrimitiveRef>                     m_Lights;
+        std::unordered_map<const Hittable*, uint32_t> m_LightIndices;
+        LightBVH                                      m_LightBVH;
+    };
+
+    /*
+     * The light arriving from infinitely far away, in every direction a ray escapes the scene. It is either a constant
+     * color or an equirectangular (latitude-longitude) HDR image with +Y up, loaded with stb_image's float loader.
+     * Images are importance sampled with a 2D distribution over their pixels, weighted by luminance and by the solid
+     * angle each row covers. Constant colors are only found by rays that escape.
+     */
+    class EnvironmentLight
+    {
+    public:
+        EnvironmentLight(const Color& color) : m_Color(color) {}
+        EnvironmentLight(const char* fileName) : m_Color(Black)
+        {
+            int    componentsPerPixel = 3;
+            float* data               = stbi_loadf(fileName, &m_Width, &m_Height, &componentsPerPixel, 3);
+            if (!data)
+            {
+                std::cerr << "ERROR: Could not load environment map '" << fileName << "'.\n";
+                m_Width = m_Height = 0;
+                return;
+            }
+
+            m_Pixels.assign(data, data + 3 * static_cast<size_t>(m_Width) * m_Height);
+            stbi_image_free(data);
+
+            // Rows near the poles cover less solid angle, the sine of the row's polar angle accounts for it.
+            m_Distribution = Distribution2D(m_Width, m_Height, [this](uint32_t x, uint32_t y) {
+                const float* pixel    = GetPixel(x, y);
+                Real         sinTheta = std::sin(Pi * (y + 0.5) / m_Height);
+                return Luminance(Color(pixel[0], pixel[1], pixel[2])) * sinTheta;
+            });
+        }
+
+        bool HasImage() const { return m_Width > 0; }
+
+        Color GetRadiance(const Vector3& direction) const
+        {
+            if (!HasImage())
+                return m_Color;
+
+            return GetRadiance(DirectionToUV(Normalize(direction)));
+        }
+
+        // Samples a direction towards the image, with the radiance from there and the solid angle pdf.
+        bool Sample(Sample2D u, Vector3& direction, Color& radiance, Real& pdf) const
+        {
+            Real     mapPdf;
+            Sample2D uv = m_Distribution.Sample(u, mapPdf);
+            if (mapPdf == 0)
+                return false;
+
+            Real theta    = Pi * uv.Y;
+            Real phi      = 2 * Pi * uv.X - Pi;
+            Real sinTheta = std::sin(theta);
+            if (sinTheta == 0)
+                return false;
+
+            // The image covers 2pi x pi radians, and a solid angle element is sin(theta) times the area element.
+            direction = Vector3(sinTheta * std::cos(phi), std::cos(theta), sinTheta * std::sin(phi));
+            radiance  = GetRadiance(uv);
+            pdf       = mapPdf / (2 * Pi * Pi * sinTheta);
+            return true;
+        }
+
+        // The density of Sample choosing direction, 0 for constant colors.
+        Real Pdf(const Vector3& direction) const
+        {
+            if (!HasImage())
+                return 0;
+
+            Vector3 unit     = Normalize(direction);
+            Real    sinTheta = std::sqrt(std::max<Real>(0, 1 - unit.y() * unit.y()));
+            if (sinTheta == 0)
+                return 0;
+
+            return m_Distribution.Pdf(DirectionToUV(unit)) / (2 * Pi * Pi * sinTheta);
+        }
+
+    private:
+        static Sample2D DirectionToUV(const Vector3& unit)
+        {
+            Real u = (std::atan2(unit.z(), unit.x()) + Pi) / (2 * Pi);
+            Real v = std::acos(Clamp(unit.y(), -1, 1)) / Pi;
+            return {std::min(u, OneMinusEpsilon), std::min(v, OneMinusEpsilon)};
+        }
+
+        const float* GetPixel(uint32_t x, uint32_t y) const
+        {
+            return &m_Pixels[3 * (static_cast<size_t>(y) * m_Width + x)];
+        }
+
+        Color GetRadiance(Sample2D uv) const
+        {
+            auto         x     = std::min(static_cast<int>(uv.X * m_Width), m_Width - 1);
+            auto         y     = std::min(static_cast<int>(uv.Y * m_Height), m_Height - 1);
+            const float* pixel = GetPixel(x, y);
+            return Color(pixel[0], pixel[1], pixel[2]);
+        }
+
+        Color              m_Color;
+        std::vector<float> m_Pixels; // RGB, row by row from the top (+Y)
+        int                m_Width  = 0;
+        int                m_Height = 0;
+        Distribution2D     m_Distribution;
+    };
+
+    struct PixelColor
+    {
+        PixelColor() : R(0), G(0), B(0), A(0) {}
+        PixelColor(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) : R(r), G(g), B(b), A(a) {}
+        PixelColor(const Color& color)
+        {
+            R = static_cast<uint8_t>(255.999 * color.x());
+            G = static_cast<uint8_t>(255.999 * color.y());
+            B = static_cast<uint8_t>(255.999 * color.z());
+            A = 255;
+        }
+
+        uint8_t R;
+        uint8_t G;
+        uint8_t B;
+        uint8_t A;
+    };
+
+    struct FrameBuffer
+    {
+        FrameBuffer(std::vector<PixelColor> data, int width, int height) : Data(data), Width(width), Height(height) {}
+
+        size_t GetSize() { return Width * Height; }
+
+        std::vector<PixelColor> Data;
+        uint32_t                Width;
+        uint32_t                Height;
+    };
+
+    struct RenderCameraConfiguration
+    {
+        Point3  LookFrom;
+        Point3  LookAt;
+        Vector3 ViewUp;
+        Real    DistanceToFocus;
+        Real    Aperture;
+        Real    FOV;
+    };
+
+    enum class IntegratorType : uint32_t
+    {
+        DepthFirst = 0, // Each path is traced to its end before the next one starts
+        Wavefront,      // Batches of paths advance one bounce at a time, see RaytracerCore::TraceWavefront
+    };
+
+    inline const char* IntegratorTypeNames[] = {"DepthFirst", "Wavefront"};
+
+    struct RenderQualityConfiguration
+    {
+        uint32_t       SamplesPerPixel = 10;
+        uint32_t       MaxDepth        = 4;
+        uint32_t       MinDepth        = 3; // Bounces before Russian roulette may end a path
+        SamplerType    Sampler         = SamplerType::Sobol;
+        IntegratorType Integrator      = IntegratorType::DepthFirst;
+        bool           SortRays        = true; // Wavefront: bin secondary rays by direction and origin before tracing
+        Real           ErrorThreshold  = 0;    // Adaptive sampling: see PixelEstimate::GetError, 0 turns it off
+    };
+
+    struct RenderConfiguration
+    {
+        uint32_t                   RenderTargetWidth;
+        uint32_t                   RenderTargetHeight;
+        RenderCameraConfiguration  CameraConfig;
+        Color                      BackgroundColor = Black;
+        std::string                EnvironmentMap; // Path of an HDR image that replaces BackgroundColor, if not empty
+        uint32_t                   RenderTileSize = 16;
+        RenderQualityConfiguration QualityConfig;
+        uint32_t                   SceneID = 0;
+    };
+
+    /*
+     * A scene ready for rendering: the authored objects, the compiled form that is traced and the materials both refer
+     * to by ID. Dropping the scene releases its arena in one go.
+     */
+    struct Scene
+    {
+        MemoryArena   Arena;   // Backs all that World refers to, declared first so it's destroyed last
+        HittableList  Objects; // The authored geometry, released once it's compiled into World
+        CompiledScene World;
+        MaterialTable Materials;
+    };
+
+    /*
+     * Counts the cache misses of the calling thread with the hardware counters of the CPU, through the Linux perf
+     * interface. Elsewhere, and where the counters can't be opened (virtual machines without a PMU, a restrictive
+     * perf_event_paranoid), IsAvailable is false and Read returns 0. Implemented in CacheMissCounter.cpp.
+     */
+    class CacheMissCounter
+    {
+    public:
+        CacheMissCounter();
+        ~CacheMissCounter();
+
+        CacheMissCounter(const CacheMissCounter&)            = delete;
+        CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+
+        bool IsAvailable() const { return m_FileDescriptor >= 0; }
+
+        // The misses counted since the counter was created.
+        uint64_t Read() const;
+
+    private:
+        int m_FileDescriptor = -1;
+    };
+
+    /*
+     * How the wavefront integrator's secondary rays went through the scene BVH, during the last render with SortRays
+     * off and the last one with it on, so the two can be compared.
+     */
+    struct TraversalStats
+    {
+        struct Counts
+        {
+            uint64_t SecondaryRays = 0;
+            uint64_t CacheMisses   = 0; // While intersecting SecondaryRays
+        };
+
+        Counts Unsorted;
+        Counts Sorted;
+        bool   CacheMissesCounted = false; // CacheMissCounter::IsAvailable, CacheMisses stays 0 otherwise
     };
 
-    struct PixelColor
+    // A rectangle of the frame buffer that is rendered as one unit of work, its pixels are numbered row by row.
+    struct RenderTile
     {
-        PixelColor() : R(0), G(0), B(0), A(0) {}
-        PixelColor(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) : R(r), G(g), B(b), A(a) {}
-        PixelColor(const Color& color)
+        uint32_t XStart;
+        uint32_t YStart;
+        uint32_t XEnd;
+        uint32_t YEnd;
+        uint32_t FrameBufferWidth;
+        uint32_t FrameBufferHeight;
+
+        uint32_t GetWidth() const { return XEnd - XStart; }
+        uint32_t GetPixelCount() const { return GetWidth() * (YEnd - YStart); }
+        uint32_t GetX(uint32_t pixel) const { return XStart + pixel % GetWidth(); }
+        uint32_t GetY(uint32_t pixel) const { return YStart + pixel / GetWidth(); }
+        bool     Contains(uint32_t x, uint32_t y) const { return x >= XStart && x < XEnd && y >= YStart && y < YEnd; }
+
+        // The tile with a border of the given width around it, clipped to the frame buffer.
+        RenderTile Grow(uint32_t border) const
         {
-            R = static_cast<uint8_t>(255.999 * color.x());
-            G = static_cast<uint8_t>(255.999 * color.y());
-            B = static_cast<uint8_t>(255.999 * color.z());
-            A = 255;
+            RenderTile grown = *this;
+            grown.XStart     = XStart - std::min(XStart, border);
+            grown.YStart     = YStart - std::min(YStart, border);
+            grown.XEnd       = std::min(XEnd + border, FrameBufferWidth);
+            grown.YEnd       = std::min(YEnd + border, FrameBufferHeight);
+            return grown;
         }
-
-        uint8_t R;
-        uint8_t G;
-        uint8_t B;
-        uint8_t A;
     };
 
-    struct FrameBuffer
+    /*
+     * The samples of a pixel so far: the sum of their radiance, and the running mean and variance of their luminance
+     * (Welford's algorithm), which adaptive sampling judges the pixel by.
+     */
+    struct PixelEstimate
     {
-        FrameBuffer(std::vector<PixelColor> data, int width, int height) : Data(data), Width(width), Height(height) {}
+        Color    Sum         = Black;
+        uint32_t SampleCount = 0;
+        Real     Mean        = 0;
+        Real     M2          = 0; // Sum of squared differences from the mean
 
-        size_t GetSize() { return Width * Height; }
+        void Add(const Color& radiance)
+        {
+            Real luminance = Luminance(radiance);
+            Real delta     = luminance - Mean;
+            Sum += radiance;
+            SampleCount++;
+            Mean += delta / SampleCount;
+            M2 += delta * (luminance - Mean);
+        }
 
-        std::vector<PixelColor> Data;
-        uint32_t                Width;
-        uint32_t                Height;
-    };
+        /*
+         * How far off the displayed value of the pixel may be: half the difference of the displayed values (gamma 2,
+         * clamped to [0, 1]) one standard error of the mean above and below the mean. Pixels that are black or
+         * saturated either way converge early, dark ones are held to a stricter standard than bright ones.
+         */
+        Real GetError() const
+        {
+            if (SampleCount < 2)
+                return Infinity;
 
-    struct RenderCameraConfiguration
-    {
-        Point3  LookFrom;
-        Point3  LookAt;
-        Vector3 ViewUp;
-        double  DistanceToFocus;
-        double  Aperture;
-        double  FOV;
+            Real standardError = std::sqrt(M2 / (SampleCount - 1) / SampleCount);
+            auto display       = [](Real value) { return std::sqrt(Clamp(value, 0, 1)); };
+            return (display(Mean + standardError) - display(Mean - standardError)) / 2;
+        }
     };
 
-    struct RenderQualityConfiguration
+    // What a path carries from one vertex to the next.
+    struct PathState
     {
-        uint32_t SamplesPerPixel = 10;
-        uint32_t MaxDepth        = 4;
+        Ray     CurrentRay;
+        Color   Radiance   = Black;
+        Color   Throughput = White; // The product of the attenuations so far
+        Real    ScatterPdf = 0;     // Density CurrentRay was scattered with, 0 unless the lights were sampled too
+        Point3  ScatterPoint;
+        Vector3 ScatterNormal;
     };
 
-    struct RenderConfiguration
+    // A shadow ray towards a sampled light, and the radiance it adds to its path if nothing blocks it.
+    struct DirectLightSample
     {
-        uint32_t                   RenderTargetWidth;
-        uint32_t                   RenderTargetHeight;
-        RenderCameraConfiguration  CameraConfig;
-        Color                      BackgroundColor = Black;
-        uint32_t                   RenderTileSize  = 16;
-        RenderQualityConfiguration QualityConfig;
-        uint32_t                   SceneID = 0;
+        Ray   ShadowRay;
+        Real  TMax     = 0;
+        Color Radiance = Black;
     };
 
-    static ThreadPool Pool(std::thread::hardware_concurrency() - 1);
     static std::mutex TileMutex;
 
     class RaytracerCore
     {
     public:
-        RaytracerCore() {}
+        // The counters are available to every thread of the process or to none, one try tells.
+        RaytracerCore() : m_CacheMissCounterAvailable(CacheMissCounter().IsAvailable()) {}
         const std::shared_ptr<FrameBuffer>& GetFrameBuffer() const { return m_FrameBuffer; }
 
+        // Samples taken by all pixels since the start of the last render, adaptive sampling makes it vary.
+        uint64_t GetPixelSampleCount() const { return m_PixelSampleCount.load(std::memory_order_relaxed); }
+
+        // Samples adaptive sampling took around the tiles only to judge their edge pixels by, since the last render.
+        uint64_t GetApronSampleCount() const { return m_ApronSampleCount.load(std::memory_order_relaxed); }
+
+        // Counted from the start of the last wavefront render of each kind, tiles that are still running keep adding.
+        TraversalStats GetTraversalStats() const
+        {
+            auto counts = [&](bool sorted) {
+                TraversalStats::Counts counts;
+                counts.SecondaryRays = m_SecondaryRayCount[sorted].load(std::memory_order_relaxed);
+                counts.CacheMisses   = m_SecondaryRayCacheMisses[sorted].load(std::memory_order_relaxed);
+                return counts;
+            };
+
+            TraversalStats stats;
+            stats.Unsorted           = counts(false);
+            stats.Sorted             = counts(true);
+            stats.CacheMissesCounted = m_CacheMissCounterAvailable;
+            return stats;
+        }
+
+        // Drops all cached scenes, the next render of each scene rebuilds it from scratch. A scene's arena is released
+        // as soon as the tiles still rendering it are done.
+        void ClearSceneCache() { m_SceneCache.clear(); }
+
+        // Arena statistics of a cached scene, returns false if the scene hasn't been built yet.
+        bool GetSceneMemoryStats(uint32_t sceneID, MemoryArena::Stats& stats) const
+        {
+            auto it = m_SceneCache.find(sceneID);
+            if (it == m_SceneCache.end())
+                return false;
+
+            stats = it->second->Arena.GetStats();
+            return true;
+        }
+
         void Render(RenderConfiguration config)
         {
             auto frameBufferWidth  = config.RenderTargetWidth;
             auto frameBufferHeight = config.RenderTargetHeight;
             auto tileSize          = config.RenderTileSize;
-            auto samplesPerPixel   = config.QualityConfig.SamplesPerPixel;
-            auto maxDepth          = config.QualityConfig.MaxDepth;
-
-            m_FrameBuffer = std::make_shared<FrameBuffer>(
-                std::vector<PixelColor>(frameBufferWidth * frameBufferHeight), frameBufferWidth, frameBufferHeight);
+            auto quality           = config.QualityConfig;
 
-            // Init World
-            switch (config.SceneID)
+            m_PixelSampleCount = 0;
+            m_ApronSampleCount = 0;
+            if (quality.Integrator == IntegratorType::Wavefront)
             {
-                case 0: {
-                    InitRandomScene();
-                    break;
-                }
+                m_SecondaryRayCount[quality.SortRays]       = 0;
+                m_SecondaryRayCacheMisses[quality.SortRays] = 0;
+            }
 
-                case 1: {
-                    InitSimpleCornellBox();
-                }
+            auto frameBuffer = std::make_shared<FrameBuffer>(
+                std::vector<PixelColor>(frameBufferWidth * frameBufferHeight), frameBufferWidth, frameBufferHeight);
+            m_FrameBuffer = frameBuffer;
 
-                default:
-                    break;
-            }
+            // Init World, scenes are built only once and shared by every render of the same scene
+            std::shared_ptr<const Scene>            scene       = GetScene(config.SceneID);
+            std::shared_ptr<const EnvironmentLight> environment = GetEnvironment(config);
 
             // Camera
             m_Camera = {config.CameraConfig.LookFrom,
                         config.CameraConfig.LookAt,
                         config.CameraConfig.ViewUp,
                         config.CameraConfig.FOV,
-                        (double)frameBufferWidth / frameBufferWidth,
+                        (Real)frameBufferWidth / frameBufferWidth,
                         config.CameraConfig.Aperture,
                         config.CameraConfig.DistanceToFocus};
 
@@ -1497,55 +5611,115 @@ namespace VRaytracer
             int totalTileCount    = xTiles * yTiles;
             int finishedTileCount = 0;
 
-            auto renderTile = [&](int      xTileIndex,
+            // Tiles keep their own references to the scene, environment, frame buffer, camera and quality settings, so
+            // they stay valid even if a new render is started before this one finishes.
+            auto renderTile = [this, scene, environment, frameBuffer, quality, camera = m_Camera](
+                                  int      xTileIndex,
                                   int      yTileIndex,
                                   uint32_t tileSize,
                                   uint32_t frameBufferWidth,
                                   uint32_t frameBufferHeight,
-                                  uint32_t samplesPerPixel,
-                                  uint32_t maxDepth,
-                                  Color    backgroundColor,
                                   int      finishedTileCount,
                                   int      totalTileCount) {
-                int xStart = xTileIndex * tileSize;
-                int yStart = yTileIndex * tileSize;
-
-                for (int j = yStart; j < yStart + tileSize; ++j)
+                RenderTile tile;
+                tile.XStart            = xTileIndex * tileSize;
+                tile.YStart            = yTileIndex * tileSize;
+                tile.XEnd              = std::min(tile.XStart + tileSize, frameBufferWidth);
+                tile.YEnd              = std::min(tile.YStart + tileSize, frameBufferHeight);
+                tile.FrameBufferWidth  = frameBufferWidth;
+                tile.FrameBufferHeight = frameBufferHeight;
+
+                // Samplers are deterministic per pixel, so the image doesn't depend on the tile scheduling.
+                auto sampler =
+                    CreateSampler(quality.Sampler, quality.SamplesPerPixel, frameBufferWidth, frameBufferHeight);
+
+                // Without an error threshold every pixel takes all its samples in one round. With one, pixels take
+                // samples in rounds and drop out once their error estimates and their neighbours' are below it. The
+                // pixels on the edge of the tile have neighbours in the next tiles, so a one pixel apron around the
+                // tile is traced as well, only to judge them by.
+                bool       adaptive = quality.ErrorThreshold > 0;
+                RenderTile traced   = adaptive ? tile.Grow(1) : tile;
+
+                std::vector<PixelEstimate> estimates(traced.GetPixelCount());
+                std::vector<uint32_t>      pixels(traced.GetPixelCount());
+                std::iota(pixels.begin(), pixels.end(), 0);
+
+                uint32_t roundSize   = adaptive ? AdaptiveRoundSamples : std::max<uint32_t>(1, quality.SamplesPerPixel);
+                uint32_t firstSample = 0;
+                while (firstSample < quality.SamplesPerPixel && !pixels.empty())
                 {
-                    for (int i = xStart; i < xStart + tileSize; ++i)
+                    uint32_t lastSample = std::min(firstSample + roundSize, quality.SamplesPerPixel);
+                    if (quality.Integrator == IntegratorType::Wavefront)
                     {
-                        // Bounds check
-                        if (i >= frameBufferWidth || j >= frameBufferHeight)
-                            continue;
+                        TraceWavefront(camera,
+                                       *scene,
+                                       *environment,
+                                       quality,
+                                       traced,
+                                       pixels,
+                                       firstSample,
+                                       lastSample,
+                                       *sampler,
+                                       estimates);
+                    }
+                    else
+                    {
+                        TraceDepthFirst(camera,
+                                        *scene,
+                                        *environment,
+                                        quality,
+                                        traced,
+                                        pixels,
+                                        firstSample,
+                                        lastSample,
+                                        *sampler,
+                                        estimates);
+                    }
 
-                        Color color = Black;
-                        for (int s = 0; s < samplesPerPixel; ++s)
-                        {
-                            double u = (i + GetRandomDouble()) / (frameBufferWidth - 1);
-                            double v = (j + GetRandomDouble()) / (frameBufferHeight - 1);
-                            Ray    r = m_Camera.GetRay(u, v);
-                            color += GetRayColor(r, backgroundColor, m_World, maxDepth);
-                        }
+                    if (adaptive)
+                        RemoveConvergedPixels(traced, estimates, quality.ErrorThreshold, pixels);
+
+                    firstSample = lastSample;
+                }
 
-                        auto r = color.x();
-                        auto g = color.y();
-                        auto b = color.z();
-
-                        // Divide the color by the number of samples and gamma-correct for gamma=2.0.
-                        double scale = 1.0 / samplesPerPixel;
-                        r            = sqrt(scale * r);
-                        g            = sqrt(scale * g);
-                        b            = sqrt(scale * b);
-
-                        // Write Color
-                        int        index           = j * frameBufferWidth + i;
-                        PixelColor pixelColor      = {static_cast<uint8_t>(255.999 * r),
-                                                      static_cast<uint8_t>(255.999 * g),
-                                                      static_cast<uint8_t>(255.999 * b)};
-                        m_FrameBuffer->Data[index] = pixelColor;
+                uint64_t sampleCount      = 0;
+                uint64_t apronSampleCount = 0;
+                for (uint32_t pixel = 0; pixel < traced.GetPixelCount(); ++pixel)
+                {
+                    const PixelEstimate& estimate = estimates[pixel];
+
+                    // The apron belongs to the next tiles, which write it themselves
+                    uint32_t x = traced.GetX(pixel);
+                    uint32_t y = traced.GetY(pixel);
+                    if (!tile.Contains(x, y))
+                    {
+                        apronSampleCount += estimate.SampleCount;
+                        continue;
                     }
+
+                    sampleCount += estimate.SampleCount;
+
+                    auto r = estimate.Sum.x();
+                    auto g = estimate.Sum.y();
+                    auto b = estimate.Sum.z();
+
+                    // Divide the color by the number of samples and gamma-correct for gamma=2.0.
+                    Real scale = 1.0 / std::max<uint32_t>(1, estimate.SampleCount);
+                    r          = sqrt(scale * r);
+                    g          = sqrt(scale * g);
+                    b          = sqrt(scale * b);
+
+                    // Write Color
+                    int        index         = y * frameBufferWidth + x;
+                    PixelColor pixelColor    = {static_cast<uint8_t>(255.999 * r),
+                                                static_cast<uint8_t>(255.999 * g),
+                                                static_cast<uint8_t>(255.999 * b)};
+                    frameBuffer->Data[index] = pixelColor;
                 }
 
+                m_PixelSampleCount += sampleCount;
+                m_ApronSampleCount += apronSampleCount;
+
                 {
                     std::lock_guard<std::mutex> lock(TileMutex);
                     finishedTileCount++;
@@ -1566,9 +5740,6 @@ namespace VRaytracer
                                  tileSize,
                                  frameBufferWidth,
                                  frameBufferHeight,
-                                 samplesPerPixel,
-                                 maxDepth,
-                                 config.BackgroundColor,
                                  finishedTileCount,
                                  totalTileCount);
                 }
@@ -1576,44 +5747,586 @@ namespace VRaytracer
         }
 
     private:
-        Color GetRayColor(const Ray& r, const Color& backgroundColor, const Hittable& world, int depth)
+        // Samples per pixel and round of adaptive sampling, a power of two keeps the Sobol points of a pixel balanced.
+        static constexpr uint32_t AdaptiveRoundSamples = 16;
+
+        /*
+         * Drops the pixels whose estimate and those of all their neighbours in the tile are within the threshold. Going
+         * by the neighbours too keeps a pixel that got lucky in its first rounds from stopping next to noisy ones. The
+         * tile is the rendered one with its apron, so only the apron's outer ring goes by fewer neighbours.
+         */
+        static void RemoveConvergedPixels(const RenderTile&                 tile,
+                                          const std::vector<PixelEstimate>& estimates,
+                                          Real                              threshold,
+                                          std::vector<uint32_t>&            pixels)
+        {
+            std::vector<uint8_t> withinThreshold(estimates.size());
+            for (size_t pixel = 0; pixel < estimates.size(); ++pixel)
+                withinThreshold[pixel] = estimates[pixel].GetError() <= threshold;
+
+            int  width     = tile.GetWidth();
+            int  height    = tile.YEnd - tile.YStart;
+            auto converged = [&](uint32_t pixel) {
+                int x = pixel % width;
+                int y = pixel / width;
+                for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ++ny)
+                    for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); ++nx)
+                        if (!withinThreshold[ny * width + nx])
+                            return false;
+                return true;
+            };
+            pixels.erase(std::remove_if(pixels.begin(), pixels.end(), converged), pixels.end());
+        }
+
+        // Paths per wave of the wavefront integrator, higher sample counts are traced in several waves per round.
+        static constexpr uint32_t WavefrontPathCount = 1 << 14;
+
+        struct WavefrontPath
+        {
+            PathState Path;
+            uint32_t  Pixel; // Of the tile
+            uint32_t  SampleIndex;
+        };
+
+        struct WavefrontHit
+        {
+            SurfaceHit Hit;
+            HitRecord  Record;
+            uint32_t   Path; // Index into the wave
+        };
+
+        // Moves the sampler to the pixel sample and returns its camera ray.
+        static Ray GenerateCameraRay(
+            const Camera& camera, const RenderTile& tile, uint32_t pixel, uint32_t sampleIndex, Sampler& sampler)
         {
-            HitRecord rec;
+            uint32_t x = tile.GetX(pixel);
+            uint32_t y = tile.GetY(pixel);
+            sampler.StartPixelSample(x, y, sampleIndex);
+            Sample2D film = sampler.Get2D();
+            Real     u    = (x + film.X) / (tile.FrameBufferWidth - 1);
+            Real     v    = (y + film.Y) / (tile.FrameBufferHeight - 1);
+            return camera.GetRay(u, v, sampler);
+        }
 
-            // If we've exceeded the ray bounce limit, no more light is gathered.
-            if (depth <= 0)
+        // Adds the samples [firstSample, lastSample) of the given pixels of the tile to their estimates, path by path.
+        void TraceDepthFirst(const Camera&                     camera,
+                             const Scene&                      scene,
+                             const EnvironmentLight&           environment,
+                             const RenderQualityConfiguration& quality,
+                             const RenderTile&                 tile,
+                             const std::vector<uint32_t>&      pixels,
+                             uint32_t                          firstSample,
+                             uint32_t                          lastSample,
+                             Sampler&                          sampler,
+                             std::vector<PixelEstimate>&       estimates)
+        {
+            for (uint32_t pixel : pixels)
             {
-                return Black;
+                for (uint32_t s = firstSample; s < lastSample; ++s)
+                {
+                    Ray r = GenerateCameraRay(camera, tile, pixel, s, sampler);
+                    estimates[pixel].Add(
+                        GetRayColor(r, environment, scene, quality.MaxDepth, quality.MinDepth, sampler));
+                }
+            }
+        }
+
+        /*
+         * Traces a path iteratively, carrying the throughput (the product of the attenuations so far) and the radiance
+         * gathered along it. After minDepth bounces Russian roulette ends paths with a probability that grows as their
+         * throughput drops, and survivors are reweighted so the estimate stays unbiased. maxDepth is a hard limit.
+         *
+         * At vertices whose material has a pdf, the direct light is estimated both by sampling a point on a light and
+         * tracing a shadow ray to it, and by the scattered ray hitting a light. The two are weighted against each other
+         * with the power heuristic, so each dominates where the other one is noisy (small lights, glossy surfaces).
+         * An environment image counts as one more light, sampled half of the time when the scene has lights too.
+         */
+        Color GetRayColor(const Ray&              r,
+                          const EnvironmentLight& environment,
+                          const Scene&            scene,
+                          uint32_t                maxDepth,
+                          uint32_t                minDepth,
+                          Sampler&                sampler)
+        {
+            PathState path;
+            path.CurrentRay = r;
+
+            for (uint32_t bounce = 0; bounce < maxDepth; ++bounce)
+            {
+                // Secondary rays are spawned off the surface by HitRecord::SpawnRay, so no epsilon is needed here.
+                SurfaceHit hit;
+                if (!scene.World.Intersect(path.CurrentRay, 0, Infinity, hit))
+                {
+                    AddEnvironmentLight(path, environment, scene);
+                    break;
+                }
+
+                HitRecord rec;
+                hit.ComputeSurfaceInteraction(path.CurrentRay, rec);
+
+                DirectLightSample direct;
+                bool              scattered =
+                    ShadePathVertex(path, hit, rec, scene, environment, bounce, minDepth, sampler, direct);
+                if (IsUnoccluded(direct, scene))
+                    path.Radiance += direct.Radiance;
+
+                if (!scattered)
+                    break;
+            }
+
+            return path.Radiance;
+        }
+
+        /*
+         * The same as TraceDepthFirst, but instead of following one path to its end, a wave of paths advances one
+         * bounce at a time: all rays of the wave are intersected, the hits are grouped by material type and shaded
+         * group by group, the shadow rays of the wave are traced together, and the paths that scattered form the next
+         * wave. Each stage is one tight loop over many rays running the same code, rather than traversal, shading and
+         * texture lookups taking turns for a single ray.
+         *
+         * After the first bounce the rays of a wave point every which way. With SortRays they are binned by direction
+         * octant and then by origin along a Z-curve before they are intersected, so consecutive rays walk similar parts
+         * of the BVH while its nodes are still cached. The cache misses of the intersection loop alone are added to the
+         * TraversalStats.
+         *
+         * The sampler is moved to a path's pixel sample and bounce before shading it, so the sample values, and with
+         * them the image, match the depth-first integrator up to the order the samples of a pixel are summed in.
+         */
+        void TraceWavefront(const Camera&                     camera,
+                            const Scene&                      scene,
+                            const EnvironmentLight&           environment,
+                            const RenderQualityConfiguration& quality,
+                            const RenderTile&                 tile,
+                            const std::vector<uint32_t>&      pixels,
+                            uint32_t                          firstSample,
+                            uint32_t                          lastSample,
+                            Sampler&                          sampler,
+                            std::vector<PixelEstimate>&       estimates)
+        {
+            static thread_local CacheMissCounter cacheMissCounter;
+
+            uint32_t pixelCount     = static_cast<uint32_t>(pixels.size());
+            uint32_t samplesPerWave = std::max<uint32_t>(1, WavefrontPathCount / std::max<uint32_t>(1, pixelCount));
+            size_t   typeCount      = scene.Materials.GetTypeCount();
+
+            // The queues keep their capacity from one call to the next, every round of every tile reuses them.
+            static thread_local std::vector<WavefrontPath>     paths;
+            static thread_local std::vector<uint32_t>          activePaths; // The paths still being traced
+            static thread_local std::vector<uint64_t>          sortKeys;
+            static thread_local std::vector<WavefrontHit>      hits;
+            static thread_local std::vector<uint32_t>          escapedPaths;
+            static thread_local std::vector<uint32_t>          shadingOrder;
+            static thread_local std::vector<uint32_t>          typeOffsets;
+            static thread_local std::vector<uint8_t>           scattered;
+            static thread_local std::vector<DirectLightSample> shadowRays;
+            static thread_local std::vector<uint32_t>          shadowRayPaths;
+            typeOffsets.resize(typeCount + 1);
+
+            auto startPathSample = [&](const WavefrontPath& path) {
+                sampler.StartPixelSample(tile.GetX(path.Pixel), tile.GetY(path.Pixel), path.SampleIndex);
+            };
+
+            for (uint32_t waveStart = firstSample; waveStart < lastSample; waveStart += samplesPerWave)
+            {
+                // Camera rays, sample by sample so neighboring paths start from neighboring pixels
+                uint32_t waveEnd = std::min(waveStart + samplesPerWave, lastSample);
+                paths.clear();
+                activePaths.clear();
+                for (uint32_t s = waveStart; s < waveEnd; ++s)
+                {
+                    for (uint32_t pixel : pixels)
+                    {
+                        WavefrontPath path;
+                        path.Path.CurrentRay = GenerateCameraRay(camera, tile, pixel, s, sampler);
+                        path.Pixel           = pixel;
+                        path.SampleIndex     = s;
+                        activePaths.push_back(static_cast<uint32_t>(paths.size()));
+                        paths.push_back(path);
+                    }
+                }
+
+                for (uint32_t bounce = 0; bounce < quality.MaxDepth && !activePaths.empty(); ++bounce)
+                {
+                    // Camera rays are coherent already, they start out in pixel order
+                    if (quality.SortRays && bounce > 0)
+                        SortRays(paths, activePaths, sortKeys);
+
+                    // Intersect the wave, nothing else runs between the counter reads
+                    uint64_t cacheMisses = cacheMissCounter.Read();
+                    hits.clear();
+                    escapedPaths.clear();
+                    for (uint32_t i : activePaths)
+                    {
+                        WavefrontHit hit;
+                        if (scene.World.Intersect(paths[i].Path.CurrentRay, 0, Infinity, hit.Hit))
+                        {
+                            hit.Path = i;
+                            hits.push_back(hit);
+                        }
+                        else
+                        {
+                            escapedPaths.push_back(i);
+                        }
+                    }
+
+                    if (bounce > 0)
+                    {
+                        m_SecondaryRayCount[quality.SortRays] += activePaths.size();
+                        m_SecondaryRayCacheMisses[quality.SortRays] += cacheMissCounter.Read() - cacheMisses;
+                    }
+
+                    // Paths that left the scene pick up the environment and end
+                    for (uint32_t i : escapedPaths)
+                    {
+                        AddEnvironmentLight(paths[i].Path, environment, scene);
+                        estimates[paths[i].Pixel].Add(paths[i].Path.Radiance);
+                    }
+
+                    // Surface interactions, then a counting sort of the hits by material type
+                    std::fill(typeOffsets.begin(), typeOffsets.end(), 0);
+                    for (WavefrontHit& hit : hits)
+                    {
+                        hit.Hit.ComputeSurfaceInteraction(paths[hit.Path].Path.CurrentRay, hit.Record);
+                        ++typeOffsets[scene.Materials.GetTypeIndex(hit.Record.MaterialID) + 1];
+                    }
+
+                    for (size_t type = 0; type < typeCount; ++type)
+                        typeOffsets[type + 1] += typeOffsets[type];
+
+                    shadingOrder.resize(hits.size());
+                    for (uint32_t i = 0; i < hits.size(); ++i)
+                        shadingOrder[typeOffsets[scene.Materials.GetTypeIndex(hits[i].Record.MaterialID)]++] = i;
+
+                    // Shade one material type after the other, queueing shadow rays for the direct lighting
+                    scattered.assign(hits.size(), 0);
+                    shadowRays.clear();
+                    shadowRayPaths.clear();
+                    for (uint32_t i : shadingOrder)
+                    {
+                        const WavefrontHit& hit  = hits[i];
+                        WavefrontPath&      path = paths[hit.Path];
+                        startPathSample(path);
+
+                        DirectLightSample direct;
+                        scattered[i] = ShadePathVertex(path.Path,
+                                                       hit.Hit,
+                                                       hit.Record,
+                                                       scene,
+                                                       environment,
+                                                       bounce,
+                                                       quality.MinDepth,
+                                                       sampler,
+                                                       direct);
+                        if (MaxComponent(direct.Radiance) > 0)
+                        {
+                            shadowRays.push_back(direct);
+                            shadowRayPaths.push_back(hit.Path);
+                        }
+                    }
+
+                    for (uint32_t i = 0; i < shadowRays.size(); ++i)
+                    {
+                        if (IsUnoccluded(shadowRays[i], scene))
+                            paths[shadowRayPaths[i]].Path.Radiance += shadowRays[i].Radiance;
+                    }
+
+                    // The paths that scattered form the next wave
+                    activePaths.clear();
+                    for (uint32_t i = 0; i < hits.size(); ++i)
+                    {
+                        const WavefrontPath& path = paths[hits[i].Path];
+                        if (scattered[i])
+                            activePaths.push_back(hits[i].Path);
+                        else
+                            estimates[path.Pixel].Add(path.Path.Radiance);
+                    }
+                }
+
+                // Paths still alive after MaxDepth bounces
+                for (uint32_t i : activePaths)
+                    estimates[paths[i].Pixel].Add(paths[i].Path.Radiance);
+            }
+        }
+
+        /*
+         * Orders activePaths by the direction octant of their rays, then by the Morton code of the ray origins on a
+         * 512^3 grid over their bounds. Octant, Morton code and path index are packed into one 64-bit sort key.
+         */
+        static void SortRays(const std::vector<WavefrontPath>& paths,
+                             std::vector<uint32_t>&            activePaths,
+                             std::vector<uint64_t>&            sortKeys)
+        {
+            Point3 boundsMin = paths[activePaths[0]].Path.CurrentRay.Origin();
+            Point3 boundsMax = boundsMin;
+            for (uint32_t i : activePaths)
+            {
+                boundsMin = Min(boundsMin, paths[i].Path.CurrentRay.Origin());
+                boundsMax = Max(boundsMax, paths[i].Path.CurrentRay.Origin());
+            }
+
+            constexpr Real GridSize = 1 << 9;
+            Vector3        extent   = boundsMax - boundsMin;
+            Vector3        scale(extent.x() > 0 ? GridSize / extent.x() : 0,
+                                 extent.y() > 0 ? GridSize / extent.y() : 0,
+                                 extent.z() > 0 ? GridSize / extent.z() : 0);
+
+            auto quantize = [](Real v) { return static_cast<uint32_t>(std::min<Real>(v, GridSize - 1)); };
+
+            sortKeys.clear();
+            for (uint32_t i : activePaths)
+            {
+                const Ray& ray       = paths[i].Path.CurrentRay;
+                Vector3    direction = ray.Direction();
+                Vector3    cell      = (ray.Origin() - boundsMin) * scale;
+
+                uint64_t octant = (direction.x() < 0) | (direction.y() < 0) << 1 | (direction.z() < 0) << 2;
+                uint64_t morton = EncodeMorton3(quantize(cell.x()), quantize(cell.y()), quantize(cell.z()));
+                sortKeys.push_back((octant << 59) | (morton << 32) | i);
+            }
+
+            std::sort(sortKeys.begin(), sortKeys.end());
+            for (size_t i = 0; i < sortKeys.size(); ++i)
+                activePaths[i] = static_cast<uint32_t>(sortKeys[i]);
+        }
+
+        // How often direct lighting samples the environment image rather than the lights of the scene.
+        static Real GetEnvironmentProbability(const EnvironmentLight& environment, const Scene& scene)
+        {
+            if (!environment.HasImage())
+                return 0;
+
+            return scene.World.GetLightCount() > 0 ? 0.5 : 1;
+        }
+
+        // Adds the light of the environment to a path that left the scene.
+        static void AddEnvironmentLight(PathState& path, const EnvironmentLight& environment, const Scene& scene)
+        {
+            Real  environmentProbability = GetEnvironmentProbability(environment, scene);
+            Color background             = environment.GetRadiance(path.CurrentRay.Direction());
+            if (path.ScatterPdf > 0 && environmentProbability > 0)
+            {
+                Real lightPdf = environmentProbability * environment.Pdf(path.CurrentRay.Direction());
+                background *= PowerHeuristic(path.ScatterPdf, lightPdf);
+            }
+
+            path.Radiance += path.Throughput * background;
+        }
+
+        /*
+         * Shades the vertex where the path hit the scene: adds the light the surface emits, prepares direct lighting
+         * (its shadow ray is left to the caller, so it can be traced right away or batched) and scatters the path into
+         * its next ray, ending it by Russian roulette after minDepth bounces. Returns false if the path ends here.
+         */
+        bool ShadePathVertex(PathState&              path,
+                             const SurfaceHit&       hit,
+                             const HitRecord&        rec,
+                             const Scene&            scene,
+                             const EnvironmentLight& environment,
+                             uint32_t                bounce,
+                             uint32_t                minDepth,
+                             Sampler&                sampler,
+                             DirectLightSample&      direct)
+        {
+            Real environmentProbability = GetEnvironmentProbability(environment, scene);
+            bool hasLights              = environmentProbability > 0 || scene.World.GetLightCount() > 0;
+
+            const Material& material = scene.Materials.Get(rec.MaterialID);
+            if (material.IsEmissive())
+            {
+                Color emitted = material.Emitted(rec.U, rec.V, rec.Point);
+                if (path.ScatterPdf > 0)
+                {
+                    Real lightPdf = (1 - environmentProbability) *
+                                    scene.World.LightPdf(path.ScatterPoint, path.ScatterNormal, hit, rec.Point);
+                    emitted *= PowerHeuristic(path.ScatterPdf, lightPdf);
+                }
+
+                path.Radiance += path.Throughput * emitted;
             }
 
-            if (!world.Hit(r, 0.001, Infinity, rec))
+            bool sampleLights = material.HasPdf() && hasLights;
+            if (sampleLights)
             {
-                return backgroundColor;
+                if (SampleDirectLighting(path.CurrentRay, rec, material, scene, environment, bounce, sampler, direct))
+                    direct.Radiance = path.Throughput * direct.Radiance;
             }
 
             Ray   scattered;
             Color attenuation;
-            Color emitted = rec.MaterialPtr->Emitted(rec.U, rec.V, rec.Point);
+            sampler.StartBounce(bounce);
+            if (!material.Scatter(path.CurrentRay, rec, attenuation, scattered, sampler))
+                return false;
+
+            Real scatterPdf = sampleLights ? material.Pdf(path.CurrentRay, rec, Normalize(scattered.Direction())) : 0;
+
+            path.ScatterPdf    = scatterPdf;
+            path.ScatterPoint  = rec.Point;
+            path.ScatterNormal = rec.Normal;
+            path.Throughput    = path.Throughput * attenuation;
+            path.CurrentRay    = scattered;
+
+            if (bounce + 1 >= minDepth)
+            {
+                Real maxThroughput = MaxComponent(path.Throughput);
+                if (maxThroughput < 1)
+                {
+                    sampler.StartBounce(bounce, Sampler::RussianRouletteDimension);
+                    if (sampler.Get1D() >= maxThroughput)
+                        return false;
+
+                    path.Throughput /= maxThroughput;
+                }
+            }
+
+            return true;
+        }
+
+        /*
+         * Samples one point on a light or the environment for the direct light arriving at rec. Returns false if the
+         * sample carries no light, otherwise direct holds the shadow ray and the MIS weighted radiance it would add.
+         */
+        bool SampleDirectLighting(const Ray&              ray,
+                                  const HitRecord&        rec,
+                                  const Material&         material,
+                                  const Scene&            scene,
+                                  const EnvironmentLight& environment,
+                                  uint32_t                bounce,
+                                  Sampler&                sampler,
+                                  DirectLightSample&      direct)
+        {
+            // Shadow rays stop short of the sampled point, so they don't hit the light they are aimed at.
+            constexpr Real ShadowEpsilon = 0.0001;
+
+            sampler.StartBounce(bounce, Sampler::LightSampleDimension);
+            Real     uLight = sampler.Get1D();
+            Sample2D u      = sampler.Get2D();
+
+            Real    environmentProbability = GetEnvironmentProbability(environment, scene);
+            Vector3 toLight;
+            Color   emitted;
+            Real    pdf;
+            Real    tMax;
+            if (uLight < environmentProbability)
+            {
+                if (!environment.Sample(u, toLight, emitted, pdf))
+                    return false;
+
+                pdf *= environmentProbability;
+                tMax = Infinity;
+            }
+            else
+            {
+                uLight = std::min((uLight - environmentProbability) / (1 - environmentProbability), OneMinusEpsilon);
+
+                ShapeSample lightSample;
+                if (!scene.World.SampleLight(rec.Point, rec.Normal, uLight, u, lightSample))
+                    return false;
+
+                const Material& light = scene.Materials.Get(lightSample.MaterialID);
+                toLight               = lightSample.Point - rec.Point;
+                emitted               = light.Emitted(lightSample.U, lightSample.V, lightSample.Point);
+                pdf                   = lightSample.Pdf * (1 - environmentProbability);
+                tMax                  = 1 - ShadowEpsilon;
+            }
+
+            Vector3 direction = Normalize(toLight);
+            Color   f         = material.Eval(ray, rec, direction);
+            if (MaxComponent(f) <= 0)
+                return false;
+
+            Real weight      = PowerHeuristic(pdf, material.Pdf(ray, rec, direction));
+            direct.ShadowRay = rec.SpawnRay(toLight, ray.Time());
+            direct.TMax      = tMax;
+            direct.Radiance  = (weight / pdf) * f * emitted;
+            return true;
+        }
+
+        // False for samples without radiance, so callers can skip their shadow rays.
+        static bool IsUnoccluded(const DirectLightSample& direct, const Scene& scene)
+        {
+            if (MaxComponent(direct.Radiance) <= 0)
+                return false;
+
+            SurfaceHit occluder;
+            return !scene.World.Intersect(direct.ShadowRay, 0, direct.TMax, occluder);
+        }
+
+        /*
+         * Environment images are loaded the first time a render names them and cached by file name. A file that fails
+         * to load is cached too, without an image, so it isn't read and reported again, and falls back to the
+         * background color.
+         */
+        std::shared_ptr<const EnvironmentLight> GetEnvironment(const RenderConfiguration& config)
+        {
+            if (config.EnvironmentMap.empty())
+                return std::make_shared<EnvironmentLight>(config.BackgroundColor);
+
+            auto it = m_EnvironmentCache.find(config.EnvironmentMap);
+            if (it == m_EnvironmentCache.end())
+            {
+                auto environment = std::make_shared<EnvironmentLight>(config.EnvironmentMap.c_str());
+                it               = m_EnvironmentCache.emplace(config.EnvironmentMap, environment).first;
+            }
+
+            if (!it->second->HasImage())
+                return std::make_shared<EnvironmentLight>(config.BackgroundColor);
+
+            return it->second;
+        }
+
+        std::shared_ptr<const Scene> GetScene(uint32_t sceneID)
+        {
+            auto it = m_SceneCache.find(sceneID);
+            if (it != m_SceneCache.end())
+            {
+                return it->second;
+            }
+
+            // Scene construction draws random numbers too, use a fixed stream so a scene always looks the same.
+            GetThreadRNG().SetSequence(sceneID);
 
-            if (!rec.MaterialPtr->Scatter(r, rec, attenuation, scattered))
+            auto scene = std::make_shared<Scene>();
+            switch (sceneID)
             {
-                return emitted;
+                case 0: {
+                    InitRandomScene(*scene);
+                    break;
+                }
+
+                case 1: {
+                    InitSimpleCornellBox(*scene);
+                    break;
+                }
+
+                default:
+                    break;
             }
 
-            return emitted + attenuation * GetRayColor(scattered, backgroundColor, world, depth - 1);
+            scene->World = CompiledScene(scene->Objects, scene->Materials, scene->Arena, 0, 1);
+            scene->Objects.Clear();
+
+            m_SceneCache[sceneID] = scene;
+            return scene;
         }
 
-        void InitRandomScene()
+        void InitRandomScene(Scene& scene)
         {
-            auto checker = std::make_shared<CheckerTexture>(Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
-            m_World.Add(std::make_shared<Sphere>(Point3(0, -1000, 0), 1000, std::make_shared<Lambertian>(checker)));
+            HittableList&  world     = scene.Objects;
+            MaterialTable& materials = scene.Materials;
+            MemoryArena&   arena     = scene.Arena;
+
+            auto     even   = arena.MakeShared<SolidColor>(Color(0.2, 0.3, 0.1));
+            auto     odd    = arena.MakeShared<SolidColor>(Color(0.9, 0.9, 0.9));
+            uint32_t ground = materials.Add(arena.MakeShared<Lambertian>(arena.MakeShared<CheckerTexture>(even, odd)));
+            world.Add(std::make_shared<Sphere>(Point3(0, -1000, 0), 1000, ground));
 
+            std::vector<SphereGroup::Entry> smallSpheres;
             for (int a = -11; a < 11; a++)
             {
                 for (int b = -11; b < 11; b++)
                 {
-                    double materialChosen = GetRandomDouble();
-                    Point3 center(a + 0.9 * GetRandomDouble(), 0.2, b + 0.9 * GetRandomDouble());
+                    Real   materialChosen = GetRandomReal();
+                    Point3 center(a + 0.9 * GetRandomReal(), 0.2, b + 0.9 * GetRandomReal());
 
                     if ((center - Point3(4, 0.2, 0)).Length() > 0.9)
                     {
@@ -1623,64 +6336,121 @@ namespace VRaytracer
                         {
                             // Diffuse
                             Color albedo   = Color::GetRandom() * Color::GetRandom();
-                            materialSphere = std::make_shared<Lambertian>(albedo);
+                            materialSphere = arena.MakeShared<Lambertian>(arena.MakeShared<SolidColor>(albedo));
                         }
                         else if (materialChosen < 0.95)
                         {
                             // Metal
-                            Color  albedo  = Color::GetRandom(0.5, 1);
-                            double fuzz    = GetRandomDouble(0, 0.5);
-                            materialSphere = std::make_shared<Metal>(albedo, fuzz);
+                            Color albedo   = Color::GetRandom(0.5, 1);
+                            Real  fuzz     = GetRandomReal(0, 0.5);
+                            materialSphere = arena.MakeShared<Metal>(albedo, fuzz);
                         }
                         else
                         {
                             // Glass
-                            materialSphere = std::make_shared<Dielectric>(1.5);
+                            materialSphere = arena.MakeShared<Dielectric>(1.5);
                         }
 
-                        m_World.Add(std::make_shared<Sphere>(center, 0.2, materialSphere));
+                        smallSpheres.push_back({center, 0.2, materials.Add(materialSphere)});
                     }
                 }
             }
 
-            auto material1 = std::make_shared<Dielectric>(1.5);
-            m_World.Add(std::make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
+            AddSphereGroups(world, std::move(smallSpheres));
 
-            auto material2 = std::make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
-            m_World.Add(std::make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
+            uint32_t material1 = materials.Add(arena.MakeShared<Dielectric>(1.5));
+            world.Add(std::make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
 
-            auto material3 = std::make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
-            m_World.Add(std::make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
+            auto     albedo2   = arena.MakeShared<SolidColor>(Color(0.4, 0.2, 0.1));
+            uint32_t material2 = materials.Add(arena.MakeShared<Lambertian>(albedo2));
+            world.Add(std::make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
+
+            uint32_t material3 = materials.Add(arena.MakeShared<Metal>(Color(0.7, 0.6, 0.5), 0.0));
+            world.Add(std::make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
         }
 
-        void InitSimpleCornellBox()
+        void InitSimpleCornellBox(Scene& scene)
         {
-            auto red   = std::make_shared<Lambertian>(Color(.65, .05, .05));
-            auto white = std::make_shared<Lambertian>(Color(.73, .73, .73));
-            auto green = std::make_shared<Lambertian>(Color(.12, .45, .15));
-            auto light = std::make_shared<DiffuseLight>(Color(15, 15, 15));
+            HittableList&  world     = scene.Objects;
+            MaterialTable& materials = scene.Materials;
+            MemoryArena&   arena     = scene.Arena;
+
+            auto diffuse = [&](const Color& albedo) {
+                return materials.Add(arena.MakeShared<Lambertian>(arena.MakeShared<SolidColor>(albedo)));
+            };
 
-            m_World.Add(std::make_shared<YZRect>(0, 555, 0, 555, 555, green));
-            m_World.Add(std::make_shared<YZRect>(0, 555, 0, 555, 0, red));
-            m_World.Add(std::make_shared<XZRect>(213, 343, 227, 332, 554, light));
-            m_World.Add(std::make_shared<XZRect>(0, 555, 0, 555, 0, white));
-            m_World.Add(std::make_shared<XZRect>(0, 555, 0, 555, 555, white));
-            m_World.Add(std::make_shared<XYRect>(0, 555, 0, 555, 555, white));
+            uint32_t red      = diffuse(Color(.65, .05, .05));
+            uint32_t white    = diffuse(Color(.73, .73, .73));
+            uint32_t green    = diffuse(Color(.12, .45, .15));
+            auto     emission = arena.MakeShared<SolidColor>(Color(15, 15, 15));
+            uint32_t light    = materials.Add(arena.MakeShared<DiffuseLight>(emission));
+
+            // Parallel walls share one group, the light stays a rect of its own so it can be sampled directly.
+            auto sideWalls = std::make_shared<AxisAlignedRectGroup<0>>();
+            sideWalls->Add(YZRect(0, 555, 0, 555, 555, green));
+            sideWalls->Add(YZRect(0, 555, 0, 555, 0, red));
+            world.Add(sideWalls);
+
+            world.Add(std::make_shared<XZRect>(213, 343, 227, 332, 554, light));
+
+            auto floorAndCeiling = std::make_shared<AxisAlignedRectGroup<1>>();
+            floorAndCeiling->Add(XZRect(0, 555, 0, 555, 0, white));
+            floorAndCeiling->Add(XZRect(0, 555, 0, 555, 555, white));
+            world.Add(floorAndCeiling);
+
+            world.Add(std::make_shared<XYRect>(0, 555, 0, 555, 555, white));
+
+            // The blocks are instances, which World keeps referring to, so they go into the arena with their contents.
+            // The tall block is a triangle mesh, so the mesh kernel is part of the built-in scenes too.
+            auto                      tallBlock = CreateBoxMesh(Point3(0, 0, 0), Point3(165, 330, 165));
+            std::shared_ptr<Hittable> box1      = arena.MakeShared<TriangleMesh>(tallBlock, white, arena);
+            box1                                = arena.MakeShared<RotateY>(box1, 15);
+            box1                                = arena.MakeShared<Translate>(box1, Vector3(265, 0, 295));
+            world.Add(box1);
+
+            std::shared_ptr<Hittable> box2 = arena.MakeShared<Box>(Point3(0, 0, 0), Point3(165, 165, 165), white);
+            box2                           = arena.MakeShared<RotateY>(box2, -18);
+            box2                           = arena.MakeShared<Translate>(box2, Vector3(130, 0, 65));
+            world.Add(box2);
+        }
 
-            std::shared_ptr<Hittable> box1 = std::make_shared<Box>(Point3(0, 0, 0), Point3(165, 330, 165), white);
-            box1                           = std::make_shared<RotateY>(box1, 15);
-            box1                           = std::make_shared<Translate>(box1, Vector3(265, 0, 295));
-            m_World.Add(box1);
+        // The 12 triangles of the axis-aligned box spanned by p0 and p1, wound counter-clockwise seen from outside.
+        static TriangleMeshData CreateBoxMesh(const Point3& p0, const Point3& p1)
+        {
+            TriangleMeshData data;
+            for (int corner = 0; corner < 8; ++corner)
+            {
+                data.Positions.push_back(Point3(corner & 1 ? p1.x() : p0.x(),
+                                                corner & 2 ? p1.y() : p0.y(),
+                                                corner & 4 ? p1.z() : p0.z()));
+            }
 
-            std::shared_ptr<Hittable> box2 = std::make_shared<Box>(Point3(0, 0, 0), Point3(165, 165, 165), white);
-            box2                           = std::make_shared<RotateY>(box2, -18);
-            box2                           = std::make_shared<Translate>(box2, Vector3(130, 0, 65));
-            m_World.Add(box2);
+            // Corners in counter-clockwise order per face, corner bits are (z, y, x).
+            const uint32_t faces[6][4] = {
+                {0, 4, 6, 2}, // -x
+                {1, 3, 7, 5}, // +x
+                {0, 1, 5, 4}, // -y
+                {2, 6, 7, 3}, // +y
+                {0, 2, 3, 1}, // -z
+                {4, 5, 7, 6}, // +z
+            };
+            for (const auto& face : faces)
+            {
+                data.Indices.insert(data.Indices.end(), {face[0], face[1], face[2], face[0], face[2], face[3]});
+            }
+            return data;
         }
 
     private:
-        std::shared_ptr<FrameBuffer> m_FrameBuffer;
-        HittableList                 m_World;
-        Camera                       m_Camera;
+        std::shared_ptr<FrameBuffer>                                             m_FrameBuffer;
+        std::unordered_map<uint32_t, std::shared_ptr<const Scene>>               m_SceneCache;
+        std::unordered_map<std::string, std::shared_ptr<const EnvironmentLight>> m_EnvironmentCache;
+        Camera                                                                   m_Camera;
+        std::atomic<uint64_t>                                                    m_PixelSampleCount{0};
+        std::atomic<uint64_t>                                                    m_ApronSampleCount{0};
+        // The secondary ray counts are indexed by RenderQualityConfiguration::SortRays
+        std::atomic<uint64_t>                                                    m_SecondaryRayCount[2]{};
+        std::atomic<uint64_t>                                                    m_SecondaryRayCacheMisses[2]{};
+        bool                                                                     m_CacheMissCounterAvailable;
     };
 } // namespace VRaytracer
\ No newline at end of file
@@ -0,0 +1,3 @@
+// Compiles the stb_image implementation once, everything else includes the header for the declarations only.
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
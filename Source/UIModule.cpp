@@ -23,6 +23,9 @@ namespace VRaytracer
 {
     const char* UIModule::s_Scenes[] = {"RandomScene", "SimpleCornellBox"};
 
+    // ImGui data type matching the precision the core was built with.
+    static const ImGuiDataType RealDataType = std::is_same_v<Real, float> ? ImGuiDataType_Float : ImGuiDataType_Double;
+
     bool UIModule::Init()
     {
         // Decide GL+GLSL versions
@@ -69,8 +72,9 @@ namespace VRaytracer
         auto sceneConfig = ConfigLoader::LoadBuiltinScene(s_Scenes[0]);
         if (sceneConfig != nullptr)
         {
-            std::memcpy(&m_RenderConfig.CameraConfig, &sceneConfig->CameraConfig, sizeof(CameraConfiguration));
-            std::memcpy(&m_RenderConfig.BackgroundColor, &sceneConfig->BackgroundColor, sizeof(Color));
+            m_RenderConfig.CameraConfig    = ToRenderConfig(sceneConfig->CameraConfig);
+            m_RenderConfig.BackgroundColor = ToVector3(sceneConfig->BackgroundColor);
+            m_RenderConfig.EnvironmentMap  = ToEnvironmentMapPath(sceneConfig->EnvironmentMap);
             m_RenderConfigLastFrame = m_RenderConfig;
         }
 
@@ -189,31 +193,109 @@ namespace VRaytracer
         ImGui::Text("Scene Configuration");
         ImGui::Indent();
         ImGui::Combo("Scene", reinterpret_cast<int*>(&m_RenderConfig.SceneID), s_Scenes, IM_ARRAYSIZE(s_Scenes));
+        MemoryArena::Stats sceneMemory;
+        if (Raytracer::GetCore()->GetSceneMemoryStats(m_RenderConfig.SceneID, sceneMemory))
+        {
+            ImGui::Text("Scene Memory: %.1f KB in %zu allocations",
+                        sceneMemory.BytesUsed / 1024.0,
+                        sceneMemory.AllocationCount);
+
+            // Releases the arenas of the cached scenes, the next render builds its scene again.
+            if (ImGui::Button("Reload Scenes"))
+            {
+                Raytracer::GetCore()->ClearSceneCache();
+            }
+        }
+        if (!m_RenderConfig.EnvironmentMap.empty())
+        {
+            ImGui::Text("Environment Map: %s", FileSystem::GetFileName(m_RenderConfig.EnvironmentMap).c_str());
+        }
         ImGui::Unindent();
 
         // Load Configuration
         if (m_RenderConfigLastFrame.SceneID != m_RenderConfig.SceneID)
         {
             auto sceneConfig = ConfigLoader::LoadBuiltinScene(s_Scenes[m_RenderConfig.SceneID]);
-            std::memcpy(&m_RenderConfig.CameraConfig, &sceneConfig->CameraConfig, sizeof(CameraConfiguration));
-            std::memcpy(&m_RenderConfig.QualityConfig, &sceneConfig->QualityConfig, sizeof(QualityConfiguration));
-            std::memcpy(&m_RenderConfig.BackgroundColor, &sceneConfig->BackgroundColor, sizeof(ColorInfo));
+            m_RenderConfig.CameraConfig    = ToRenderConfig(sceneConfig->CameraConfig);
+            m_RenderConfig.QualityConfig   = ToRenderConfig(sceneConfig->QualityConfig);
+            m_RenderConfig.BackgroundColor = ToVector3(sceneConfig->BackgroundColor);
+            m_RenderConfig.EnvironmentMap  = ToEnvironmentMapPath(sceneConfig->EnvironmentMap);
         }
 
         ImGui::Text("Camera Configuration");
         ImGui::Indent();
-        ImGui::DragScalarN("LookFrom", ImGuiDataType_Double, &m_RenderConfig.CameraConfig.LookFrom, 3);
-        ImGui::DragScalarN("LookAt", ImGuiDataType_Double, &m_RenderConfig.CameraConfig.LookAt, 3);
-        ImGui::DragScalarN("ViewUp", ImGuiDataType_Double, &m_RenderConfig.CameraConfig.ViewUp, 3);
-        ImGui::DragScalar("DistanceToFocus", ImGuiDataType_Double, &m_RenderConfig.CameraConfig.DistanceToFocus);
-        ImGui::DragScalar("Aperture", ImGuiDataType_Double, &m_RenderConfig.CameraConfig.Aperture);
-        ImGui::DragScalar("FOV", ImGuiDataType_Double, &m_RenderConfig.CameraConfig.FOV);
+        ImGui::DragScalarN("LookFrom", RealDataType, &m_RenderConfig.CameraConfig.LookFrom, 3);
+        ImGui::DragScalarN("LookAt", RealDataType, &m_RenderConfig.CameraConfig.LookAt, 3);
+        ImGui::DragScalarN("ViewUp", RealDataType, &m_RenderConfig.CameraConfig.ViewUp, 3);
+        ImGui::DragScalar("DistanceToFocus", RealDataType, &m_RenderConfig.CameraConfig.DistanceToFocus);
+        ImGui::DragScalar("Aperture", RealDataType, &m_RenderConfig.CameraConfig.Aperture);
+        ImGui::DragScalar("FOV", RealDataType, &m_RenderConfig.CameraConfig.FOV);
         ImGui::Unindent();
 
         ImGui::Text("Quality Configuration");
         ImGui::Indent();
-        ImGui::DragScalar("Samples Per Pixel", ImGuiDataType_U32, &m_RenderConfig.QualityConfig.SamplesPerPixel);
+        uint32_t minSamplesPerPixel = 1;
+        ImGui::DragScalar("Samples Per Pixel",
+                          ImGuiDataType_U32,
+                          &m_RenderConfig.QualityConfig.SamplesPerPixel,
+                          1.0f,
+                          &minSamplesPerPixel,
+                          nullptr,
+                          nullptr,
+                          ImGuiSliderFlags_AlwaysClamp);
         ImGui::DragScalar("Max Depth", ImGuiDataType_U32, &m_RenderConfig.QualityConfig.MaxDepth);
+        ImGui::DragScalar("Min Depth", ImGuiDataType_U32, &m_RenderConfig.QualityConfig.MinDepth);
+        ImGui::DragScalar("Error Threshold", RealDataType, &m_RenderConfig.QualityConfig.ErrorThreshold, 0.001f);
+        ImGui::Combo("Sampler",
+                     reinterpret_cast<int*>(&m_RenderConfig.QualityConfig.Sampler),
+                     SamplerTypeNames,
+                     IM_ARRAYSIZE(SamplerTypeNames));
+        ImGui::Combo("Integrator",
+                     reinterpret_cast<int*>(&m_RenderConfig.QualityConfig.Integrator),
+                     IntegratorTypeNames,
+                     IM_ARRAYSIZE(IntegratorTypeNames));
+        if (m_RenderConfig.QualityConfig.Integrator == IntegratorType::Wavefront)
+        {
+            ImGui::Checkbox("Sort Rays", &m_RenderConfig.QualityConfig.SortRays);
+
+            // The last render with sorting and the last one without, render both ways to compare
+            TraversalStats traversal = Raytracer::GetCore()->GetTraversalStats();
+            if (!traversal.CacheMissesCounted)
+            {
+                ImGui::Text("Cache Misses: no hardware counters");
+            }
+            else
+            {
+                auto showMissesPerRay = [](const char* label, const TraversalStats::Counts& counts) {
+                    if (counts.SecondaryRays > 0)
+                    {
+                        ImGui::Text("Cache Misses %s: %.2f per secondary ray",
+                                    label,
+                                    static_cast<double>(counts.CacheMisses) / counts.SecondaryRays);
+                    }
+                    else
+                    {
+                        ImGui::Text("Cache Misses %s: not rendered yet", label);
+                    }
+                };
+                showMissesPerRay("Sorted", traversal.Sorted);
+                showMissesPerRay("Unsorted", traversal.Unsorted);
+            }
+        }
+        uint64_t sampleCount = Raytracer::GetCore()->GetPixelSampleCount();
+        if (sampleCount > 0 && m_RenderTextureWidth > 0 && m_RenderTextureHeight > 0)
+        {
+            ImGui::Text("Samples: %.1f per pixel",
+                        static_cast<double>(sampleCount) / (m_RenderTextureWidth * m_RenderTextureHeight));
+
+            // Traced around the tiles to judge their edge pixels by, on top of the samples per pixel
+            uint64_t apronSampleCount = Raytracer::GetCore()->GetApronSampleCount();
+            if (apronSampleCount > 0)
+            {
+                ImGui::Text("Apron Samples: %.1f per pixel",
+                            static_cast<double>(apronSampleCount) / (m_RenderTextureWidth * m_RenderTextureHeight));
+            }
+        }
         ImGui::Unindent();
 
         m_RenderConfigLastFrame = m_RenderConfig;